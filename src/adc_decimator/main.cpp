@@ -0,0 +1,188 @@
+// Copyright (C) 2018 MS-Cheminformatics LLC
+// Licence: CC BY-NC
+// Author: Toshinobu Hondo, Ph.D.
+// Contact: toshi.hondo@qtplatz.com
+//
+// Host test of the CIC response of adc_decimator: DC gain, 12.4 scaling, passband droop and
+// the nulls at multiples of fs/R, against (sin(pi f R) / (R sin(pi f)))^N.
+
+#include "adc_decimator.hpp"
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+using namespace stm32f103;
+
+namespace {
+
+    std::vector< adc_decimated > outputs;
+
+    void collect( const adc_decimated& y ) { outputs.push_back( y ); }
+
+    int failures = 0;
+
+    void
+    expect( bool condition, const char * what )
+    {
+        if ( !condition ) {
+            std::cout << "\tFAILED: " << what << std::endl;
+            ++failures;
+        }
+    }
+
+    // the first order outputs still see the zero initial state
+    void
+    feed( adc_decimator& d, const std::vector< uint16_t >& x )
+    {
+        outputs.clear();
+        d.unsubscribe( collect );
+        d.subscribe( collect );
+        d.reset();
+        for ( size_t i = 0; i < x.size(); i += 256 )    // in blocks, as the adc stream delivers them
+            d.process( x.data() + i, std::min( size_t( 256 ), x.size() - i ), uint32_t( i ) );
+    }
+
+    std::vector< uint16_t >
+    tone( size_t n, double f, double amplitude, double offset = 2048 )
+    {
+        std::vector< uint16_t > x( n );
+        for ( size_t i = 0; i < n; ++i )
+            x[ i ] = uint16_t( std::lround( offset + amplitude * std::sin( 2 * M_PI * f * i ) ) );
+        return x;
+    }
+
+    double
+    cic_response( double f, uint32_t ratio, uint32_t order )
+    {
+        return std::pow( std::fabs( std::sin( M_PI * f * ratio ) / ( ratio * std::sin( M_PI * f ) ) ), order );
+    }
+
+    // amplitude, in adc counts, of the output component at fo cycles per output sample
+    double
+    amplitude( double fo, size_t skip )
+    {
+        double a = 0, b = 0;
+        const size_t n = outputs.size() - skip;
+        for ( size_t i = skip; i < outputs.size(); ++i ) {
+            a += outputs[ i ].data[ 0 ] * std::cos( 2 * M_PI * fo * i );
+            b += outputs[ i ].data[ 0 ] * std::sin( 2 * M_PI * fo * i );
+        }
+        return 2 * std::sqrt( a * a + b * b ) / n / 16;
+    }
+
+    void
+    dc_gain()
+    {
+        std::cout << "DC gain" << std::endl;
+        const struct { uint32_t ratio; uint8_t order; uint16_t value; } cases [] = {
+            { 1, 1, 1234 }, { 16, 1, 2048 }, { 16, 3, 2048 }, { 64, 3, 4095 }, { 1024, 2, 4095 }, { 32, 4, 4095 }, { 5, 4, 1 } };
+
+        for ( auto& c: cases ) {
+            adc_decimator d;
+            expect( d.configure( 1, c.ratio, c.order ), "configure" );
+            feed( d, std::vector< uint16_t >( c.ratio * 20, c.value ) );
+            expect( outputs.size() == 20, "one output per ratio inputs" );
+            bool exact = true;
+            for ( size_t i = c.order; i < outputs.size(); ++i )
+                exact &= outputs[ i ].data[ 0 ] == uint16_t( c.value << 4 );
+            expect( exact, "unity gain" );
+        }
+    }
+
+    void
+    scaling()
+    {
+        std::cout << "12.4 scaling" << std::endl;
+        adc_decimator d;
+        d.configure( 2, 4, 1 );                     // two interleaved channels
+        feed( d, { 1000, 100, 1001, 101, 1001, 100, 1001, 100
+                   , 1000, 3000, 1000, 3000, 1000, 3000, 1001, 3000 } );
+        expect( outputs.size() == 2, "outputs" );
+        expect( outputs[ 0 ].channels == 2 && outputs[ 0 ].sequence == 0 && outputs[ 1 ].sequence == 1, "sequence" );
+        expect( outputs[ 0 ].data[ 0 ] == 16012 && outputs[ 0 ].data[ 1 ] == 1604, "1000.75, 100.25" );
+        expect( outputs[ 1 ].data[ 0 ] == 16004 && outputs[ 1 ].data[ 1 ] == 48000, "1000.25, 3000" );
+
+        d.configure( 1, 3, 1 );
+        feed( d, { 1, 1, 0 } );                   // 2/3, truncated to 10/16
+        expect( outputs.size() == 1 && outputs[ 0 ].data[ 0 ] == 10, "fraction truncated" );
+    }
+
+    void
+    passband( uint32_t ratio, uint8_t order )
+    {
+        std::cout << "passband droop, R " << ratio << " N " << int( order ) << std::endl;
+        adc_decimator d;
+        expect( d.configure( 1, ratio, order ), "configure" );
+        for ( double fo: { 1.0 / 16, 1.0 / 8, 1.0 / 4, 3.0 / 8 } ) {   // cycles per output sample
+            const double f = fo / ratio;
+            feed( d, tone( ratio * ( 512 + order ), f, 1000 ) );
+            const double measured = amplitude( fo, order ) / 1000;
+            const double expected = cic_response( f, ratio, order );
+            std::cout << "\tf " << std::setw( 6 ) << fo << " fs/R: " << std::fixed << std::setprecision( 4 )
+                      << measured << ", expected " << expected << std::defaultfloat << std::endl;
+            expect( std::fabs( measured - expected ) < 0.002, "droop" );
+        }
+    }
+
+    void
+    alias_rejection( uint32_t ratio, uint8_t order )
+    {
+        std::cout << "alias rejection, R " << ratio << " N " << int( order ) << std::endl;
+        adc_decimator d;
+        expect( d.configure( 1, ratio, order ), "configure" );
+
+        // on the nulls the tone averages out exactly; the output is the offset
+        for ( uint32_t k = 1; k < 4 && k < ratio; ++k ) {
+            feed( d, tone( ratio * 64, double( k ) / ratio, 1000 ) );
+            int deviation = 0;
+            for ( size_t i = order; i < outputs.size(); ++i )
+                deviation = std::max( deviation, std::abs( int( outputs[ i ].data[ 0 ] ) - 2048 * 16 ) );
+            std::cout << "\tf " << k << " fs/R: max deviation " << deviation << "/16" << std::endl;
+            expect( deviation <= 1, "null at k fs/R" );
+        }
+
+        // next to a null, a tone aliases onto fs_out/8 with the attenuation of the response
+        const double f = 1.0 / ratio + 1.0 / ( 8 * ratio );
+        feed( d, tone( ratio * ( 512 + order ), f, 1000 ) );
+        const double measured = amplitude( 1.0 / 8, order ) / 1000;
+        const double expected = cic_response( f, ratio, order );
+        std::cout << "\tf 1.125 fs/R: " << 20 * std::log10( measured ) << " dB, expected "
+                  << 20 * std::log10( expected ) << " dB" << std::endl;
+        expect( std::fabs( measured - expected ) < 0.002, "alias attenuation" );
+    }
+
+    void
+    growth_limit()
+    {
+        std::cout << "register growth limit" << std::endl;
+        adc_decimator d;
+        expect( d.configure( 1, 1024, 2 ) && d.gain() == 1024 * 1024, "12 + 2 * 10 bits" );
+        expect( d.configure( 1, 32, 4 ), "12 + 4 * 5 bits" );
+        expect( !d.configure( 1, 33, 4 ), "12 + 4 * 6 bits" );
+        expect( !d.configure( 1, 1024, 3 ), "12 + 3 * 10 bits" );
+        expect( !d.configure( 1, 1025, 2 ), "12 + 2 * 11 bits" );
+        expect( !d.configure( 1, 16, 5 ) && !d.configure( 1, 16, 0 ) && !d.configure( 1, 0, 1 ), "order, ratio" );
+        expect( !d.configure( 0, 16, 1 ) && !d.configure( 9, 16, 1 ), "channels" );
+        expect( d.ratio() == 32 && d.order() == 4, "rejected configurations keep the last one" );
+    }
+}
+
+int
+main( int argc, char ** argv )
+{
+    dc_gain();
+    scaling();
+    passband( 8, 3 );
+    passband( 16, 4 );
+    passband( 1024, 2 );
+    alias_rejection( 8, 3 );
+    alias_rejection( 32, 2 );
+    growth_limit();
+
+    std::cout << ( failures ? "FAILED " : "passed" );
+    if ( failures )
+        std::cout << failures;
+    std::cout << std::endl;
+    return failures ? 1 : 0;
+}
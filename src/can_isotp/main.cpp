@@ -0,0 +1,315 @@
+// Copyright (C) 2018 MS-Cheminformatics LLC
+// Licence: CC BY-NC
+// Author: Toshinobu Hondo, Ph.D.
+// Contact: toshi.hondo@qtplatz.com
+//
+// Host test of can_isotp: two endpoints over a simulated bxCAN in loopback mode; every frame
+// enqueued is received by both, in order. atomic_jiffies is advanced by the test.
+
+#include "can.hpp"
+#include "can_isotp.hpp"
+#include "stm32f103.hpp"
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <vector>
+
+std::atomic< uint32_t > atomic_jiffies;
+
+namespace {
+
+    std::deque< CanMsg > wire;                        // enqueued, not yet received
+    bool (*tap)( CanMsg& ) = nullptr;                 // sees every frame on its way, false drops it
+
+    struct record {
+        uint8_t pci;
+        uint32_t jiffies;
+    };
+    std::vector< record > trace;                      // frames as they were received
+}
+
+// the parts of can the transport uses
+namespace stm32f103 {
+
+    can::can() {}
+
+    CAN_STATUS can::init( CAN_BASE, uint32_t ) { return CAN_OK; }
+
+    bool
+    can::enqueue( const CanMsg& msg, can_tx_callback )
+    {
+        if ( wire.size() >= CAN_TX_QUEUE_SIZE )
+            return false;
+        wire.push_back( msg );
+        return true;
+    }
+
+    size_t can::tx_pending() const { return wire.size(); }
+
+    size_t
+    can::rx_drain( CanMsg * msgs, size_t n )
+    {
+        size_t count = 0;
+        while ( count < n && !wire.empty() ) {
+            CanMsg msg = wire.front();
+            wire.pop_front();
+            if ( tap && !tap( msg ) )
+                continue;
+            trace.push_back( { msg.Data[ 0 ], atomic_jiffies.load() } );
+            msgs[ count++ ] = msg;
+        }
+        return count;
+    }
+}
+
+using namespace stm32f103;
+
+namespace {
+
+    constexpr can_isotp_config config_a{ 0x7e0, 0x7e8, CAN_ID_STD, 0, 0, 0xcc };
+    constexpr can_isotp_config config_b{ 0x7e8, 0x7e0, CAN_ID_STD, 0, 0, 0xcc };
+
+    uint8_t payload[ 4095 ];
+    uint8_t rx_a[ 8 ];
+    uint8_t rx_b[ 4095 ];
+
+    int failures = 0;
+
+    void
+    expect( bool condition, const char * what )
+    {
+        if ( !condition ) {
+            std::cout << "\tFAILED: " << what << std::endl;
+            ++failures;
+        }
+    }
+
+    can& bus() { return *can_t< CAN1_BASE >::instance(); }
+
+    void
+    reset( size_t size )
+    {
+        wire.clear();
+        trace.clear();
+        tap = nullptr;
+        atomic_jiffies = 0x12345;
+        for ( size_t i = 0; i < size; ++i )
+            payload[ i ] = uint8_t( i * 7 + size );
+    }
+
+    // one jiffy per step: the frames on the wire (one batch), then both endpoints' poll()
+    void
+    run( can_isotp& a, can_isotp& b, uint32_t steps )
+    {
+        std::array< CanMsg, 8 > msgs;
+        while ( steps-- ) {
+            size_t n = bus().rx_drain( msgs );
+            for ( size_t i = 0; i < n; ++i )
+                a.receive( msgs[ i ] ) || b.receive( msgs[ i ] );
+            a.poll();
+            b.poll();
+            ++atomic_jiffies;
+        }
+    }
+
+    size_t
+    count( uint8_t type )
+    {
+        return std::count_if( trace.begin(), trace.end(), [=]( const record& r ){ return ( r.pci & 0xf0 ) == type; } );
+    }
+
+    bool
+    received( const can_isotp& b, size_t size )
+    {
+        return b.rx_ready() && b.rx_size() == size && std::equal( payload, payload + size, b.rx_data() );
+    }
+
+    void
+    single_frame()
+    {
+        std::cout << "single frame" << std::endl;
+        reset( 7 );
+        can_isotp a( bus(), config_a, rx_a, sizeof( rx_a ) ), b( bus(), config_b, rx_b, sizeof( rx_b ) );
+        expect( a.send( payload, 7 ) == ISOTP_OK, "send" );
+        run( a, b, 10 );
+        expect( received( b, 7 ), "payload" );
+        expect( trace.size() == 1 && trace[ 0 ].pci == 0x07, "one SF" );
+        expect( a.send( payload, 0 ) == ISOTP_INVALID && a.send( payload, 4096 ) == ISOTP_INVALID, "size limits" );
+    }
+
+    void
+    segmented( size_t size, uint8_t block_size )
+    {
+        std::cout << "first + consecutive frames, " << size << " bytes, BS " << int( block_size ) << std::endl;
+        reset( size );
+        auto cb = config_b;
+        cb.block_size = block_size;
+        can_isotp a( bus(), config_a, rx_a, sizeof( rx_a ) ), b( bus(), cb, rx_b, sizeof( rx_b ) );
+        expect( a.send( payload, size ) == ISOTP_OK, "send" );
+        expect( a.send( payload, size ) == ISOTP_BUSY, "busy while sending" );
+        run( a, b, 2000 );
+
+        const size_t cfs = ( size - 6 + 6 ) / 7;
+        const size_t fcs = 1 + ( block_size ? ( cfs - 1 ) / block_size : 0 );
+        expect( received( b, size ), "payload" );
+        expect( !a.tx_busy() && a.tx_result() == ISOTP_OK, "tx result" );
+        expect( count( 0x10 ) == 1 && count( 0x20 ) == cfs && count( 0x30 ) == fcs, "frame counts" );
+
+        // sequence numbers run 1..15, 0, 1..
+        uint8_t sn = 1;
+        bool in_order = true;
+        for ( const auto& r: trace ) {
+            if ( ( r.pci & 0xf0 ) == 0x20 ) {
+                in_order &= ( r.pci & 0x0f ) == sn;
+                sn = ( sn + 1 ) & 0x0f;
+            }
+        }
+        expect( in_order, "sequence numbers" );
+    }
+
+    void
+    st_min( uint8_t st, uint32_t min_jiffies )
+    {
+        std::cout << "STmin 0x" << std::hex << int( st ) << std::dec << std::endl;
+        reset( 60 );
+        auto cb = config_b;
+        cb.st_min = st;
+        can_isotp a( bus(), config_a, rx_a, sizeof( rx_a ) ), b( bus(), cb, rx_b, sizeof( rx_b ) );
+        a.send( payload, 60 );
+        run( a, b, 5000 );
+        expect( received( b, 60 ), "payload" );
+
+        uint32_t last = 0, shortest = ~0u;
+        bool first = true;
+        for ( const auto& r: trace ) {
+            if ( ( r.pci & 0xf0 ) != 0x20 )
+                continue;
+            if ( !first )
+                shortest = std::min( shortest, r.jiffies - last );
+            first = false;
+            last = r.jiffies;
+        }
+        expect( shortest >= min_jiffies, "consecutive frames separated by STmin" );
+    }
+
+    // the receiver side is played by hand: flow control frames from 0x7e8
+    CanMsg
+    flow_control( uint8_t status, uint8_t bs = 0, uint8_t st = 0 )
+    {
+        CanMsg msg;
+        msg.ID = config_b.tx_id;
+        msg.IDE = CAN_ID_STD;
+        msg.RTR = CAN_RTR_DATA;
+        msg.DLC = 3;
+        msg.Data[ 0 ] = 0x30 | status;
+        msg.Data[ 1 ] = bs;
+        msg.Data[ 2 ] = st;
+        return msg;
+    }
+
+    void
+    flow_control_wait_overflow()
+    {
+        std::cout << "FC.WAIT, FC.OVFLW" << std::endl;
+        reset( 20 );
+        can_isotp a( bus(), config_a, rx_a, sizeof( rx_a ) );
+        a.send( payload, 20 );
+        wire.clear();
+
+        atomic_jiffies += 9000;
+        a.poll();
+        expect( a.receive( flow_control( 1 ) ), "WAIT accepted" );
+        atomic_jiffies += 9000;                        // 1.8s after FF, 0.9s after WAIT
+        a.poll();
+        expect( a.tx_busy(), "WAIT restarts N_Bs" );
+        a.receive( flow_control( 0 ) );
+        a.poll();
+        expect( wire.size() == 2 && ( wire[ 0 ].Data[ 0 ] & 0xf0 ) == 0x20, "CTS releases the CFs" );
+        expect( !a.tx_busy() && a.tx_result() == ISOTP_OK, "done" );
+
+        reset( 20 );
+        a.send( payload, 20 );
+        a.receive( flow_control( 2 ) );
+        expect( !a.tx_busy() && a.tx_result() == ISOTP_OVERFLOW, "OVFLW aborts" );
+
+        reset( 20 );
+        a.send( payload, 20 );
+        a.receive( flow_control( 5 ) );
+        expect( !a.tx_busy() && a.tx_result() == ISOTP_INVALID, "reserved flow status aborts" );
+
+        // a receiver without room answers the FF with OVFLW
+        reset( 200 );
+        uint8_t small[ 100 ];
+        can_isotp b( bus(), config_b, small, sizeof( small ) );
+        a.send( payload, 200 );
+        run( a, b, 100 );
+        expect( a.tx_result() == ISOTP_OVERFLOW && b.rx_result() == ISOTP_OVERFLOW && !b.rx_ready(), "receiver overflow" );
+    }
+
+    void
+    wrong_sequence_number()
+    {
+        std::cout << "wrong SN" << std::endl;
+        reset( 100 );
+        can_isotp a( bus(), config_a, rx_a, sizeof( rx_a ) ), b( bus(), config_b, rx_b, sizeof( rx_b ) );
+        tap = []( CanMsg& msg ) {
+            if ( msg.Data[ 0 ] == 0x23 )
+                msg.Data[ 0 ] = 0x24;
+            return true;
+        };
+        a.send( payload, 100 );
+        run( a, b, 100 );
+        expect( !b.rx_ready() && b.rx_result() == ISOTP_WRONG_SN, "reception aborted" );
+    }
+
+    void
+    timeouts()
+    {
+        std::cout << "N_Bs, N_Cr" << std::endl;
+        reset( 100 );
+        can_isotp a( bus(), config_a, rx_a, sizeof( rx_a ) ), b( bus(), config_b, rx_b, sizeof( rx_b ) );
+        tap = []( CanMsg& msg ) { return ( msg.Data[ 0 ] & 0xf0 ) != 0x30; };   // no flow control
+        a.send( payload, 100 );
+        run( a, b, 9990 );
+        expect( a.tx_busy(), "waiting for FC" );
+        run( a, b, 20 );
+        expect( !a.tx_busy() && a.tx_result() == ISOTP_TIMEOUT_BS, "N_Bs" );
+
+        reset( 100 );
+        tap = []( CanMsg& msg ) { return ( msg.Data[ 0 ] & 0xf0 ) != 0x20 || msg.Data[ 0 ] == 0x21; };  // CFs after the first get lost
+        a.send( payload, 100 );
+        run( a, b, 9990 );
+        expect( !b.rx_ready() && b.rx_result() == ISOTP_OK, "waiting for CF" );
+        run( a, b, 20 );
+        expect( !b.rx_ready() && b.rx_result() == ISOTP_TIMEOUT_CR, "N_Cr" );
+
+        // a new FF after the timeout is received normally
+        b.rx_release();
+        tap = nullptr;
+        trace.clear();
+        a.send( payload, 100 );
+        run( a, b, 100 );
+        expect( received( b, 100 ), "next transfer" );
+    }
+}
+
+int
+main( int argc, char ** argv )
+{
+    single_frame();
+    segmented( 8, 0 );
+    segmented( 100, 0 );
+    segmented( 100, 4 );
+    segmented( 4095, 8 );
+    st_min( 5, 50 );          // 5ms
+    st_min( 0xf3, 3 );        // 300us
+    flow_control_wait_overflow();
+    wrong_sequence_number();
+    timeouts();
+
+    std::cout << ( failures ? "FAILED " : "passed" );
+    if ( failures )
+        std::cout << failures;
+    std::cout << std::endl;
+    return failures ? 1 : 0;
+}
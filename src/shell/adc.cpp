@@ -5,6 +5,7 @@
 //
 
 #include "adc.hpp"
+#include "condition_wait.hpp"
 #include "dma.hpp"
 #include "dma_channel.hpp"
 #include "scoped_spinlock.hpp"
@@ -21,7 +22,103 @@ extern "C" {
     void disable_interrupt( stm32f103::IRQn_type IRQn );
 }
 
+extern std::atomic< uint32_t > atomic_jiffies;          //  100us  (4.97 days)
+
 namespace stm32f103 {
+
+    // RM0008, 11.12 ADC registers, p237-
+    enum ADC_SR_MASK : uint32_t {
+        ADC_SR_STRT      = 1 << 4  // Regular channel start flag
+        , ADC_SR_JSTRT   = 1 << 3  // Injected channel start flag
+        , ADC_SR_JEOC    = 1 << 2  // Injected channel end of conversion
+        , ADC_SR_EOC     = 1 << 1  // End of conversion
+        , ADC_SR_AWD     = 1 << 0  // Analog watchdog flag
+    };
+
+    enum ADC_CR1_MASK : uint32_t {
+        ADC_CR1_AWDEN    = 1 << 23 // Analog watchdog enable on regular channels
+        , ADC_CR1_JAWDEN = 1 << 22 // Analog watchdog enable on injected channels
+        , ADC_CR1_DUALMOD = 0x0f << 16
+        , ADC_CR1_AWDSGL = 1 << 9  // Enable the watchdog on a single channel in scan mode
+        , ADC_CR1_SCAN   = 1 << 8  // Scan mode
+        , ADC_CR1_JEOCIE = 1 << 7  // Interrupt enable for injected channels
+        , ADC_CR1_AWDIE  = 1 << 6  // Analog watchdog interrupt enable
+        , ADC_CR1_EOCIE  = 1 << 5  // Interrupt enable for EOC
+        , ADC_CR1_AWDCH  = 0x1f    // Analog watchdog channel select
+    };
+
+    enum ADC_CR2_MASK : uint32_t {
+        ADC_CR2_SWSTART  = 1 << 22 // Start conversion of regular channels
+        , ADC_CR2_JSWSTART = 1 << 21
+        , ADC_CR2_JEXTTRIG = 1 << 15 // External trigger conversion mode for injected channels
+        , ADC_CR2_JEXTSEL  = 7 << 12 // External event select for injected group (111: JSWSTART)
+        , ADC_CR2_EXTTRIG  = 1 << 20 // External trigger conversion mode for regular channels
+        , ADC_CR2_EXTSEL   = 7 << 17 // External event select for regular group (111: SWSTART)
+        , ADC_CR2_EXTSEL_TIM3_TRGO = 4 << 17
+        , ADC_CR2_DMA      = 1 << 8  // Direct memory access mode
+        , ADC_CR2_CONT     = 1 << 1  // Continuous conversion
+        , ADC_CR2_ADON     = 1 << 0
+    };
+
+    // p246-248, SQR3 := SQ1..SQ6, SQR2 := SQ7..SQ12, SQR1 := SQ13..SQ16, L[23:20]
+    // p245, SMPR2 := channel 0..9, SMPR1 := channel 10..17
+    static void regular_sequence( volatile ADC& _, const uint8_t * channels, size_t size, uint8_t sample_time )
+    {
+        std::array< uint32_t, 3 > sqr = { 0 }; // SQR1, SQR2, SQR3
+        for ( size_t i = 0; i < size && i < 16; ++i ) {
+            uint8_t ch = channels[ i ] & 0x1f;
+            sqr[ 2 - ( i / 6 ) ] |= uint32_t( ch ) << ( 5 * ( i % 6 ) );
+            if ( ch < 10 )
+                _.SMPR2 = ( _.SMPR2 & ~( 07 << ( 3 * ch ) ) ) | ( ( sample_time & 07 ) << ( 3 * ch ) );
+            else
+                _.SMPR1 = ( _.SMPR1 & ~( 07 << ( 3 * ( ch - 10 ) ) ) ) | ( ( sample_time & 07 ) << ( 3 * ( ch - 10 ) ) );
+        }
+        _.SQR1 = sqr[ 0 ] | ( uint32_t( size - 1 ) & 0x0f ) << 20;
+        _.SQR2 = sqr[ 1 ];
+        _.SQR3 = sqr[ 2 ];
+    }
+
+    // ADCCLK := PCLK2 / 6 (see main.cpp)
+    constexpr uint32_t adc_clock = 72000000 / 6;
+
+    // p249, JSQR; a sequence of n < 4 occupies JSQ(5-n)..JSQ4, results come in JDR1..JDRn
+    static void injected_sequence( volatile ADC& _, const uint8_t * channels, size_t size )
+    {
+        uint32_t jsqr = uint32_t( size - 1 ) << 20;
+        for ( size_t i = 0; i < size; ++i )
+            jsqr |= uint32_t( channels[ i ] & 0x1f ) << ( 5 * ( 4 - size + i ) );
+        _.JSQR = jsqr;
+    }
+
+    // p245, SMPx[2:0], sample time in half ADC clock cycles (1.5, 7.5, ... 239.5)
+    constexpr uint16_t sample_half_cycles[] = { 3, 15, 27, 57, 83, 111, 143, 479 };
+
+    // longest sample time for which a scan (sample + 12.5 cycles conversion per channel) fits in the trigger period
+    static int sample_time_for( const timer_rate& rate, uint8_t channels )
+    {
+        for ( int i = 7; i >= 0; --i ) {
+            uint64_t scan = uint64_t( channels ) * ( sample_half_cycles[ i ] + 25 ) * rate.clock; // x2 adc cycles
+            if ( scan < uint64_t( rate.period() ) * 2 * adc_clock )
+                return i;
+        }
+        return -1;
+    }
+
+    static void calibrate( volatile ADC& _ )
+    {
+        size_t count = 1000;
+        _.CR2 |= (1 << 3);
+        while(count-- && (_.CR2 & (1 << 3)))
+            ; // stream() << "reset: " << ( ADC->CR2 & (1 << 3) ) << std::endl;
+
+        _.CR2 |= (1 << 2);
+        count = 1000;
+        while(count-- && (_.CR2 & (1 << 2)))
+            ; // stream() << "calibration: " << ( ADC->CR2 & (1 << 2)) << std::endl;
+    }
+
+    static bool __adc2_ready;
+
     static dma_channel_t< DMA_ADC1 > * __dma_adc1;
     static uint8_t __adc1_dma[ sizeof( dma_channel_t< DMA_ADC1 > ) ];
     static std::array< uint16_t, 4 > __adc1_data;
@@ -93,6 +190,224 @@ adc::attach( dma& dma )
     __dma_adc1->enable( true );
 }
 
+bool
+adc::stream_start( dma& dma, uint16_t * buffer, size_t size, uint8_t channels, uint32_t sample_rate )
+{
+    return stream_start( dma, buffer, size, adc_independent, channels, sample_rate );
+}
+
+bool
+adc::stream_start( dma& dma, uint16_t * buffer, size_t size, adc_dual_mode mode, uint8_t channels, uint32_t sample_rate )
+{
+    const bool dual = mode != adc_independent;
+
+    if ( adc_ == nullptr || buffer == nullptr || channels == 0 || channels > ( dual ? 8 : 16 ) )
+        return false;
+
+    if ( mode == adc_fast_interleaved && ( channels != 1 || sample_rate ) )
+        return false; // continuous only; a trigger would convert a single ADC2/ADC1 pair
+
+    if ( dual && ( reinterpret_cast< uintptr_t >( buffer ) & 03 ) )
+        return false;
+
+    // channels in a block, and the smallest whole unit of a half buffer (a 32bit word in dual modes)
+    const uint8_t block_channels = mode == adc_regular_simultaneous ? 2 * channels : channels;
+    const uint8_t unit = dual ? std::max< uint8_t >( block_channels, 2 ) : block_channels;
+
+    if ( size == 0 || size > 0xffff || ( size % ( 2 * unit ) ) != 0 )
+        return false;
+
+    uint8_t sample_time = mode == adc_fast_interleaved ? 0 : 07; // 1.5 (must be < 7 cycles) or 239.5 cycles
+    timer_rate trigger{ timer_clock, 0, 0 };
+    if ( sample_rate ) {
+        trigger = timer_rate_solver( sample_rate );
+        int smp = sample_time_for( trigger, channels );
+        if ( smp < 0 )
+            return false; // scan does not fit in the period even with the shortest sample time
+        sample_time = uint8_t( smp );
+    }
+
+    stream_stop();
+    stream_trigger_ = trigger;
+
+    stream_buffer_ = buffer;
+    stream_size_ = uint16_t( size );
+    stream_channels_ = block_channels;
+    stream_mode_ = mode;
+    stream_queue_.clear();
+
+    if ( dual ) {
+        constexpr uint32_t ccr = ( dma_channel_t< DMA_ADC1 >::dma_ccr & ~( MSIZE_MASK | PSIZE_MASK ) ) | ( 2 << 10 ) | ( 2 << 8 ); // 32bit,32bit
+        __dma_adc1 = new (&__adc1_dma) dma_channel_t< DMA_ADC1 >( dma, reinterpret_cast< uint8_t * >( buffer ), uint16_t( size / 2 ), ccr );
+    } else {
+        __dma_adc1 = new (&__adc1_dma) dma_channel_t< DMA_ADC1 >( dma, reinterpret_cast< uint8_t * >( buffer ), uint16_t( size ) );
+    }
+    __dma_adc1->set_callback( +[]( uint32_t flag ){ adc::instance()->handle_stream_dma( flag ); } );
+
+    std::array< uint8_t, 16 > sequence;
+    for ( size_t i = 0; i < sequence.size(); ++i )
+        sequence[ i ] = uint8_t( i );
+
+    regular_sequence( *adc_, sequence.data(), channels, sample_time );
+
+    adc_->CR1 &= ~ADC_CR1_EOCIE;  // DR is read by dma; EOC interrupt would race against it
+    adc_->CR1 |= ADC_CR1_SCAN;
+
+    if ( dual ) {
+        auto adc2 = reinterpret_cast< volatile ADC * >( ADC2_BASE );
+        if ( ! __adc2_ready ) {
+            adc2->CR2 |= ADC_CR2_ADON;
+            calibrate( *adc2 );
+            __adc2_ready = true;
+        }
+        // ADC2 is the slave; its own trigger is SWSTART, which is never set
+        regular_sequence( *adc2, sequence.data() + ( mode == adc_regular_simultaneous ? channels : 0 ), channels, sample_time );
+        adc2->CR1 = ( adc2->CR1 & ~ADC_CR1_EOCIE ) | ADC_CR1_SCAN;
+        adc2->CR2 = ( adc2->CR2 & ~ADC_CR2_CONT ) | ADC_CR2_EXTSEL | ADC_CR2_EXTTRIG | ( sample_rate ? 0 : ADC_CR2_CONT );
+
+        // DUALMOD last, a configuration change while in dual mode may lose synchronization
+        adc_->CR1 = ( adc_->CR1 & ~ADC_CR1_DUALMOD ) | ( uint32_t( mode ) << 16 );
+    }
+
+    if ( sample_rate ) {
+        timer_t< TIM3_BASE > tim3;
+        tim3.set_trigger_output( trigger ); // counter stays disabled until dma is ready
+
+        adc_->CR2 = ( adc_->CR2 & ~( ADC_CR2_EXTSEL | ADC_CR2_CONT ) ) | ADC_CR2_EXTSEL_TIM3_TRGO | ADC_CR2_EXTTRIG | ADC_CR2_DMA;
+        __dma_adc1->enable( true, HTIE | TCIE | TEIE );
+        tim3.enable( true );
+    } else {
+        adc_->CR2 |= ADC_CR2_EXTSEL | ADC_CR2_CONT | ADC_CR2_DMA;
+        __dma_adc1->enable( true, HTIE | TCIE | TEIE );
+        adc_->CR2 |= ADC_CR2_SWSTART;
+    }
+
+    return true;
+}
+
+void
+adc::stream_stop()
+{
+    if ( stream_buffer_ && adc_ ) {
+        if ( stream_trigger_.period() > 1 ) {
+            timer_t< TIM3_BASE >().enable( false );
+            adc_->CR2 |= ADC_CR2_EXTSEL; // back to SWSTART
+            stream_trigger_ = timer_rate{ timer_clock, 0, 0 };
+        }
+        adc_->CR2 &= ~( ADC_CR2_CONT | ADC_CR2_DMA );
+        if ( stream_mode_ != adc_independent ) {
+            auto adc2 = reinterpret_cast< volatile ADC * >( ADC2_BASE );
+            adc_->CR1 &= ~ADC_CR1_DUALMOD;
+            adc2->CR2 &= ~ADC_CR2_CONT;
+            adc2->CR1 &= ~ADC_CR1_SCAN;
+            adc2->SQR1 = 0;
+            adc2->SQR2 = 0;
+            adc2->SQR3 = 0;
+            stream_mode_ = adc_independent;
+        }
+        if ( __dma_adc1 ) {
+            __dma_adc1->enable( false, HTIE | TCIE | TEIE );
+            __dma_adc1->clear_callback();
+        }
+        if ( capture_state_.load() != 3 )
+            capture_state_ = 0;  // the window can no longer complete
+        adc_->CR1 &= ~ADC_CR1_SCAN;
+        adc_->SQR1 = 0;          // back to single conversion of ch0
+        adc_->SQR2 = 0;
+        adc_->SQR3 = 0;
+        adc_->SR &= ~ADC_SR_EOC;
+        adc_->CR1 |= ADC_CR1_EOCIE;
+    }
+    stream_buffer_ = nullptr;
+}
+
+// dma (HT|TC) interrupt context
+void
+adc::handle_stream_dma( uint32_t flag )
+{
+    const uint32_t timestamp = atomic_jiffies.load();
+    const uint16_t half = stream_size_ / 2;
+
+    for ( auto mask: { HTIF, TCIF } ) { // a delayed irq may carry both, first half goes first
+        if ( ( flag & mask ) == 0 )
+            continue;
+
+        if ( stream_mode_ == adc_fast_interleaved ) {
+            // each word is ADC1[15:0], ADC2[31:16] where ADC2 has been sampled first; swap into time order
+            auto p = reinterpret_cast< uint32_t * >( stream_buffer_ + ( mask == HTIF ? 0 : half ) );
+            for ( size_t i = 0; i < half / 2; ++i )
+                p[ i ] = ( p[ i ] >> 16 ) | ( p[ i ] << 16 );
+        }
+
+        stream_queue_.push( { stream_buffer_ + ( mask == HTIF ? 0 : half )
+                              , half
+                              , stream_channels_
+                              , stream_queue_.head()
+                              , timestamp } );
+
+        if ( capture_state_.load() == 2 )
+            handle_capture( mask == HTIF ? half : stream_size_ );
+    }
+
+    if ( watchdog_armed_ )
+        adc_->CR1 |= ADC_CR1_AWDIE;  // hold-off of a block after an event
+}
+
+// dma (HT|TC) interrupt context, boundary := buffer index the dma has just completed
+void
+adc::handle_capture( uint16_t boundary )
+{
+    const uint16_t half = stream_size_ / 2;
+
+    const uint16_t written = ( boundary + stream_size_ - capture_mark_ ) % stream_size_;
+    if ( written == 0 || written > half )
+        return;                 // this boundary was passed before the event
+
+    // the window samples of the half just completed; dma is a whole half away from them
+    capture_mark_ = boundary % stream_size_;
+    capture_copy( ( capture_mark_ + stream_size_ - capture_start_ ) % stream_size_ );
+}
+
+// copies the window up to 'available' samples past its start, in order as they are written;
+// state 3 once it is complete
+void
+adc::capture_copy( uint16_t available )
+{
+    const uint16_t size = ( capture_.pre + 1 + capture_.post ) * capture_.channels;
+    if ( available > size )
+        available = size;
+
+    uint16_t index = ( capture_start_ + capture_copied_ ) % stream_size_;
+    for ( uint16_t i = capture_copied_; i < available; ++i ) {
+        capture_.data[ i ] = stream_buffer_[ index ];
+        if ( ++index == stream_size_ )
+            index = 0;
+    }
+    if ( available > capture_copied_ )
+        capture_copied_ = available;
+
+    if ( capture_copied_ == size )
+        capture_state_ = 3;
+}
+
+bool
+adc::stream_read( adc_block& block )
+{
+    return stream_queue_.read( block );
+}
+
+bool
+adc::stream_release( const adc_block& block )
+{
+    return stream_queue_.release( block );
+}
+
+uint32_t
+adc::stream_overrun() const
+{
+    return stream_queue_.overrun();
+}
+
 void
 adc::init( PERIPHERAL_BASE base )
 {
@@ -104,6 +419,21 @@ adc::init( PERIPHERAL_BASE base )
     lock_.clear();
     flag_ = false;
 
+    stream_buffer_ = nullptr;
+    stream_size_ = 0;
+    stream_channels_ = 0;
+    stream_queue_.clear();
+    stream_mode_ = adc_independent;
+    stream_trigger_ = timer_rate{ timer_clock, 0, 0 };
+
+    watchdog_armed_ = false;
+    watchdog_head_ = 0;
+    watchdog_tail_ = 0;
+    watchdog_lost_ = 0;
+    capture_state_ = 0;
+    injected_ = nullptr;
+    injected_scan_ = false;
+
     if ( auto ADC = reinterpret_cast< stm32f103::ADC * >( base ) ) {
 
         adc_ = ADC;
@@ -119,15 +449,7 @@ adc::init( PERIPHERAL_BASE base )
 
         ADC->CR2 |= (1 << 0);  // ADON (p242)
 
-        size_t count = 1000;
-        ADC->CR2 |= (1 << 3);
-        while(count-- && (ADC->CR2 & (1 << 3)))
-            ; // stream() << "reset: " << ( ADC->CR2 & (1 << 3) ) << std::endl;
-
-        ADC->CR2 |= (1 << 2);
-        count = 1000;
-        while(count-- && (ADC->CR2 & (1 << 2)))
-            ; // stream() << "calibration: " << ( ADC->CR2 & (1 << 2)) << std::endl;
+        calibrate( *ADC );
     }
 }
 
@@ -144,9 +466,74 @@ adc::cr2() const
     return adc_  ? adc_->CR2 : -1;
 }
 
+bool
+adc::convert_async( const uint8_t * channels, size_t size, adc_injected& r )
+{
+    if ( adc_ == nullptr || channels == nullptr || size == 0 || size > r.channels.size() )
+        return false;
+
+    adc_injected * idle = nullptr;
+    if ( ! injected_.compare_exchange_strong( idle, &r ) )
+        return false;
+
+    r.ready = false;
+    r.size = uint8_t( size );
+    std::copy( channels, channels + size, r.channels.begin() );
+
+    if ( ! stream_buffer_ ) {
+        // the stream owns the sample times of its channels; otherwise take the longest
+        for ( size_t i = 0; i < size; ++i ) {
+            uint8_t ch = channels[ i ] & 0x1f;
+            if ( ch < 10 )
+                adc_->SMPR2 |= 07 << ( 3 * ch );
+            else if ( ch < 18 )
+                adc_->SMPR1 |= 07 << ( 3 * ( ch - 10 ) );
+        }
+    }
+
+    injected_sequence( *adc_, channels, size );
+    injected_scan_ = size > 1 && !( adc_->CR1 & ADC_CR1_SCAN );
+    adc_->CR1 |= ADC_CR1_JEOCIE | ( size > 1 ? ADC_CR1_SCAN : 0 );
+    adc_->CR2 |= ADC_CR2_JEXTSEL | ADC_CR2_JEXTTRIG;
+    adc_->CR2 |= ADC_CR2_JSWSTART;
+
+    return true;
+}
+
+// puts SCAN back the way convert_async found it, unless a stream has started since and owns it
+void
+adc::injected_release()
+{
+    if ( injected_scan_ && ! stream_buffer_ )
+        adc_->CR1 &= ~ADC_CR1_SCAN;
+    injected_scan_ = false;
+    injected_ = nullptr;
+}
+
+bool
+adc::convert( const uint8_t * channels, uint16_t * results, size_t size )
+{
+    adc_injected r;
+    while ( size ) {
+        const size_t n = std::min( size, r.channels.size() );
+        if ( ! DEADLINE_WAIT( 1000 )( [&]{ return convert_async( channels, n, r ); } ) )
+            return false;
+        if ( ! DEADLINE_WAIT( 1000, true )( [&]{ return r.ready.load(); } ) ) { // 4 x 252 ADCCLK is 84us
+            injected_release();
+            return false;
+        }
+        results = std::copy( r.data.begin(), r.data.begin() + n, results );
+        channels += n;
+        size -= n;
+    }
+    return true;
+}
+
 bool
 adc::start_conversion()
 {
+    if ( adc_ && watchdog_armed_ )
+        adc_->CR1 |= ADC_CR1_AWDIE;
     return adc_ && ( adc_->CR2 |= (1 << 22) ); // p240
 }
 
@@ -168,10 +555,146 @@ adc::data()
 void
 adc::handle_interrupt()
 {
-    scoped_spinlock<> lock( lock_ );     
+    const uint32_t sr = adc_->SR;
+    uint16_t value = 0;
+
+    if ( ( sr & ADC_SR_EOC ) && ( adc_->CR1 & ADC_CR1_EOCIE ) ) {
+        scoped_spinlock<> lock( lock_ );
+        value = data_ = adc_->DR;
+        flag_ = true;
+    }
+
+    if ( sr & ADC_SR_JEOC ) {
+        adc_->SR = ~( ADC_SR_JEOC | ADC_SR_JSTRT ) & 0x1f;
+        if ( auto r = injected_.load() ) {
+            const volatile uint32_t * jdr = &adc_->JDR1;
+            for ( size_t i = 0; i < r->size; ++i )
+                r->data[ i ] = uint16_t( jdr[ i ] );
+            injected_release();
+            r->ready = true;
+        }
+    }
+
+    if ( ( sr & ADC_SR_AWD ) && ( adc_->CR1 & ADC_CR1_AWDIE ) ) {
+        adc_->SR = ~ADC_SR_AWD & 0x1f; // rc_w0
+        adc_->CR1 &= ~ADC_CR1_AWDIE;   // re-armed by the next block, or start_conversion
+        handle_watchdog( value );
+    }
+}
+
+// adc interrupt context
+void
+adc::handle_watchdog( uint16_t value )
+{
+    adc_watchdog_event event{ atomic_jiffies.load(), 0, value, 0 };
+
+    if ( stream_buffer_ && __dma_adc1 ) {
+        const bool dual = stream_mode_ != adc_independent;
+        // next write index; CNDTR counts 32bit words in dual modes
+        uint16_t index = stream_size_ - ( dual ? 2 * __dma_adc1->remaining() : __dma_adc1->remaining() );
+        uint16_t last = ( index + stream_size_ - ( dual ? 2 : 1 ) ) % stream_size_; // ADC1 half of the last word
+        event.position = last;
+        event.value = stream_buffer_[ last ];
+        event.channel = last % stream_channels_;
+
+        if ( capture_state_.load() == 1 ) {
+            capture_.event = event;
+            // window start is 'pre' scans ahead of the scan holding the event; the pre-trigger part is
+            // copied now, before dma leaves the current half for the one it may reach back into
+            const uint16_t ch = capture_.channels;
+            const uint16_t scan = last - ( last % ch );
+            capture_start_ = ( scan + stream_size_ - capture_.pre * ch ) % stream_size_;
+            capture_copied_ = 0;
+            capture_mark_ = index % stream_size_;
+            capture_state_ = 2;
+            capture_copy( ( capture_mark_ + stream_size_ - capture_start_ ) % stream_size_ );
+        }
+    }
+
+    uint32_t head = watchdog_head_.load();
+    if ( head - watchdog_tail_.load() >= watchdog_events_.size() ) {
+        ++watchdog_lost_;
+        return;
+    }
+    watchdog_events_[ head % watchdog_events_.size() ] = event;
+    watchdog_head_ = head + 1;
+}
+
+bool
+adc::watchdog_enable( uint16_t low, uint16_t high, int channel )
+{
+    if ( adc_ == nullptr || low > high || high > 0x0fff || channel > 17 )
+        return false;
+
+    adc_->CR1 &= ~( ADC_CR1_AWDEN | ADC_CR1_AWDIE );
+    adc_->HTR = high;
+    adc_->LTR = low;
+
+    if ( channel < 0 )
+        adc_->CR1 &= ~( ADC_CR1_AWDSGL | ADC_CR1_AWDCH );
+    else
+        adc_->CR1 = ( adc_->CR1 & ~ADC_CR1_AWDCH ) | ADC_CR1_AWDSGL | uint32_t( channel );
+
+    watchdog_head_ = 0;
+    watchdog_tail_ = 0;
+    watchdog_lost_ = 0;
+    watchdog_armed_ = true;
+
+    adc_->SR = ~ADC_SR_AWD & 0x1f;
+    adc_->CR1 |= ADC_CR1_AWDEN | ADC_CR1_AWDIE;
+
+    return true;
+}
 
-    data_ = adc_->DR;
-    flag_ = true;
+void
+adc::watchdog_disable()
+{
+    watchdog_armed_ = false;
+    if ( adc_ )
+        adc_->CR1 &= ~( ADC_CR1_AWDEN | ADC_CR1_AWDIE );
+    capture_state_ = 0;
+}
+
+bool
+adc::watchdog_read( adc_watchdog_event& event )
+{
+    uint32_t tail = watchdog_tail_.load();
+    if ( tail == watchdog_head_.load() )
+        return false;
+    event = watchdog_events_[ tail % watchdog_events_.size() ];
+    watchdog_tail_ = tail + 1;
+    return true;
+}
+
+uint32_t
+adc::watchdog_lost() const
+{
+    return watchdog_lost_.load();
+}
+
+bool
+adc::capture_arm( uint16_t * data, uint16_t pre, uint16_t post )
+{
+    if ( ! stream_buffer_ || data == nullptr )
+        return false;
+
+    if ( ( pre + 1 + post ) * stream_channels_ > stream_size_ / 2 )
+        return false; // the window would reach into the half dma is writing
+
+    capture_state_ = 0;
+    capture_ = adc_capture{ data, pre, post, stream_channels_, adc_watchdog_event{ 0, 0, 0, 0 } };
+    capture_state_ = 1;
+    return true;
+}
+
+bool
+adc::capture_read( adc_capture& capture )
+{
+    uint8_t ready = 3;
+    if ( ! capture_state_.compare_exchange_strong( ready, 0 ) )
+        return false;
+    capture = capture_;
+    return true;
 }
 
 void
@@ -4,9 +4,14 @@
 // Contact: toshi.hondo@qtplatz.com
 //
 
+#pragma once
+
+#include <array>
 #include <atomic>
 #include <cstdint>
 #include <cstddef>
+#include "dma_block_queue.hpp"
+#include "timer.hpp"
 
 namespace stm32f103 {
 
@@ -15,6 +20,49 @@ namespace stm32f103 {
 
     class dma;
 
+    // RM0008 11.9 Dual ADC mode, ADC1 CR1 DUALMOD[19:16]
+    enum adc_dual_mode : uint8_t {
+        adc_independent = 0
+        , adc_regular_simultaneous = 6  // ADC1 and ADC2 convert their own sequences at the same instant
+        , adc_fast_interleaved = 7      // ADC2 then ADC1 (7 ADC clocks later) on the same channel
+    };
+
+    // a half of the circular dma buffer, handed to the consumer by HT/TC interrupt
+    struct adc_block {
+        const uint16_t * data;   // points into the dma buffer; valid until the next half has been filled
+        uint16_t size;           // number of samples (scans x channels)
+        uint8_t channels;        // number of channels in a scan (ADC1/ADC2 pairs interleaved in dual simultaneous mode)
+        uint32_t sequence;       // block sequence number (counts up from stream_start)
+        uint32_t timestamp;      // atomic_jiffies (100us) when the block has been completed
+    };
+
+    // analog watchdog event; in stream mode value/channel are taken from the last sample dma has written
+    // when the interrupt is serviced, which may trail the offending conversion by a sample or two
+    struct adc_watchdog_event {
+        uint32_t timestamp;      // atomic_jiffies (100us)
+        uint16_t position;       // index into the stream buffer (0 when not streaming)
+        uint16_t value;
+        uint8_t channel;         // channel index within the scan
+    };
+
+    // pre/post-trigger window copied out of the circular buffer around a watchdog event
+    struct adc_capture {
+        uint16_t * data;         // (pre + 1 + post) scans x channels, scan aligned
+        uint16_t pre;            // scans before the one that triggered
+        uint16_t post;           // scans after it
+        uint8_t channels;
+        adc_watchdog_event event;
+    };
+
+    // handle of an injected group conversion (RM0008 11.3.9), owned by the caller and completed
+    // from the JEOC interrupt; injected conversions preempt the regular group, including a running stream
+    struct adc_injected {
+        std::array< uint16_t, 4 > data;
+        std::array< uint8_t, 4 > channels;
+        uint8_t size;
+        std::atomic_bool ready;
+    };
+
     class adc {
         adc( const adc& ) = delete;
         adc& operator = ( const adc& ) = delete;
@@ -22,13 +70,82 @@ namespace stm32f103 {
         std::atomic_flag lock_;
         std::atomic_bool flag_;
         std::atomic< uint16_t > data_;
+
+        // streaming acquisition
+        uint16_t * stream_buffer_;
+        uint16_t stream_size_;
+        uint8_t stream_channels_;
+        adc_dual_mode stream_mode_;
+        dma_block_queue< adc_block > stream_queue_;
+        timer_rate stream_trigger_;                 // psc == arr == 0 when free running
+
+        // analog watchdog
+        bool watchdog_armed_;
+        std::array< adc_watchdog_event, 8 > watchdog_events_;
+        std::atomic< uint32_t > watchdog_head_;
+        std::atomic< uint32_t > watchdog_tail_;
+        std::atomic< uint32_t > watchdog_lost_;
+        adc_capture capture_;
+        uint16_t capture_mark_;                     // stream buffer index up to which the window has been copied
+        uint16_t capture_start_;                    // stream buffer index of the first window sample
+        uint16_t capture_copied_;                   // window samples copied so far
+        std::atomic< uint8_t > capture_state_;      // 0: idle, 1: armed, 2: triggered, 3: ready
+
+        std::atomic< adc_injected * > injected_;    // in-flight injected group
+        bool injected_scan_;                        // SCAN was set for the group, not by the stream
+
         adc();
         ~adc();
         void init( PERIPHERAL_BASE );
+        void handle_stream_dma( uint32_t flag );
+        void handle_watchdog( uint16_t value );
+        void handle_capture( uint16_t boundary );
+        void capture_copy( uint16_t available );
+        void injected_release();
     public:
         void attach( dma& );
         operator bool () const { return adc_; }
 
+        // Continuous scan of channels [0..channels) into a circular dma buffer.
+        // size must be a multiple of (2 * channels); each half is delivered as an adc_block.
+        // sample_rate == 0 free runs; otherwise each scan is triggered by TIM3 TRGO at the
+        // nearest achievable rate, and the longest sample time that fits in the period is used.
+        bool stream_start( dma&, uint16_t * buffer, size_t size, uint8_t channels = 4, uint32_t sample_rate = 0 );
+        // Dual ADC1+ADC2 streaming through 32bit packed dma; buffer must be 4-byte aligned.
+        // regular simultaneous: ADC1 scans [0..channels), ADC2 scans [channels..2*channels), the block carries
+        //   2*channels interleaved as ADC1[0], ADC2[0], ADC1[1], ADC2[1]...
+        // fast interleaved: channel 0 only, free running; the block is a single channel at twice the rate.
+        bool stream_start( dma&, uint16_t * buffer, size_t size, adc_dual_mode, uint8_t channels = 1, uint32_t sample_rate = 0 );
+        void stream_stop();
+        bool stream_read( adc_block& );          // non-blocking, false if no block is ready
+        bool stream_release( const adc_block& ); // false if dma has overwritten the block while in use
+        uint32_t stream_overrun() const;
+        inline bool is_streaming() const { return stream_buffer_; }
+        inline const timer_rate& stream_trigger() const { return stream_trigger_; }
+        inline adc_dual_mode stream_mode() const { return stream_mode_; }
+
+        // RM0008 11.3.7 Analog watchdog; an event whenever a regular conversion falls outside [low, high].
+        // channel < 0 guards all regular channels. The interrupt is masked after an event and re-armed at
+        // the next stream block (or the next start_conversion), so a signal that stays outside does not storm.
+        // In dual modes only ADC1 conversions are guarded.
+        bool watchdog_enable( uint16_t low, uint16_t high, int channel = -1 );
+        void watchdog_disable();
+        bool watchdog_read( adc_watchdog_event& );  // non-blocking
+        uint32_t watchdog_lost() const;
+
+        // one-shot capture of the next watchdog event while streaming; (pre + 1 + post) scans
+        // must fit in a half of the stream buffer, and data must hold that many scans.
+        bool capture_arm( uint16_t * data, uint16_t pre, uint16_t post );
+        bool capture_read( adc_capture& );          // true once, when the window has been copied
+
+        // non-blocking; up to 4 channels in one injected sequence, false while another one is in flight
+        bool convert_async( const uint8_t * channels, size_t size, adc_injected& );
+        inline bool convert_async( uint8_t channel, adc_injected& r ) { return convert_async( &channel, 1, r ); }
+        inline bool busy() const { return injected_.load() != nullptr; }
+
+        // blocking batch, converted as injected sequences of 4 instead of a round trip per channel
+        bool convert( const uint8_t * channels, uint16_t * results, size_t size );
+
         bool start_conversion(); // software trigger
 
         uint32_t cr2() const;
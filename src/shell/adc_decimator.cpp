@@ -0,0 +1,145 @@
+// Copyright (C) 2018 MS-Cheminformatics LLC
+// Licence: CC BY-NC
+// Author: Toshinobu Hondo, Ph.D.
+// Contact: toshi.hondo@qtplatz.com
+//
+
+#include "adc_decimator.hpp"
+#include "adc.hpp"
+#include <algorithm>
+
+using namespace stm32f103;
+
+namespace {
+
+    constexpr uint32_t adc_bits = 12;
+    constexpr uint32_t frac_bits = 4;   // output is 12.4 fixed point
+
+    constexpr uint32_t
+    ceil_log2( uint32_t n )
+    {
+        uint32_t b = 0;
+        while ( b < 32 && ( 1u << b ) < n )
+            ++b;
+        return b;
+    }
+}
+
+adc_decimator::adc_decimator() : ratio_( 1 )
+                               , gain_( 1 )
+                               , phase_( 0 )
+                               , order_( 1 )
+                               , channels_( 1 )
+                               , channel_( 0 )
+{
+    subscribers_.fill( nullptr );
+    reset();
+}
+
+bool
+adc_decimator::configure( uint8_t channels, uint32_t ratio, uint8_t order )
+{
+    if ( channels == 0 || channels > max_channels || order == 0 || order > max_order || ratio == 0 )
+        return false;
+
+    // register growth of an N-stage CIC is N * log2(R) bits
+    if ( adc_bits + order * ceil_log2( ratio ) > 32 )
+        return false;
+
+    channels_ = channels;
+    ratio_ = ratio;
+    order_ = order;
+
+    gain_ = 1;
+    for ( size_t i = 0; i < order; ++i )
+        gain_ *= ratio;
+
+    reset();
+    return true;
+}
+
+void
+adc_decimator::reset()
+{
+    for ( auto& st: state_ ) {
+        st.integrator.fill( 0 );
+        st.comb.fill( 0 );
+    }
+    phase_ = 0;
+    channel_ = 0;
+    output_.channels = channels_;
+    output_.sequence = 0;
+    output_.timestamp = 0;
+    output_.data.fill( 0 );
+}
+
+bool
+adc_decimator::process( const adc_block& block )
+{
+    if ( block.channels != channels_ )
+        return false;
+    return process( block.data, block.size, block.timestamp );
+}
+
+bool
+adc_decimator::process( const uint16_t * data, size_t size, uint32_t timestamp )
+{
+    if ( data == nullptr || ( size % channels_ ) )
+        return false;
+
+    for ( size_t i = 0; i < size; ++i ) {
+        auto& integrator = state_[ channel_ ].integrator;
+        uint32_t x = data[ i ];
+        for ( size_t k = 0; k < order_; ++k )
+            x = ( integrator[ k ] += x );        // wraps mod 2^32, comb section takes it back
+
+        if ( ++channel_ == channels_ ) {
+            channel_ = 0;
+            if ( ++phase_ == ratio_ ) {
+                phase_ = 0;
+                emit( timestamp );
+            }
+        }
+    }
+    return true;
+}
+
+void
+adc_decimator::emit( uint32_t timestamp )
+{
+    for ( size_t ch = 0; ch < channels_; ++ch ) {
+        auto& st = state_[ ch ];
+        uint32_t x = st.integrator[ order_ - 1 ];
+        for ( size_t k = 0; k < order_; ++k ) {
+            uint32_t y = x - st.comb[ k ];
+            st.comb[ k ] = x;
+            x = y;
+        }
+        // x / gain in 12.4 without 64bit division (gain <= 2^20, so remainder << 4 fits)
+        output_.data[ ch ] = uint16_t( ( ( x / gain_ ) << frac_bits ) | ( ( ( x % gain_ ) << frac_bits ) / gain_ ) );
+    }
+    output_.channels = channels_;
+    output_.timestamp = timestamp;
+
+    for ( auto& subscriber: subscribers_ ) {
+        if ( subscriber )
+            subscriber( output_ );
+    }
+    ++output_.sequence;
+}
+
+bool
+adc_decimator::subscribe( subscriber_type f )
+{
+    auto it = std::find( subscribers_.begin(), subscribers_.end(), nullptr );
+    if ( it == subscribers_.end() || f == nullptr )
+        return false;
+    *it = f;
+    return true;
+}
+
+void
+adc_decimator::unsubscribe( subscriber_type f )
+{
+    std::replace( subscribers_.begin(), subscribers_.end(), f, subscriber_type( nullptr ) );
+}
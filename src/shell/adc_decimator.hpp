@@ -0,0 +1,70 @@
+// Copyright (C) 2018 MS-Cheminformatics LLC
+// Licence: CC BY-NC
+// Author: Toshinobu Hondo, Ph.D.
+// Contact: toshi.hondo@qtplatz.com
+//
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+namespace stm32f103 {
+
+    struct adc_block;
+
+    struct adc_decimated {
+        std::array< uint16_t, 8 > data; // per channel, 12bit adc value in 12.4 fixed point
+        uint8_t channels;
+        uint32_t sequence;              // output sample counter
+        uint32_t timestamp;             // timestamp of the adc block that completed this sample
+    };
+
+    // CIC (cascaded integrator-comb) decimator for interleaved adc blocks.
+    // order 1 is a plain boxcar average; response is (sin(pi f R) / (R sin(pi f)))^order.
+    // Integer arithmetic, each stage wraps modulo 2^32 which is exact as long as
+    // 12 + order * ceil(log2(ratio)) <= 32; configure() refuses anything beyond that.
+    class adc_decimator {
+    public:
+        static constexpr size_t max_channels = 8;
+        static constexpr size_t max_order = 4;
+        static constexpr size_t max_subscribers = 4;
+
+        typedef void (*subscriber_type)( const adc_decimated& );
+
+        adc_decimator();
+
+        bool configure( uint8_t channels, uint32_t ratio, uint8_t order = 3 );
+        void reset();
+
+        bool process( const adc_block& );
+        bool process( const uint16_t * data, size_t size, uint32_t timestamp );
+
+        bool subscribe( subscriber_type );
+        void unsubscribe( subscriber_type );
+
+        inline uint32_t ratio() const { return ratio_; }
+        inline uint8_t order() const { return order_; }
+        inline uint8_t channels() const { return channels_; }
+        inline uint32_t gain() const { return gain_; }
+
+    private:
+        struct state {
+            std::array< uint32_t, max_order > integrator;
+            std::array< uint32_t, max_order > comb;
+        };
+        std::array< state, max_channels > state_;
+        std::array< subscriber_type, max_subscribers > subscribers_;
+        adc_decimated output_;
+        uint32_t ratio_;
+        uint32_t gain_;     // ratio ^ order
+        uint32_t phase_;    // scans since the last output
+        uint8_t order_;
+        uint8_t channels_;
+        uint8_t channel_;   // channel of the next sample in the interleaved stream
+
+        void emit( uint32_t timestamp );
+    };
+
+}
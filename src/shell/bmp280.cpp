@@ -44,7 +44,7 @@
 #include "debug_print.hpp"
 
 namespace bmp280 {
-    std::atomic_flag __flag, __once_flag;
+    std::atomic_flag __once_flag;
     BMP280 * BMP280::__instance;
     static uint8_t __bmp280_allocator[ sizeof(BMP280) ];
 
@@ -230,7 +230,6 @@ BMP280::stop()
 bool
 BMP280::write( const uint8_t * data, size_t size ) const
 {
-    scoped_spinlock<> lock( __flag );
     bool success( false );
     if ( i2c_ ) {
         if ( i2c_->has_dma( stm32f103::i2c::DMA_Tx ) ) {
@@ -248,62 +247,73 @@ bool
 BMP280::read(  uint8_t addr, uint8_t * data, size_t size ) const
 {
     bool success( false );
-    scoped_spinlock<> lock( __flag );
     if ( i2c_ ) {
-
-        if ( i2c_->has_dma( stm32f103::i2c::DMA_Tx ) ) {
-            success = i2c_->dma_transfer( address_, &addr, 1 );
-        } else {
-            success = i2c_->write( address_, &addr, 1 );
-        }
-        
-        if ( success ) {
-            std::array< uint8_t, 2 > buf = { 0 };
-            
-            if ( i2c_->has_dma( stm32f103::i2c::DMA_Rx ) ) {
-                success = i2c_->dma_receive( address_, data, size );
-            } else {
-                success = i2c_->read( address_, data, size );
-            }
-        }
-
-        if ( !success )
-            i2c_->print_result( stream(__FILE__,__LINE__) ) << std::endl;        
+        // register pointer, repeated START, burst read -- a single bus transaction
+        if ( !( success = i2c_->read_register( address_, addr, data, size ) ) )
+            i2c_->print_result( stream(__FILE__,__LINE__) ) << std::endl;
     }
     return success;
 }
 
+std::pair< uint32_t, uint32_t >
+BMP280::convert( const uint8_t * data ) const
+{
+    uint32_t adc_P = uint32_t( data[0] ) << 12 | uint32_t( data[1] ) << 4 | data[2] & 0x0f;
+    uint32_t adc_T  = uint32_t( data[3] ) << 12 | uint32_t( data[4] ) << 4 | data[5] & 0x0f;
+    int32_t t_fine = 0;
+    auto temp = compensate_T( adc_T, t_fine );
+    auto press = compensate_P32( adc_P, t_fine );
+
+    auto minor = temp % 100;
+
+    using stm32f103::system_clock;
+    stream() << int( std::chrono::duration_cast< std::chrono::seconds >( system_clock::now() - system_clock::zero ).count() )
+             << "\t" << int( press ) << " (Pa)"
+             << "\t" << int( temp / 100 ) << "." << ( minor < 10 ? "0" : "") << minor << " (degC)";
+
+    stream() << std::endl;
+
+    return { press, temp };
+}
+
 std::pair< uint32_t, uint32_t > 
 BMP280::readout()
 {
     std::array< uint8_t, 6 > data;
-    if ( read( 0xf7, data.data(), data.size() ) ) {
-        uint32_t adc_P = uint32_t( data[0] ) << 12 | uint32_t( data[1] ) << 4 | data[2] & 0x0f;
-        uint32_t adc_T  = uint32_t( data[3] ) << 12 | uint32_t( data[4] ) << 4 | data[5] & 0x0f;
-        int32_t t_fine = 0;
-        auto temp = compensate_T( adc_T, t_fine );
-        auto press = compensate_P32( adc_P, t_fine );
-
-        auto minor = temp % 100;
-
-        using stm32f103::system_clock;
-        stream() << int( std::chrono::duration_cast< std::chrono::seconds >( system_clock::now() - system_clock::zero ).count() )
-                 << "\t" << int( press ) << " (Pa)"
-                 << "\t" << int( temp / 100 ) << "." << ( minor < 10 ? "0" : "") << minor << " (degC)";
-        
-        stream() << std::endl;
-        
-        return { press, temp };
-    }
+    if ( read( 0xf7, data.data(), data.size() ) )
+        return convert( data.data() );
     return { -1, -1 };
 }
 
+namespace bmp280 {
+    static uint8_t __readout_register = press_msb;
+    static std::array< uint8_t, 6 > __readout_data;
+    static const stm32f103::i2c_segment __readout_segments[] = {
+        { false, &__readout_register, 1 }
+        , { true, __readout_data.data(), __readout_data.size() }
+    };
+    // periodic sample; ahead of shell traffic, late after 5ms
+    static stm32f103::i2c_transaction __readout = { 0, __readout_segments, 2, {}, nullptr, nullptr, 2, 5000 };
+}
+
+bool
+BMP280::readout_async()
+{
+    __readout.address = address_;
+    __readout.callback = +[]( stm32f103::i2c_transaction& t ){
+            if ( t.result == stm32f103::I2C_RESULT_SUCCESS )
+                instance()->convert( __readout_data.data() );
+        };
+    return i2c_->submit( __readout ); // false while the previous readout is still queued
+}
+
 //static
 void
 BMP280::handle_timer()
 {
+    // TIM2 isr; the bus transfer runs on i2c interrupts, a tick is skipped while the previous readout is pending
     if ( auto p = instance() )
-        auto pair = p->readout();
+        p->readout_async();
 }
 
 /*!
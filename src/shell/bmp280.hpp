@@ -90,12 +90,14 @@ namespace bmp280 {
         void measure();
         void stop();
         std::pair< uint32_t, uint32_t> readout();
+        bool readout_async();   // submits the readout to the i2c isr; prints when it completes
         
         inline bool is_active() const { return has_callback_; }
     private:
         uint32_t compensate_P32( uint32_t adc_P, int32_t t_fine ) const;
         uint32_t compensate_P64( uint32_t adc_P, int32_t t_fine ) const;
         int32_t compensate_T( int32_t adc_T, int32_t& t_fine ) const;
+        std::pair< uint32_t, uint32_t > convert( const uint8_t * data ) const; // press_msb .. temp_xlsb
         static void handle_timer();
     };
     
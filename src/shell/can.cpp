@@ -14,6 +14,10 @@
 // reference
 // http://akb77.com/g/files/media/Maple.HardwareCAN.0.0.12.rar
 
+extern uint32_t __pclk1;
+extern uint64_t jiffies;  // 100us, systick
+extern std::atomic< uint32_t > atomic_jiffies;
+
 extern "C" {
     void enable_interrupt( stm32f103::IRQn_type IRQn );
     void disable_interrupt( stm32f103::IRQn_type IRQn );
@@ -25,7 +29,6 @@ extern "C" {
 }
 
 namespace stm32f103 {
-    constexpr uint32_t pclk1 = 36000000;
 
     static bool can_active;
 
@@ -139,8 +142,8 @@ namespace stm32f103 {
         , CAN_BTR_LBKM	    = 0x40000000	/* Loop Back Mode (Debug) */
         , CAN_BTR_SILM	    = 0x80000000	/* Silent Mode */        
         
-        , CAN_INAK_TimeOut	= 0x0000FFFF
-        , CAN_SLAK_TimeOut	= 0x0000FFFF
+        , CAN_INAK_TimeOut	= 10000         /* us, 11 recessive bits are 1.1ms at 10kbps */
+        , CAN_SLAK_TimeOut	= 10000         /* us */
         , CAN_CONTROL_MASK	= (CAN_MCR_TTCM | CAN_MCR_ABOM | CAN_MCR_AWUM | CAN_MCR_NART | CAN_MCR_RFLM | CAN_MCR_TXFP)
         , CAN_TIMING_MASK	= (CAN_BTR_SJW | CAN_BTR_TS2 | CAN_BTR_TS1 | CAN_BTR_BRP)
         , CAN_MODE_MASK		= (CAN_BTR_LBKM | CAN_BTR_SILM)
@@ -168,7 +171,7 @@ namespace stm32f103 {
         CAN_STATUS operator()( volatile CAN& _ ) {
             if ( ( _.MSR & CAN_MSR_INAK ) == 0 ) {
                 bitset::set( _.MCR, CAN_MCR_INRQ );			// Request initialisation
-                if ( ! condition_wait( CAN_INAK_TimeOut )( [&]{ return _.MSR & CAN_MSR_INAK; } ) )
+                if ( ! DEADLINE_WAIT( CAN_INAK_TimeOut )( [&]{ return _.MSR & CAN_MSR_INAK; } ) )
                     return CAN_INIT_E_FAILED;
             }
             return CAN_OK;
@@ -180,13 +183,25 @@ namespace stm32f103 {
             CAN_STATUS status( CAN_OK );
             if ( _.MSR & CAN_MSR_INAK ) {	// Check for initialization mode already reset
                 bitset::reset( _.MCR, CAN_MCR_INRQ );			// Request initialization
-                if ( !condition_wait( CAN_INAK_TimeOut )( [&]{ return ( _.MSR & CAN_MSR_INAK ) == 0; } ) )
+                if ( !DEADLINE_WAIT( CAN_INAK_TimeOut )( [&]{ return ( _.MSR & CAN_MSR_INAK ) == 0; } ) )
                     return CAN_INIT_L_FAILED;
             }
             return CAN_OK;
         }
     };
 
+    // masks all interrupts (PRIMASK) for the tx queue, which producers in any context share with the tx isr
+    struct scoped_irq_lock {
+        uint32_t primask;
+        scoped_irq_lock() {
+            __asm__ volatile ( "mrs %0, primask" : "=r" ( primask ) );
+            __asm__ volatile ( "cpsid i" ::: "memory" );
+        }
+        ~scoped_irq_lock() {
+            __asm__ volatile ( "msr primask, %0" :: "r" ( primask ) : "memory" );
+        }
+    };
+
     struct scoped_can_init {
         volatile CAN& _;
         CAN_STATUS status_;
@@ -210,10 +225,17 @@ namespace stm32f103 {
 using namespace stm32f103;
 
 can::can() : status_( CAN_INIT_FAILED )
-           , rx_head_( 0 )
-           , rx_tail_( 0 )
-           , rx_count_( 0 )
            , active_( 0 )
+           , tx_count_( 0 )
+           , tx_seq_( 0 )
+           , tx_owned_( 0 )
+           , tx_abort_( 0 )
+           , bit_16_( 32 )
+           , anchor_( 0 )
+           , anchor_time_( 0 )
+           , anchored_( false )
+           , stats_()
+           , esr_flags_( 0 )
 {
     can_active = 0;
 }
@@ -235,8 +257,9 @@ CAN_STATUS
 can::init( stm32f103::CAN_BASE base, uint32_t control )
 {
     status_ = CAN_INIT_FAILED;
-    rx_head_ = rx_tail_ = rx_count_ = rx_lost_ = 0;
-
+    rx_queue_.clear();
+    rx_lost_clear();
+    stats_clear();
     
     if ( auto CAN = reinterpret_cast< volatile stm32f103::CAN * >( base ) ) {
         can_ = CAN;
@@ -270,18 +293,25 @@ can::init( stm32f103::CAN_BASE base, uint32_t control )
                          // CAN_IER_WKUIE |   // Wakeup interrupt
                          CAN_IER_FMPIE0 |  // FIFO message pending interrupt enable
                          CAN_IER_FMPIE1 |  // FIFO message pending interrupt enable FMP[1:0] bits are not 0b00
-                         CAN_IER_TMEIE     // Transmit mailbox empty interrupt enable
+                         CAN_IER_TMEIE |   // Transmit mailbox empty interrupt enable
+                         CAN_IER_ERRIE |   // error interrupt, for the statistics
+                         CAN_IER_LECIE |   // on every error frame
+                         CAN_IER_BOFIE |
+                         CAN_IER_EPVIE |
+                         CAN_IER_EWGIE
                 );
         } while ( 0 );
 
-        condition_wait()( [&]{ return can_->TSR & CAN_TSR_TME0; } );    // Transmit mailbox 0 is empty
-        condition_wait()( [&]{ return can_->TSR & CAN_TSR_TME1; } );    // Transmit mailbox 1 is empty
-        condition_wait()( [&]{ return can_->TSR & CAN_TSR_TME2; } );    // Transmit mailbox 2 is empty
+        DEADLINE_WAIT( can_tx_timeout_us )( [&]{ return can_->TSR & CAN_TSR_TME0; } );    // Transmit mailbox 0 is empty
+        DEADLINE_WAIT( can_tx_timeout_us )( [&]{ return can_->TSR & CAN_TSR_TME1; } );    // Transmit mailbox 1 is empty
+        DEADLINE_WAIT( can_tx_timeout_us )( [&]{ return can_->TSR & CAN_TSR_TME2; } );    // Transmit mailbox 2 is empty
 
         bitset::reset( can_->MSR, CAN_MSR_WKUI );
 
         enable_interrupt( stm32f103::CAN1_TX_IRQn );
         enable_interrupt( stm32f103::CAN1_RX0_IRQn );
+        enable_interrupt( stm32f103::CAN1_RX1_IRQn );
+        enable_interrupt( stm32f103::CAN1_SCE_IRQn );
     }
 
     return status_;
@@ -290,31 +320,35 @@ can::init( stm32f103::CAN_BASE base, uint32_t control )
 CAN_STATUS
 can::set_bitrate( uint32_t bitrate )
 {
-    // BTW based on CAN Bit Time Calculation web site
-    // http://www.bittiming.can-wiki.info/
+    return set_timing( can_timing_solver( bitrate, 875, __pclk1 ? __pclk1 : can_pclk1 ) );
+}
+
+CAN_STATUS
+can::set_timing( const can_timing& t )
+{
+    if ( !t.valid )
+        return CAN_BITRATE_INVALID;
 
-    constexpr uint32_t _2000kbps = 0x001e0000; // n_tq = 18, prescaler = 1, s1=15, s2=2    
-    constexpr uint32_t _1000kbps = 0x001e0001; // n_tq = 18, prescaler = 2, s1=15, s2=2
-    constexpr uint32_t __500kbps = 0x001e0003; // n_tq = 18, prescaler = 4, s1=15, s2=2
-    constexpr uint32_t __250kbps = 0x001c0008; // n_tq = 16, prescaler = 9, s1=13, s2=2
-    constexpr uint32_t __125kbps = 0x001c0011; // n_tq = 16, prescaler = 18, s1=13, s2=2
-    constexpr uint32_t SJW = 0;
-            
     scoped_can_init can_init( *can_ );
     CAN_STATUS status;
     if ( ( status = can_init.enter() ) == CAN_OK ) {
-        if ( bitrate >= 1000000 )
-            can_->BTR = SJW | _1000kbps;
-        else if ( bitrate >= 500000 )
-            can_->BTR = (SJW << 24) | __500kbps;
-        else if ( bitrate >= 250000 )
-            can_->BTR = (SJW << 24) | __250kbps;
-        else 
-            can_->BTR = (SJW << 24) | __125kbps;                
-	}
+        can_->BTR = ( can_->BTR & CAN_MODE_MASK ) | ( t.btr & CAN_TIMING_MASK );
+        // the TTCM counter changes pace; 1/16us is exact for the usual rates at 36MHz (20 at 800k, 192 at 83.3k)
+        bit_16_ = ( 16 * t.prescaler() * t.n_tq() ) / ( t.pclk / 1000000 );
+        anchored_ = false;
+    }
     return status;
 }
 
+can_timing
+can::timing() const
+{
+    const uint32_t pclk = __pclk1 ? __pclk1 : can_pclk1;
+    can_timing t{ pclk, can_->BTR & CAN_TIMING_MASK, 0, 0, true };
+    t.sample_point = uint16_t( ( 1 + t.ts1() ) * 1000 / t.n_tq() );
+    return t;
+}
+
 CAN_STATUS
 can::set_silent_mode( bool enable )
 {
@@ -375,11 +409,52 @@ can::filter( uint8_t filter_idx, CAN_FIFO fifo, CAN_FILTER_SCALE scale, CAN_FILT
 	return CAN_OK;
 }
 
+void
+can::filter_disable( uint8_t filter_idx )
+{
+    bitset::set( can_->FMR, CAN_FMR_FINIT );
+	can_->FA1R &= ~( 0x00000001 << filter_idx );
+    bitset::reset( can_->FMR, CAN_FMR_FINIT );
+}
+
+void
+can::write_mailbox( CAN_TX_MBX mbx, const CanMsg& msg )
+{
+	uint32_t data;
+
+    /* Set up the Id */
+    // stdid[31:21]; exxid[31:3]
+    if (msg.IDE == CAN_ID_STD)
+		data = ( msg.ID << 21 );             // 10bit standard id
+    else
+		data = ( msg.ID << 3 ) | CAN_ID_EXT; // 28bit extended id
+
+	data |= msg.RTR;
+
+    // timestamp [31:16], TGT [8], DLC[3:0] = data length code
+    can_->txMailBox[mbx].TDTR = msg.DLC & 0x0F;
+
+    /* Set up the data field */
+    can_->txMailBox[mbx].TDLR = 
+		uint32_t( msg.Data[3] ) << 24 | 
+		uint32_t( msg.Data[2] ) << 16 |
+		uint32_t( msg.Data[1] ) << 8 | 
+		uint32_t( msg.Data[0] );
+
+    can_->txMailBox[mbx].TDHR = 
+		uint32_t( msg.Data[7] ) << 24 |
+		uint32_t( msg.Data[6] ) << 16 |
+		uint32_t( msg.Data[5] ) << 8 |
+		uint32_t( msg.Data[4] );
+        
+    /* Request transmission */
+    can_->txMailBox[mbx].TIR = (data | CAN_TMIDxR_TXRQ);
+}
+
 CAN_TX_MBX
 can::transmit( CanMsg * msg )
 {
 	CAN_TX_MBX mbx;
-	uint32_t data;
 
 	/* Select one empty transmit mailbox */
 	if (can_->TSR & CAN_TSR_TME0) 
@@ -394,44 +469,120 @@ can::transmit( CanMsg * msg )
 	}
 
     tx_status_[ mbx ] = 0;
+    write_mailbox( mbx, *msg );
+    status_ = CAN_OK;
 
-    /* Set up the Id */
-    // stdid[31:21]; exxid[31:3]
-    if (msg->IDE == CAN_ID_STD)
-		data = ( msg->ID << 21 );             // 10bit standard id
-    else
-		data = ( msg->ID << 3 ) | CAN_ID_EXT; // 28bit extended id
+	return mbx;
+}
 
-	data |= msg->RTR;
+// heap order: arbitration key, then submission order
+static inline bool
+tx_before( uint32_t k1, uint32_t s1, uint32_t k2, uint32_t s2 )
+{
+    return k1 < k2 || ( k1 == k2 && int32_t( s1 - s2 ) < 0 );
+}
 
-    // timestamp [31:16], TGT [8], DLC[3:0] = data length code
-    can_->txMailBox[mbx].TDTR = msg->DLC & 0x0F;
+bool
+can::tx_push( const tx_entry& e )
+{
+    if ( tx_count_ >= tx_heap_.size() )
+        return false;
+    size_t i = tx_count_++;
+    while ( i > 0 ) {
+        size_t parent = ( i - 1 ) / 2;
+        if ( !tx_before( e.key, e.seq, tx_heap_[ parent ].key, tx_heap_[ parent ].seq ) )
+            break;
+        tx_heap_[ i ] = tx_heap_[ parent ];
+        i = parent;
+    }
+    tx_heap_[ i ] = e;
+    return true;
+}
 
-    /* Set up the data field */
-    can_->txMailBox[mbx].TDLR = 
-		uint32_t( msg->Data[3] ) << 24 | 
-		uint32_t( msg->Data[2] ) << 16 |
-		uint32_t( msg->Data[1] ) << 8 | 
-		uint32_t( msg->Data[0] );
+void
+can::tx_pop( tx_entry& e )
+{
+    e = tx_heap_[ 0 ];
+    const tx_entry& last = tx_heap_[ --tx_count_ ];
+    size_t i = 0;
+    for ( size_t child; ( child = 2 * i + 1 ) < tx_count_; i = child ) {
+        if ( child + 1 < tx_count_ && tx_before( tx_heap_[ child + 1 ].key, tx_heap_[ child + 1 ].seq
+                                                 , tx_heap_[ child ].key, tx_heap_[ child ].seq ) )
+            ++child;
+        if ( !tx_before( tx_heap_[ child ].key, tx_heap_[ child ].seq, last.key, last.seq ) )
+            break;
+        tx_heap_[ i ] = tx_heap_[ child ];
+    }
+    tx_heap_[ i ] = last;
+}
 
-    can_->txMailBox[mbx].TDHR = 
-		uint32_t( msg->Data[7] ) << 24 |
-		uint32_t( msg->Data[6] ) << 16 |
-		uint32_t( msg->Data[5] ) << 8 |
-		uint32_t( msg->Data[4] );
-        
-    /* Request transmission */
-    can_->txMailBox[mbx].TIR = (data | CAN_TMIDxR_TXRQ);
-    status_ = CAN_OK;
+// interrupts masked, or in the tx isr
+void
+can::tx_refill()
+{
+    constexpr uint32_t tme[] = { CAN_TSR_TME0, CAN_TSR_TME1, CAN_TSR_TME2 };
+    constexpr uint32_t rqcp[] = { CAN_TSR_RQCP0, CAN_TSR_RQCP1, CAN_TSR_RQCP2 };
+    constexpr uint32_t abrq[] = { CAN_TSR_ABRQ0, CAN_TSR_ABRQ1, CAN_TSR_ABRQ2 };
+
+    while ( tx_count_ ) {
+        const uint32_t tsr = can_->TSR;
+        int mbx = -1;
+        for ( int m = 0; m < 3 && mbx < 0; ++m ) {
+            // a completion the isr has not seen yet still owns the mailbox
+            if ( ( tsr & tme[ m ] ) && !( tsr & rqcp[ m ] ) && !( tx_owned_ & ( 1 << m ) ) )
+                mbx = m;
+        }
 
-	return mbx;
+        if ( mbx < 0 ) {
+            // all busy; bxCAN sends the lowest id among the mailboxes (TXFP=0), but a lower id
+            // waiting here would lose to all three -- abort the highest queued one to make room
+            if ( tx_owned_ == 07 && tx_abort_ == 0 ) {
+                int victim = 0;
+                for ( int m = 1; m < 3; ++m )
+                    if ( tx_before( tx_mbx_[ victim ].key, tx_mbx_[ victim ].seq, tx_mbx_[ m ].key, tx_mbx_[ m ].seq ) )
+                        victim = m;
+                if ( tx_before( tx_heap_[ 0 ].key, tx_heap_[ 0 ].seq, tx_mbx_[ victim ].key, tx_mbx_[ victim ].seq ) ) {
+                    tx_abort_ |= 1 << victim;
+                    can_->TSR = abrq[ victim ];   // other bits are rc_w1 and written 0
+                }
+            }
+            break;
+        }
+
+        tx_pop( tx_mbx_[ mbx ] );
+        tx_owned_ |= 1 << mbx;
+        tx_status_[ mbx ] = 0;
+        write_mailbox( CAN_TX_MBX( mbx ), tx_mbx_[ mbx ].msg );
+    }
+}
+
+bool
+can::enqueue( const CanMsg& msg, can_tx_callback callback )
+{
+    tx_entry e;
+    e.key = ( msg.IDE == CAN_ID_STD ? ( msg.ID << 21 ) : ( ( msg.ID << 3 ) | CAN_ID_EXT ) ) | ( msg.RTR & CAN_RTR_REMOTE );
+    e.msg = msg;
+    e.callback = callback;
+
+    scoped_irq_lock lock;
+    e.seq = tx_seq_++;
+    if ( !tx_push( e ) )
+        return false;
+    tx_refill();
+    return true;
+}
+
+size_t
+can::tx_pending() const
+{
+    return tx_count_;
 }
 
 CAN_STATUS
-can::tx_status( CAN_TX_MBX mbx, uint32_t timeout )
+can::tx_status( CAN_TX_MBX mbx, uint32_t timeout_us )
 {
 	/* RQCP, TXOK and TME bits */
-    if ( condition_wait( timeout )( [&]{ return tx_status_[ mbx ].load(); } ) ) {
+    if ( DEADLINE_WAIT( timeout_us, true )( [&]{ return tx_status_[ mbx ].load(); } ) ) {
 
         uint8_t state = tx_status_[ mbx ];
 
@@ -472,13 +623,13 @@ can::cancel( uint8_t mbx )
 	/* abort transmission */
 	switch (mbx) {
 	case 0:
-		can_->TSR |= CAN_TSR_ABRQ0;
+		can_->TSR = CAN_TSR_ABRQ0;	// |= would clear pending RQCPx
 		break;
 	case 1:
-		can_->TSR |= CAN_TSR_ABRQ1;
+		can_->TSR = CAN_TSR_ABRQ1;	// |= would clear pending RQCPx
 		break;
 	case 2:
-		can_->TSR |= CAN_TSR_ABRQ2;
+		can_->TSR = CAN_TSR_ABRQ2;	// |= would clear pending RQCPx
 		break;
 	default:
 		break;
@@ -488,32 +639,64 @@ can::cancel( uint8_t mbx )
 void
 can::rx_queue_clear()
 {
-	// nvic_irq_disable(NVIC_USB_LP_CAN_RX0);
-	rx_head_ = rx_tail_ = rx_count_ = rx_lost_ = 0;
-	// nvic_irq_enable(NVIC_USB_LP_CAN_RX0);
+    rx_queue_.clear();
+}
+
+void
+can::rx_lost_clear()
+{
+    rx_lost_[ CAN_FIFO_0 ] = 0;
+    rx_lost_[ CAN_FIFO_1 ] = 0;
+}
+
+can_stats
+can::stats()
+{
+    scoped_irq_lock lock;
+    // ABOM leaves bus-off without an interrupt
+    const uint32_t esr = can_->ESR;
+    if ( stats_.in_bus_off && !( esr & CAN_ESR_BOFF ) ) {
+        stats_.in_bus_off = false;
+        ++stats_.bus_off_recovered;
+    }
+    esr_flags_ = esr & ( CAN_ESR_EWGF | CAN_ESR_EPVF | CAN_ESR_BOFF );  // leaving a state raises no irq
+    stats_.tec = ( esr & CAN_ESR_TEC ) >> 16;
+    stats_.rec = ( esr & CAN_ESR_REC ) >> 24;
+    return stats_;
+}
+
+void
+can::stats_clear()
+{
+    scoped_irq_lock lock;
+    const bool in_bus_off = stats_.in_bus_off;
+    stats_ = can_stats();
+    stats_.since = atomic_jiffies.load();
+    stats_.in_bus_off = in_bus_off;
 }
 
 uint8_t
 can::rx_available(void)
 {
-	return rx_count_;
+    return uint8_t( rx_queue_.size() );
 }
 
 CanMsg *
 can::rx_queue_get(void)
 {
-	if (rx_count_ == 0)
-		return nullptr;
-	return &( rx_queue_[ rx_tail_ ] );
+    return rx_queue_.front();
 }
 
 void
 can::rx_queue_free()
 {
-	if ( rx_count_ > 0 ) {
-		rx_tail_ = ( rx_tail_ == (CAN_RX_QUEUE_SIZE - 1)) ? 0 : (rx_tail_ + 1);
-		--rx_count_;
-	}
+    rx_queue_.pop();
+}
+
+size_t
+can::rx_drain( CanMsg * msgs, size_t n )
+{
+    return rx_queue_.drain( msgs, n );
 }
 
 CanMsg*
@@ -533,6 +716,9 @@ can::read( CAN_FIFO fifo, CanMsg* msg )
 	msg->RTR = CAN_RTR_REMOTE & data;
 	msg->DLC = 0x0F & can_->fifoMailBox[fifo].RDTR;
 	msg->FMI = 0xFF & (can_->fifoMailBox[fifo].RDTR >> 8);
+	msg->FIFO = fifo;
+	msg->TIME = uint16_t( can_->fifoMailBox[fifo].RDTR >> 16 );
+	msg->timestamp = extend_timestamp( msg->TIME );
 
 	/* Get the data field */
 	data = can_->fifoMailBox[fifo].RDLR;
@@ -551,6 +737,40 @@ can::read( CAN_FIFO fifo, CanMsg* msg )
 	return msg;
 }
 
+// rx isr context. The frame was received before now and after the anchor, less one wrap, so the
+// counter difference is unwrapped to the latest time not later than now. The first frame (and the first
+// after 2^30/16 us, 67s, of silence) anchors at now: absolute time is good to the isr latency, intervals
+// between frames to one bit time.
+uint64_t
+can::extend_timestamp( uint16_t time )
+{
+    const uint64_t now = ( jiffies + 1 ) * 100 * 16;   // upper bound of the current time
+    if ( !anchored_ || int64_t( now - anchor_ ) >= 0x40000000 ) {
+        anchored_ = true;
+        anchor_ = now;
+        anchor_time_ = time;
+        return now >> 4;
+    }
+
+    const int32_t wrap = int32_t( 65536 * bit_16_ );
+    const int32_t elapsed = int32_t( now - anchor_ ) + wrap / 4;  // the first anchor is late by the isr latency
+    const int32_t d = int32_t( uint16_t( time - anchor_time_ ) * bit_16_ );
+
+    // largest d + k * wrap <= elapsed; k is -1 for a frame older than the anchor (other FIFO)
+    int32_t delta = d;
+    if ( elapsed >= d )
+        delta += ( ( elapsed - d ) / wrap ) * wrap;
+    else
+        delta -= wrap;
+
+    const uint64_t ts = anchor_ + delta;
+    if ( delta > 0 ) {
+        anchor_ = ts;
+        anchor_time_ = time;
+    }
+    return ts >> 4;
+}
+
 void
 can::rx_release( CAN_FIFO fifo )
 {
@@ -560,16 +780,24 @@ can::rx_release( CAN_FIFO fifo )
 		can_->RF1R |= (CAN_RF1R_RFOM1);	// Release FIFO1
 }
 
+// rx isr context, the only producer of rx_queue_
 void
 can::rx_read( CAN_FIFO fifo )
 {
-	if ( rx_count_ < CAN_RX_QUEUE_SIZE ) {	// read the message
-		CanMsg * msg = &rx_queue_[rx_head_];
-		read( fifo, msg);
-		rx_head_ = (rx_head_ == (CAN_RX_QUEUE_SIZE - 1)) ? 0 : (rx_head_ + 1);
-		rx_count_++;
-	} else
-		rx_lost_ = 1;						// no place in queue, ignore package
+    volatile uint32_t& rfr = ( fifo == CAN_FIFO_0 ) ? can_->RF0R : can_->RF1R;
+    if ( rfr & CAN_RF0R_FOVR0 ) {          // same bit in RF1R; a 4th frame arrived while the FIFO was full
+        rfr = CAN_RF0R_FOVR0;              // rc_w1
+        ++rx_lost_[ fifo ];
+    }
+
+	stats_.count( can_->fifoMailBox[fifo].RIR, can_->fifoMailBox[fifo].RDTR, false );
+
+	if ( auto msg = rx_queue_.prepare() ) {
+		read( fifo, msg );
+		rx_queue_.commit();
+	} else {
+		++rx_lost_[ fifo ];                // no place in queue, ignore package
+	}
 
 	rx_release(fifo);
 }
@@ -589,7 +817,8 @@ can::handle_rx0_interrupt()
 void
 can::handle_rx1_interrupt()
 {
-    stream(__FILE__,__LINE__,__FUNCTION__) << "\n" << std::endl;
+    // same priority as rx0, so the queue still sees a single producer
+    handle_rx0_interrupt();
 }
 
 void
@@ -601,28 +830,87 @@ can::handle_tx_interrupt()
         tx_status_[ 0 ] =  tsr & CAN_TSR_RQCP0 ? 4 : 0;
         tx_status_[ 0 ] |= tsr & CAN_TSR_TXOK0 ? 2 : 0;
         tx_status_[ 0 ] |= tsr & CAN_TSR_TME0  ? 1 : 0;
-        can_->TSR |= CAN_TSR_RQCP0;		// reset request complete mbx 0
+        can_->TSR = CAN_TSR_RQCP0;		// reset request complete mbx 0; rc_w1, the others are written 0
     }
 
     if ( tsr & CAN_TSR_RQCP1) {
         tx_status_[ 1 ] =  tsr & CAN_TSR_RQCP1 ? 4 : 0;
         tx_status_[ 1 ] |= tsr & CAN_TSR_TXOK1 ? 2 : 0;
         tx_status_[ 1 ] |= tsr & CAN_TSR_TME1  ? 1 : 0;   
-        can_->TSR |= CAN_TSR_RQCP1;		// reset request complete mbx 1
+        can_->TSR = CAN_TSR_RQCP1;		// reset request complete mbx 1; rc_w1, the others are written 0
     }
 
     if ( tsr & CAN_TSR_RQCP2) {
         tx_status_[ 2 ] =  tsr & CAN_TSR_RQCP2 ? 4 : 0;
         tx_status_[ 2 ] |= tsr & CAN_TSR_TXOK2 ? 2 : 0;
         tx_status_[ 2 ] |= tsr & CAN_TSR_TME2  ? 1 : 0;   
-        can_->TSR |= CAN_TSR_RQCP2;		// reset request complete mbx 2
+        can_->TSR = CAN_TSR_RQCP2;		// reset request complete mbx 2; rc_w1, the others are written 0
     }
+
+    for ( int m = 0; m < 3; ++m ) {
+        if ( !( tsr & ( CAN_TSR_RQCP0 << ( 8 * m ) ) ) )
+            continue;
+        if ( tsr & ( CAN_TSR_TXOK0 << ( 8 * m ) ) )
+            stats_.count( can_->txMailBox[ m ].TIR, can_->txMailBox[ m ].TDTR, true );
+        else
+            ++stats_.tx_failed;
+    }
+
+    // queued frames: report, requeue the ones aborted for a lower id, refill
+    scoped_irq_lock lock;
+    for ( int m = 0; m < 3; ++m ) {
+        const uint32_t rqcp = CAN_TSR_RQCP0 << ( 8 * m ), txok = CAN_TSR_TXOK0 << ( 8 * m );
+        const uint8_t bit = 1 << m;
+        if ( !( tsr & rqcp ) || !( tx_owned_ & bit ) )
+            continue;
+        tx_owned_ &= ~bit;
+        const bool ok = tsr & txok;
+        if ( ( tx_abort_ & bit ) && !ok && tx_push( tx_mbx_[ m ] ) ) {
+            tx_abort_ &= ~bit;
+            continue;
+        }
+        tx_abort_ &= ~bit;
+        if ( tx_mbx_[ m ].callback )
+            tx_mbx_[ m ].callback( tx_mbx_[ m ].msg, ok ? CAN_OK : CAN_TX_FAILED );
+    }
+    tx_refill();
 }
 
+// error and status change; counts the error states on entry and the last error code of every
+// error frame (LEC is set to 7 after reading, so the next error shows up as a change)
 void
 can::handle_sce_interrupt()
 {
-    stream(__FILE__,__LINE__,__FUNCTION__) << "\n" << std::endl;
+    const uint32_t esr = can_->ESR;
+    const uint8_t tec = ( esr & CAN_ESR_TEC ) >> 16;
+    const uint8_t rec = ( esr & CAN_ESR_REC ) >> 24;
+    const uint32_t lec = ( esr & CAN_ESR_LEC ) >> 4;
+
+    if ( lec != 0 && lec != 7 ) {
+        ++stats_.lec[ lec ];
+        can_->ESR = esr | CAN_ESR_LEC;
+    }
+    if ( tec > stats_.tec_max )
+        stats_.tec_max = tec;
+    if ( rec > stats_.rec_max )
+        stats_.rec_max = rec;
+
+    const uint32_t flags = esr & ( CAN_ESR_EWGF | CAN_ESR_EPVF | CAN_ESR_BOFF );
+    const uint32_t entered = flags & ~esr_flags_;
+    if ( entered & CAN_ESR_EWGF )
+        ++stats_.error_warning;
+    if ( entered & CAN_ESR_EPVF )
+        ++stats_.error_passive;
+    if ( entered & CAN_ESR_BOFF ) {
+        ++stats_.bus_off;
+        stats_.in_bus_off = true;
+    } else if ( stats_.in_bus_off && !( flags & CAN_ESR_BOFF ) ) {
+        stats_.in_bus_off = false;
+        ++stats_.bus_off_recovered;
+    }
+    esr_flags_ = flags;
+
+    can_->MSR = CAN_MSR_ERRI;   // rc_w1
 }
 
 
@@ -660,7 +948,7 @@ can::print_registers()
              << " n_tq="       << n_tq
              << " loopback-mode:" << (btr & 0x40000000 ? "[on]" : "[off]" )
              << " silent-mode:" << (btr & 0x80000000 ? "[on]" : "[off]" );
-    stream() << " baudrate=" << int( pclk1 / ( prescaler * n_tq ) );
+    stream() << " baudrate=" << int( timing().hz() );
 }
 
 bool
@@ -3,7 +3,9 @@
 #include <array>
 #include <atomic>
 #include <cstdint>
+#include "can_stats.hpp"
 #include "scoped_spinlock.hpp"
+#include "spsc_ring.hpp"
 
 //  CAN Master Control Register bits
 enum CAN_MasterControlRegister {
@@ -28,6 +30,7 @@ enum CAN_STATUS {
     , CAN_TX_PENDING
     , CAN_NO_MB
     , CAN_FILTER_FULL
+    , CAN_BITRATE_INVALID
 };
 
 enum CAN_FIFO {
@@ -58,10 +61,29 @@ struct CanMsg {
 	uint8_t RTR;
 	uint8_t DLC;
 	uint8_t Data[8];
-	uint8_t FMI;
-    CanMsg() : ID(0), IDE(0), RTR(0), DLC(0), Data{ 0 }, FMI(0) {}
+	uint8_t FMI;		// filter match index, numbered per FIFO
+	uint8_t FIFO;		// CAN_FIFO the frame was received in
+	uint16_t TIME;		// TTCM bit time counter at SOF, as captured in RDTR
+	uint64_t timestamp;	// us, TIME extended onto the monotonic (jiffies) clock
+    CanMsg() : ID(0), IDE(0), RTR(0), DLC(0), Data{ 0 }, FMI(0), FIFO(0), TIME(0), timestamp(0) {}
 };
 
+// seconds and the microsecond remainder of a timestamp, without 64bit division
+inline uint32_t
+can_timestamp_split( uint64_t us, uint32_t& usec )
+{
+    constexpr uint32_t d = 1000000;     // < 2^20, so ( r << 12 ) | 12 bits fits 32bit
+    uint64_t q = 0;
+    uint32_t r = 0;
+    for ( int shift = 60; shift >= 0; shift -= 12 ) {
+        const uint32_t cur = ( r << 12 ) | uint32_t( ( us >> shift ) & 0xfff );
+        q = ( q << 12 ) | ( cur / d );
+        r = cur % d;
+    }
+    usec = r;
+    return uint32_t( q );
+}
+
 enum CAN_Identifier : uint32_t {
     CAN_ID_STD	 = 0x00 //  Standard Id
     , CAN_ID_EXT = 0x04
@@ -76,7 +98,86 @@ namespace stm32f103 {
 
     enum CAN_BASE : uint32_t;
 
-    constexpr int CAN_RX_QUEUE_SIZE = 8;
+    constexpr size_t CAN_RX_QUEUE_SIZE = 32;      // power of two; ~20 bytes each
+    constexpr uint32_t can_tx_timeout_us = 10000; // a full frame at 125kbps is ~1ms
+    constexpr size_t CAN_TX_QUEUE_SIZE = 16;
+
+    constexpr uint32_t can_pclk1 = 36000000;
+
+    // BTR timing fields (RM0008 24.7.7); bit time = (1 + TS1 + TS2) tq, tq = BRP * tpclk
+    struct can_timing {
+        uint32_t pclk;
+        uint32_t btr;            // SJW[25:24] | TS2[22:20] | TS1[19:16] | BRP[9:0], each minus one
+        uint16_t sample_point;   // achieved, permille
+        uint32_t error_ppm;      // |achieved - requested| bitrate
+        bool valid;
+
+        constexpr uint32_t prescaler() const { return ( btr & 0x3ff ) + 1; }
+        constexpr uint32_t ts1() const { return ( ( btr >> 16 ) & 0x0f ) + 1; }
+        constexpr uint32_t ts2() const { return ( ( btr >> 20 ) & 07 ) + 1; }
+        constexpr uint32_t sjw() const { return ( ( btr >> 24 ) & 03 ) + 1; }
+        constexpr uint32_t n_tq() const { return 1 + ts1() + ts2(); }
+        constexpr uint32_t hz() const { return valid ? pclk / ( prescaler() * n_tq() ) : 0; }
+    };
+
+    // Searches n_tq 25..8 with the nearest prescaler; least bitrate error first, then the sample point
+    // closest to the request, then more quanta. TS2 >= 2, SJW = min(TS2, 4). valid is false above max_error_ppm.
+    // Integer only, no 64bit division, so it serves at runtime as well.
+    constexpr can_timing
+    can_timing_solver( uint32_t bitrate, uint16_t sample_point = 875, uint32_t pclk = can_pclk1, uint32_t max_error_ppm = 5000 )
+    {
+        can_timing best{ pclk, 0, 0, 0xffffffff, false };
+        if ( bitrate < 1000 || bitrate > 1000000 || sample_point < 500 || sample_point >= 1000 )
+            return best;
+
+        uint32_t best_sp_diff = 0xffffffff;
+        for ( uint32_t n_tq = 25; n_tq >= 8; --n_tq ) {
+            const uint32_t brp = ( pclk + bitrate * n_tq / 2 ) / ( bitrate * n_tq );
+            if ( brp == 0 || brp > 1024 )
+                continue;
+
+            uint32_t ts2 = ( n_tq * ( 1000 - sample_point ) + 500 ) / 1000;
+            ts2 = ts2 < 2 ? 2 : ts2 > 8 ? 8 : ts2;   // TS2 >= 2 leaves room for resynchronization
+            uint32_t ts1 = n_tq - 1 - ts2;
+            if ( ts1 > 16 ) {
+                ts1 = 16;
+                ts2 = n_tq - 1 - ts1;
+            }
+            if ( ts1 < 1 || ts2 < 2 || ts2 > 8 )
+                continue;
+
+            const uint32_t achieved = pclk / ( brp * n_tq );
+            const uint32_t diff = achieved > bitrate ? achieved - bitrate : bitrate - achieved;
+            const uint32_t error = diff * 1000 / ( bitrate / 1000 );
+            const uint32_t sp = ( 1 + ts1 ) * 1000 / n_tq;
+            const uint32_t sp_diff = sp > sample_point ? sp - sample_point : sample_point - sp;
+
+            if ( error < best.error_ppm || ( error == best.error_ppm && sp_diff < best_sp_diff ) ) {
+                const uint32_t sjw = ts2 < 4 ? ts2 : 4;
+                best.btr = ( ( sjw - 1 ) << 24 ) | ( ( ts2 - 1 ) << 20 ) | ( ( ts1 - 1 ) << 16 ) | ( brp - 1 );
+                best.sample_point = uint16_t( sp );
+                best.error_ppm = error;
+                best_sp_diff = sp_diff;
+            }
+        }
+        best.valid = best.error_ppm <= max_error_ppm;
+        return best;
+    }
+
+    constexpr can_timing can_125kbps  = can_timing_solver( 125000 );
+    constexpr can_timing can_250kbps  = can_timing_solver( 250000 );
+    constexpr can_timing can_500kbps  = can_timing_solver( 500000 );
+    constexpr can_timing can_1000kbps = can_timing_solver( 1000000 );
+
+    // same quanta as the former hand computed constants (SJW aside)
+    static_assert( ( can_125kbps.btr & 0x007f03ff ) == 0x001c0011 && can_125kbps.error_ppm == 0, "" );
+    static_assert( ( can_250kbps.btr & 0x007f03ff ) == 0x001c0008 && can_250kbps.sample_point == 875, "" );
+    static_assert( ( can_500kbps.btr & 0x007f03ff ) == 0x001e0003, "" );
+    static_assert( ( can_1000kbps.btr & 0x007f03ff ) == 0x001e0001 && can_1000kbps.hz() == 1000000, "" );
+    static_assert( can_timing_solver( 800000 ).valid && can_timing_solver( 800000 ).hz() == 800000, "" );
+
+    // tx isr context, once the frame's mailbox has completed (CAN_OK) or failed (CAN_TX_FAILED)
+    typedef void (*can_tx_callback)( const CanMsg&, CAN_STATUS );
 
     struct CAN;
 
@@ -84,19 +185,44 @@ namespace stm32f103 {
         volatile CAN * can_;
 
         CAN_STATUS status_;
-        uint8_t rx_head_;
-        uint8_t rx_tail_;
-        uint8_t rx_count_;
-        uint8_t rx_lost_;
         uint8_t active_;
         std::atomic< uint8_t > tx_status_[3];
         
-        CanMsg rx_queue_[ CAN_RX_QUEUE_SIZE ];
+        // software tx queue, a binary heap in arbitration order; the tx irq refills mailboxes from it
+        struct tx_entry {
+            uint32_t key;                                  // TIR image without TXRQ, lower wins on the bus
+            uint32_t seq;                                  // fifo among equal ids
+            CanMsg msg;
+            can_tx_callback callback;
+        };
+        std::array< tx_entry, CAN_TX_QUEUE_SIZE > tx_heap_;
+        size_t tx_count_;
+        uint32_t tx_seq_;
+        std::array< tx_entry, 3 > tx_mbx_;                 // in the mailbox, for the callback or a requeue
+        uint8_t tx_owned_;                                 // mailboxes loaded from the queue
+        uint8_t tx_abort_;                                 // of those, aborted to let a lower id pass
+        bool tx_push( const tx_entry& );
+        void tx_pop( tx_entry& );
+        void tx_refill();
+        void write_mailbox( CAN_TX_MBX, const CanMsg& );
+
+        // TTCM timestamp extension, rx isr only. The 16bit counter runs at the bit rate and wraps
+        // every 65536 bit times (65ms at 1Mbps); the anchor pairs a counter value with 1/16us time.
+        uint32_t bit_16_;                                  // bit time in 1/16 us
+        uint64_t anchor_;                                  // 1/16 us
+        uint16_t anchor_time_;
+        bool anchored_;
+        uint64_t extend_timestamp( uint16_t time );
+
+        spsc_ring< CanMsg, CAN_RX_QUEUE_SIZE > rx_queue_;  // rx isr -> thread
+        std::atomic< uint32_t > rx_lost_[ 2 ];             // per FIFO: queue full or hardware FIFO overrun
+        can_stats stats_;                                  // isrs only, read under the irq lock
+        uint32_t esr_flags_;                               // EWGF, EPVF, BOFF at the last sce irq
         CAN_STATUS init_enter();
         CAN_STATUS init_leave();
         can();        
         template< CAN_BASE > friend struct can_t;
-        CAN_STATUS init( stm32f103::CAN_BASE, uint32_t control = CAN_MCR_NART );
+        CAN_STATUS init( stm32f103::CAN_BASE, uint32_t control = CAN_MCR_NART | CAN_MCR_TTCM | CAN_MCR_ABOM );
 
         void rx_read( CAN_FIFO fifo );
         void rx_release( CAN_FIFO fifo );
@@ -116,7 +242,9 @@ namespace stm32f103 {
 
         CAN_STATUS set_silent_mode( bool );
         CAN_STATUS set_loopback_mode( bool );
-        CAN_STATUS set_bitrate( uint32_t );
+        CAN_STATUS set_bitrate( uint32_t );           // solved for the current pclk1, 87.5% sample point
+        CAN_STATUS set_timing( const can_timing& );  // keeps loopback/silent
+        can_timing timing() const;
         
         bool loopback_mode() const;
         bool silent_mode() const;
@@ -126,9 +254,15 @@ namespace stm32f103 {
                            , CAN_FILTER_SCALE scale = CAN_FILTER_32BIT
                            , CAN_FILTER_MODE mode = CAN_FILTER_MASK
                            , uint32_t fr1 = 0, uint32_t fr2 = 0 );
+        void filter_disable( uint8_t filter_idx );
 
         CAN_TX_MBX transmit( CanMsg* msg );
-        CAN_STATUS tx_status( CAN_TX_MBX mbx, uint32_t timeout = 0xffff );
+
+        // non-blocking; queued by id and sent lowest id first as mailboxes free up.
+        // false when the queue is full. Safe from thread and isr context.
+        bool enqueue( const CanMsg&, can_tx_callback = nullptr );
+        size_t tx_pending() const;      // queued, not yet in a mailbox
+        CAN_STATUS tx_status( CAN_TX_MBX mbx, uint32_t timeout_us = can_tx_timeout_us ); // wfe until the tx irq reports
 
         void cancel( uint8_t );
 
@@ -137,6 +271,16 @@ namespace stm32f103 {
         void rx_queue_free();
         CanMsg * rx_queue_get();
 
+        // copies up to n received frames out in one go, returns the count
+        size_t rx_drain( CanMsg * msgs, size_t n );
+        template< size_t N > inline size_t rx_drain( std::array< CanMsg, N >& msgs ) { return rx_drain( msgs.data(), N ); }
+
+        inline uint32_t rx_lost( CAN_FIFO fifo ) const { return rx_lost_[ fifo ].load(); }
+        void rx_lost_clear();
+
+        can_stats stats();              // consistent copy, with the current TEC/REC
+        void stats_clear();
+
         void handle_tx_interrupt();
         void handle_rx0_interrupt();
         void handle_rx1_interrupt();
@@ -8,6 +8,8 @@
 // stm32f> candump [cr]
 
 #include "can.hpp"
+#include "can_filter.hpp"
+#include "can_isotp.hpp"
 #include "condition_wait.hpp"
 #include "dma.hpp"
 #include "stm32f103.hpp"
@@ -25,9 +27,11 @@ constexpr const char * __can_status_strings [] = {
     , "CAN_TX_PENDING"
     , "CAN_NO_MB"
     , "CAN_FILTER_FULL"
+    , "CAN_BITRATE_INVALID"
 };
 
 extern void mdelay( uint32_t );
+extern std::atomic< uint32_t > atomic_jiffies;
 
 static uint32_t __cansend_repeat;
 
@@ -72,14 +76,36 @@ cansend( const char * data )
 
     if ( msg.ID ) {
         auto can = stm32f103::can_t< stm32f103::CAN1_BASE >::instance();
-        can->filter( 0, CAN_FIFO_0, CAN_FILTER_32BIT, CAN_FILTER_MASK, 0, 0 ); // idx, fifo, scale, mode, fr1, fr2
+        static std::atomic< uint32_t > __sent, __failed;
+        static uint32_t __queued;
+        auto callback = +[]( const CanMsg&, CAN_STATUS status ){ ++( status == CAN_OK ? __sent : __failed ); };
+
+        // queued frames plus the three mailboxes, at the worst case frame length (extended id,
+        // 8 bytes, bit stuffing ~160 bits) for the current bitrate; 3s at 1kbps
+        auto drain_us = [&]{
+            const uint32_t hz = can->timing().hz();
+            const uint32_t frame_us = 160 * 1000 / ( ( hz ? hz : 125000 ) / 1000 );
+            return uint32_t( can->tx_pending() + 3 ) * frame_us + stm32f103::can_tx_timeout_us;
+        };
+
+        // callbacks of a previous burst, still in flight, would count against this one
+        if ( ! DEADLINE_WAIT( drain_us(), true )( [&]{ return __sent + __failed >= __queued; } ) )
+            stream(__FILE__,__LINE__) << "cansend: previous burst incomplete" << std::endl;
+        __sent = __failed = 0;
+        __queued = 0;
+
+        // the whole burst is queued; only a full queue makes us wait for the tx irq
         for ( uint32_t i = 0; i < __cansend_repeat; ++i ) {
-            auto mbx = can->transmit( &msg );
-            auto state = can->tx_status( mbx );
-            if ( state != CAN_OK )
-                stream(__FILE__,__LINE__) << __can_status_strings[ state ] << std::endl;
-            mdelay( 100 );
+            if ( ! DEADLINE_WAIT( stm32f103::can_tx_timeout_us, true )( [&]{ return can->enqueue( msg, callback ); } ) ) {
+                stream(__FILE__,__LINE__) << "tx queue stalled" << std::endl;
+                break;
+            }
+            ++__queued;
         }
+        DEADLINE_WAIT( drain_us(), true )( [&]{ return __sent + __failed >= __queued; } );
+        if ( __failed || __sent < __cansend_repeat )
+            stream(__FILE__,__LINE__) << "cansend: " << int( __sent.load() ) << " sent, "
+                                      << int( __failed.load() ) << " failed of " << int( __cansend_repeat ) << std::endl;
     }
 }
 
@@ -92,20 +118,254 @@ candump()
     while ( count-- && !can->rx_available() )
         mdelay( 10 );
 
-    while ( auto rx = can->rx_queue_get() ) {
-        // stream() << "\nCAN Recv:\tID: " << rx->ID << ", RTR: " << rx->RTR
-        //                                        << ", DLC: " << rx->DLC << ", FMI: " << rx->FMI << "\tdata: \t";
-        stream() << "\nCAN Recv:\tID: " << rx->ID << "\tdata:\t";
+    // batches free the ring for the isr before the (slow) printing
+    std::array< CanMsg, 8 > msgs;
+    while ( size_t n = can->rx_drain( msgs ) ) {
+        for ( size_t k = 0; k < n; ++k ) {
+            const auto rx = &msgs[ k ];
+            // stream() << "\nCAN Recv:\tID: " << rx->ID << ", RTR: " << rx->RTR
+            //                                        << ", DLC: " << rx->DLC << ", FMI: " << rx->FMI << "\tdata: \t";
+            uint32_t usec;
+            const uint32_t sec = can_timestamp_split( rx->timestamp, usec );
+            char frac[ 8 ] = ".000000";
+            for ( int i = 6; i > 0; --i, usec /= 10 )
+                frac[ i ] = char( '0' + usec % 10 );
+            stream() << "\nCAN Recv:\t" << int( sec ) << frac << "\tID: " << rx->ID
+                     << "\tFIFO" << int( rx->FIFO ) << "/" << int( rx->FMI ) << "\tdata:\t";
 
-        for ( int i = 0; i < sizeof( rx->Data ); ++i )
-            stream() << rx->Data[ i ] << ", ";
+            for ( int i = 0; i < sizeof( rx->Data ); ++i )
+                stream() << rx->Data[ i ] << ", ";
 
-        stream() << std::endl;
-        
-        can->rx_queue_free();
+            stream() << std::endl;
+        }
+    }
+
+    static uint32_t __lost;
+    const uint32_t lost = can->rx_lost( CAN_FIFO_0 ) + can->rx_lost( CAN_FIFO_1 );
+    if ( lost != __lost ) {
+        stream() << "CAN lost:\tFIFO0 " << int( can->rx_lost( CAN_FIFO_0 ) )
+                 << ", FIFO1 " << int( can->rx_lost( CAN_FIFO_1 ) ) << std::endl;
+        __lost = lost;
     }
 }
 
+static stm32f103::can_filter_bank&
+can_filters()
+{
+    static stm32f103::can_filter_bank __filters;
+    return __filters;
+}
+
+// programs the 'can filter' subscriptions, or accept all when there are none or they do not fit
+void
+can_filter_restore()
+{
+    auto cbus = stm32f103::can_t< stm32f103::CAN1_BASE >::instance();
+    auto& filters = can_filters();
+
+    if ( filters.size() && filters.apply( *cbus ) )
+        return;
+    cbus->filter( 0, CAN_FIFO_0, CAN_FILTER_32BIT, CAN_FILTER_MASK, 0, 0 ); // accept all
+    for ( uint8_t i = 1; i < stm32f103::can_filter_bank::max_banks; ++i )
+        cbus->filter_disable( i );
+}
+
+static void
+can_filter_print( const stm32f103::can_filter_bank& filters )
+{
+    constexpr const char * formats [] = { "32bit mask", "32bit list", "16bit mask", "16bit list" };
+    for ( size_t i = 0; i < filters.banks(); ++i ) {
+        const auto& b = filters.at( i );
+        stream() << "\tbank " << int( i ) << " FIFO" << int( b.fifo ) << " " << formats[ ( b.scale << 1 ) | b.mode ]
+                 << "\t" << b.fr1 << ", " << b.fr2 << std::endl;
+    }
+    for ( uint8_t fifo = 0; fifo < 2; ++fifo ) {
+        for ( uint8_t fmi = 0; fmi < stm32f103::can_filter_bank::max_banks * 4; ++fmi ) {
+            auto i = filters.subscription_of( fifo, fmi );
+            if ( i != stm32f103::can_filter_bank::none )
+                stream() << "\tFIFO" << int( fifo ) << "/" << int( fmi ) << " -> " << filters.subscription( i ).id
+                         << "/" << filters.subscription( i ).mask << std::endl;
+        }
+    }
+}
+
+// can filter [clear] [add id[/mask] [ext] [prio n]]
+static void
+can_filter_command( size_t& argc, const char **& argv )
+{
+    auto cbus = stm32f103::can_t< stm32f103::CAN1_BASE >::instance();
+    auto& filters = can_filters();
+
+    while ( argc > 1 ) {
+        if ( strcmp( argv[ 1 ], "clear" ) == 0 ) {
+            filters.clear();
+            cbus->filter( 0, CAN_FIFO_0, CAN_FILTER_32BIT, CAN_FILTER_MASK, 0, 0 ); // accept all
+            for ( uint8_t i = 1; i < stm32f103::can_filter_bank::max_banks; ++i )
+                cbus->filter_disable( i );
+            stream() << "can filter: accept all" << std::endl;
+            ++argv; --argc;
+        } else if ( strcmp( argv[ 1 ], "add" ) == 0 && argc > 2 ) {
+            char * endp;
+            stm32f103::can_subscription sub{ strtox( argv[ 2 ], &endp ), 0, CAN_ID_STD, 0, nullptr };
+            argv += 2; argc -= 2;
+            bool has_mask = endp && *endp == '/';
+            if ( has_mask )
+                sub.mask = strtox( endp + 1 );
+            while ( argc > 1 ) {
+                if ( strcmp( argv[ 1 ], "ext" ) == 0 ) {
+                    sub.ide = CAN_ID_EXT;
+                    ++argv; --argc;
+                } else if ( strcmp( argv[ 1 ], "prio" ) == 0 && argc > 2 ) {
+                    sub.priority = strtod( argv[ 2 ] );
+                    argv += 2; argc -= 2;
+                } else {
+                    break;
+                }
+            }
+            if ( !has_mask )
+                sub.mask = ( sub.ide == CAN_ID_EXT ) ? 0x1fffffff : 0x7ff;
+            if ( filters.subscribe( sub ) < 0 )
+                stream() << "can filter: subscription table full" << std::endl;
+        } else {
+            break;
+        }
+    }
+
+    if ( filters.size() && !filters.apply( *cbus ) )
+        stream() << "can filter: " << int( filters.size() ) << " subscriptions do not fit into "
+                 << int( stm32f103::can_filter_bank::max_banks ) << " banks" << std::endl;
+    can_filter_print( filters );
+}
+
+// can isotp [size] [bs n] [stmin n]
+// Sends size bytes from 0x7e0 and receives them on a second endpoint listening there, which
+// answers with flow control from 0x7e8. Needs loopback (or a peer echoing the flow control)
+// and filters that pass both ids.
+static void
+can_isotp_command( size_t& argc, const char **& argv )
+{
+    using namespace stm32f103;
+
+    static uint8_t tx_data[ 512 ], rx_a[ 8 ], rx_b[ sizeof( tx_data ) ];
+    can_isotp_config ca{ 0x7e0, 0x7e8, CAN_ID_STD, 0, 0, 0xcc };
+    can_isotp_config cb{ 0x7e8, 0x7e0, CAN_ID_STD, 0, 0, 0xcc };
+    size_t size = 100;
+
+    if ( argc > 1 && argv[ 1 ][ 0 ] >= '0' && argv[ 1 ][ 0 ] <= '9' ) {
+        size = strtod( argv[ 1 ] );
+        ++argv; --argc;
+    }
+    while ( argc > 2 ) {
+        if ( strcmp( argv[ 1 ], "bs" ) == 0 )
+            cb.block_size = strtod( argv[ 2 ] );
+        else if ( strcmp( argv[ 1 ], "stmin" ) == 0 )
+            cb.st_min = strtox( argv[ 2 ] );
+        else
+            break;
+        argv += 2; argc -= 2;
+    }
+    if ( size == 0 || size > sizeof( tx_data ) ) {
+        stream() << "can isotp: size 1.." << int( sizeof( tx_data ) ) << std::endl;
+        return;
+    }
+
+    for ( size_t i = 0; i < size; ++i )
+        tx_data[ i ] = uint8_t( i * 7 + size );
+
+    auto cbus = can_t< CAN1_BASE >::instance();
+    can_isotp a( *cbus, ca, rx_a, sizeof( rx_a ) ), b( *cbus, cb, rx_b, sizeof( rx_b ) );
+
+    // the candump callback would take the frames from the rx isr
+    auto callback = can_t< CAN1_BASE >::callback_;
+    can_t< CAN1_BASE >::clear_callback();
+    cbus->rx_queue_clear();
+
+    const uint32_t start = atomic_jiffies.load();
+    auto result = a.send( tx_data, size );
+    std::array< CanMsg, 8 > msgs;
+    size_t frames = 0;
+    while ( result == ISOTP_OK && ( a.tx_busy() || !b.rx_ready() ) && ( atomic_jiffies.load() - start ) < 30000 ) {
+        while ( size_t n = cbus->rx_drain( msgs ) ) {
+            for ( size_t i = 0; i < n; ++i )
+                a.receive( msgs[ i ] ) || b.receive( msgs[ i ] );
+            frames += n;
+        }
+        a.poll();
+        b.poll();
+        if ( !a.tx_busy() && a.tx_result() != ISOTP_OK )
+            break;
+        __asm__ volatile ( "wfi" );  // the next can or systick irq
+    }
+    const uint32_t elapsed = atomic_jiffies.load() - start;  // 100us
+
+    can_t< CAN1_BASE >::set_callback( callback );
+
+    const bool match = b.rx_ready() && b.rx_size() == size
+        && std::equal( tx_data, tx_data + size, b.rx_data() );
+    stream() << "can isotp: " << int( size ) << " bytes, " << int( frames ) << " frames in "
+             << int( elapsed / 10 ) << "." << int( elapsed % 10 ) << " ms, tx result " << int( a.tx_result() )
+             << ", rx result " << int( b.rx_result() ) << ( match ? ", match" : ", MISMATCH" ) << std::endl;
+}
+
+static uint32_t
+per_second( uint32_t count, uint32_t ms )
+{
+    if ( ms == 0 )
+        return 0;
+    return count < 4294967 ? count * 1000 / ms : count / ( ms / 1000 ? ms / 1000 : 1 );
+}
+
+// can stats [clear]
+static void
+can_stats_command( size_t& argc, const char **& argv )
+{
+    using namespace stm32f103;
+    auto cbus = can_t< CAN1_BASE >::instance();
+
+    if ( argc > 1 && strcmp( argv[ 1 ], "clear" ) == 0 ) {
+        cbus->stats_clear();
+        ++argv; --argc;
+        return;
+    }
+
+    const auto st = cbus->stats();
+    const uint32_t ms = ( atomic_jiffies.load() - st.since ) / 10;
+
+    stream() << "can stats: " << int( ms / 1000 ) << "." << int( ( ms % 1000 ) / 100 ) << " s, rx " << int( st.rx_frames )
+             << " (" << int( per_second( st.rx_frames, ms ) ) << "/s), tx " << int( st.tx_frames )
+             << " (" << int( per_second( st.tx_frames, ms ) ) << "/s), tx failed " << int( st.tx_failed ) << std::endl;
+
+    // bits on the wire per 1/1000 of the time, stuffing between none and the worst case
+    const uint32_t kbit = cbus->timing().hz() / 1000;
+    const uint32_t capacity = ms < 4000000 ? kbit * ms / 1000 : kbit * ( ms / 1000 );
+    if ( capacity ) {
+        const uint32_t lo = st.bits / capacity, hi = ( st.bits + st.stuff_max ) / capacity;
+        stream() << "\tbus load " << int( lo / 10 ) << "." << int( lo % 10 ) << " .. "
+                 << int( hi / 10 ) << "." << int( hi % 10 ) << " % of " << int( kbit ) << " kbit/s"
+                 << " (frames sent and accepted by the filters)" << std::endl;
+    }
+
+    stream() << "\tTEC " << int( st.tec ) << " (max " << int( st.tec_max ) << "), REC "
+             << int( st.rec ) << " (max " << int( st.rec_max ) << "), error warning "
+             << int( st.error_warning ) << ", passive " << int( st.error_passive ) << ", bus-off " << int( st.bus_off )
+             << ", recovered " << int( st.bus_off_recovered ) << ( st.in_bus_off ? " [bus-off]" : "" ) << std::endl;
+
+    constexpr const char * lec_names [] = { "", "stuff", "form", "ack", "bit1", "bit0", "crc" };
+    stream() << "\tlast error codes:";
+    for ( size_t i = 1; i < 7; ++i )
+        stream() << " " << lec_names[ i ] << " " << int( st.lec[ i ] );
+    stream() << std::endl;
+
+    for ( size_t i = 0; i < st.nids; ++i ) {
+        const auto& c = st.ids[ i ];
+        stream() << "\tid " << ( c.id & ~can_stats::ext_flag ) << ( c.id & can_stats::ext_flag ? " ext" : "" )
+                 << "\trx " << int( c.rx ) << " (" << int( per_second( c.rx, ms ) ) << "/s)"
+                 << "\ttx " << int( c.tx ) << " (" << int( per_second( c.tx, ms ) ) << "/s)" << std::endl;
+    }
+    if ( st.other_rx || st.other_tx )
+        stream() << "\tother ids\trx " << int( st.other_rx ) << "\ttx " << int( st.other_tx ) << std::endl;
+}
+
 void
 can_command( size_t argc, const char ** argv )
 {
@@ -142,16 +402,29 @@ can_command( size_t argc, const char ** argv )
                 }
                 stream() << "can silent " << ( cbus->silent_mode() ? "on" : "off" ) << std::endl;
             } else if ( strcmp( argv[ 0 ], "bitrate" ) == 0 ) {
-                if ( argc ) {
+                if ( argc > 1 ) {
                     int32_t bitrate = strtod( argv[ 1 ] );
-                    if ( cbus->set_bitrate( bitrate * 1000 ) == CAN_OK )
-                        stream() << "can bitrate(" << bitrate << ")";
-                    else
-                        stream() << "can cannot enter init-mode";
+                    if ( bitrate <= 1000 )
+                        bitrate *= 1000;            // kbit/s
+                    auto status = cbus->set_bitrate( bitrate );
+                    if ( status == CAN_OK ) {
+                        auto t = cbus->timing();
+                        stream() << "can bitrate(" << int( t.hz() ) << ") prescaler=" << int( t.prescaler() )
+                                 << " n_tq=" << int( t.n_tq() ) << " sample-point=" << int( t.sample_point )
+                                 << " error=" << int( stm32f103::can_timing_solver( bitrate, 875, t.pclk ).error_ppm ) << "ppm";
+                    } else {
+                        stream() << "can bitrate(" << bitrate << "): " << __can_status_strings[ status ];
+                    }
                     ++argv; --argc;                    
                 } else {
-                    stream() << "\tcan bitrate {125|250|500|1000}";
+                    stream() << "\tcan bitrate <kbit/s|bit/s>";
                 }
+            } else if ( strcmp( argv[ 0 ], "filter" ) == 0 ) {
+                can_filter_command( argc, argv );
+            } else if ( strcmp( argv[ 0 ], "stats" ) == 0 ) {
+                can_stats_command( argc, argv );
+            } else if ( strcmp( argv[ 0 ], "isotp" ) == 0 ) {
+                can_isotp_command( argc, argv );
             } else if ( strcmp( argv[ 0 ], "repeat" ) == 0 ) {
                 if ( argc ) {
                     __cansend_repeat = strtod( argv[ 1 ] );
@@ -161,7 +434,10 @@ can_command( size_t argc, const char ** argv )
                 stream() << "unknown option: " << argv[ 0 ] << std::endl;
                 stream() << "usage:\n\tcan loopback {on|off}" << std::endl;
                 stream() << "\tcan silent {on|off}" << std::endl;
-                stream() << "\tcan bitrate {125|250|500|1000}" << std::endl;
+                stream() << "\tcan bitrate <kbit/s|bit/s>, e.g. 125, 500, 800, 83333" << std::endl;
+                stream() << "\tcan filter [clear] [add id[/mask] [ext] [prio n]]" << std::endl;
+                stream() << "\tcan isotp [size] [bs n] [stmin hex]" << std::endl;
+                stream() << "\tcan stats [clear]" << std::endl;
                 return;
             }
         }
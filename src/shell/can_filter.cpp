@@ -0,0 +1,204 @@
+// Copyright (C) 2018 MS-Cheminformatics LLC
+// Licence: CC BY-NC
+// Author: Toshinobu Hondo, Ph.D.
+// Contact: toshi.hondo@qtplatz.com
+//
+
+#include "can_filter.hpp"
+#include "can.hpp"
+
+using namespace stm32f103;
+
+namespace {
+
+    constexpr uint32_t std_all = 0x7ff;
+    constexpr uint32_t ext_all = 0x1fffffff;
+
+    // 32bit scale image, STDID[10:0] EXID[17:0] IDE RTR 0 (RM0008 Figure 230)
+    constexpr uint32_t
+    reg32( uint32_t id, uint8_t ide )
+    {
+        return ide == CAN_ID_EXT ? ( ( id & ext_all ) << 3 ) | CAN_ID_EXT : ( id & std_all ) << 21;
+    }
+
+    // 16bit scale image, STDID[10:0] RTR IDE EXID[17:15]
+    constexpr uint32_t
+    reg16( uint32_t id )
+    {
+        return ( id & std_all ) << 5;
+    }
+
+    constexpr uint32_t mask16_ide = 1 << 3;   // IDE must match (0, standard frame)
+    constexpr uint32_t mask16_rtr = 1 << 4;
+    constexpr uint32_t mask32_ide = CAN_ID_EXT;
+
+    inline bool
+    is_exact( const can_subscription& s )
+    {
+        return s.ide == CAN_ID_EXT ? ( s.mask & ext_all ) == ext_all : ( s.mask & std_all ) == std_all;
+    }
+}
+
+can_filter_bank::can_filter_bank() : count_( 0 )
+                                   , nbanks_( 0 )
+{
+    for ( auto& f: fmi_ )
+        f.fill( none );
+}
+
+int
+can_filter_bank::subscribe( const can_subscription& s )
+{
+    if ( count_ >= subs_.size() || ( s.ide != CAN_ID_STD && s.ide != CAN_ID_EXT ) )
+        return -1;
+    subs_[ count_ ] = s;
+    return int( count_++ );
+}
+
+void
+can_filter_bank::clear()
+{
+    count_ = 0;
+    nbanks_ = 0;
+    for ( auto& f: fmi_ )
+        f.fill( none );
+}
+
+bool
+can_filter_bank::add_bank( const bank& b, const uint8_t * subs )
+{
+    if ( nbanks_ >= max_banks )
+        return false;
+
+    size_t fmi = 0;  // numbered per FIFO, over the banks assigned to it (RM0008 24.7.4)
+    for ( size_t i = 0; i < nbanks_; ++i )
+        if ( banks_[ i ].fifo == b.fifo )
+            fmi += banks_[ i ].filters;
+
+    for ( size_t k = 0; k < b.filters; ++k )
+        fmi_[ b.fifo ][ fmi + k ] = subs[ k ];
+
+    banks_[ nbanks_++ ] = b;
+    return true;
+}
+
+bool
+can_filter_bank::pack_fifo( uint8_t fifo, uint8_t fifo0_priority )
+{
+    // std exact, std mask, ext exact, ext mask
+    std::array< uint8_t, max_subscriptions > se, sm, ee, em;
+    size_t nse = 0, nsm = 0, nee = 0, nem = 0;
+
+    for ( size_t i = 0; i < count_; ++i ) {
+        const auto& s = subs_[ i ];
+        if ( uint8_t( s.priority >= fifo0_priority ? 0 : 1 ) != fifo )
+            continue;
+        if ( s.ide == CAN_ID_EXT )
+            ( is_exact( s ) ? ee[ nee++ ] : em[ nem++ ] ) = uint8_t( i );
+        else
+            ( is_exact( s ) ? se[ nse++ ] : sm[ nsm++ ] ) = uint8_t( i );
+    }
+
+    // odd ext exact and std mask counts leave one spare slot each; leftover std ids
+    // that fit there save a 16bit list bank
+    const size_t spares = ( nee & 01 ) + ( nsm & 01 );
+    size_t to_spare = ( ( nse % 4 ) && ( nse % 4 ) <= spares ) ? nse % 4 : 0;
+    size_t ise = 0;
+
+    for ( size_t i = 0; i < nem; ++i ) {
+        const auto& s = subs_[ em[ i ] ];
+        if ( !add_bank( { reg32( s.id, CAN_ID_EXT ), reg32( s.mask, CAN_ID_EXT ) | mask32_ide
+                        , fifo, CAN_FILTER_32BIT, CAN_FILTER_MASK, 1 }, &em[ i ] ) )
+            return false;
+    }
+
+    for ( size_t i = 0; i < nee; i += 2 ) {
+        uint8_t slot[ 2 ] = { ee[ i ], ee[ i ] };
+        uint32_t fr2 = reg32( subs_[ ee[ i ] ].id, CAN_ID_EXT );
+        if ( i + 1 < nee ) {
+            slot[ 1 ] = ee[ i + 1 ];
+            fr2 = reg32( subs_[ slot[ 1 ] ].id, CAN_ID_EXT );
+        } else if ( to_spare ) {
+            slot[ 1 ] = se[ ise++ ];
+            fr2 = reg32( subs_[ slot[ 1 ] ].id, CAN_ID_STD );
+            --to_spare;
+        }
+        if ( !add_bank( { reg32( subs_[ ee[ i ] ].id, CAN_ID_EXT ), fr2, fifo, CAN_FILTER_32BIT, CAN_FILTER_LIST, 2 }, slot ) )
+            return false;
+    }
+
+    for ( size_t i = 0; i < nsm; i += 2 ) {
+        const auto& a = subs_[ sm[ i ] ];
+        uint8_t slot[ 2 ] = { sm[ i ], sm[ i ] };
+        uint32_t fr1 = ( ( reg16( a.mask ) | mask16_ide ) << 16 ) | reg16( a.id );
+        uint32_t fr2 = fr1;
+        if ( i + 1 < nsm ) {
+            const auto& b = subs_[ slot[ 1 ] = sm[ i + 1 ] ];
+            fr2 = ( ( reg16( b.mask ) | mask16_ide ) << 16 ) | reg16( b.id );
+        } else if ( to_spare ) {
+            slot[ 1 ] = se[ ise++ ];
+            fr2 = ( ( reg16( std_all ) | mask16_ide | mask16_rtr ) << 16 ) | reg16( subs_[ slot[ 1 ] ].id );
+            --to_spare;
+        }
+        if ( !add_bank( { fr1, fr2, fifo, CAN_FILTER_16BIT, CAN_FILTER_MASK, 2 }, slot ) )
+            return false;
+    }
+
+    while ( ise < nse ) {
+        // unused list slots repeat the last id
+        uint8_t slot[ 4 ];
+        uint32_t r[ 4 ];
+        for ( size_t k = 0; k < 4; ++k ) {
+            slot[ k ] = se[ ise < nse ? ise++ : ise - 1 ];
+            r[ k ] = reg16( subs_[ slot[ k ] ].id );
+        }
+        if ( !add_bank( { ( r[ 1 ] << 16 ) | r[ 0 ], ( r[ 3 ] << 16 ) | r[ 2 ], fifo, CAN_FILTER_16BIT, CAN_FILTER_LIST, 4 }, slot ) )
+            return false;
+    }
+    return true;
+}
+
+bool
+can_filter_bank::pack( uint8_t fifo0_priority )
+{
+    nbanks_ = 0;
+    for ( auto& f: fmi_ )
+        f.fill( none );
+    return pack_fifo( CAN_FIFO_0, fifo0_priority ) && pack_fifo( CAN_FIFO_1, fifo0_priority );
+}
+
+bool
+can_filter_bank::apply( can& can, uint8_t fifo0_priority )
+{
+    if ( !pack( fifo0_priority ) )
+        return false;
+
+    for ( size_t i = 0; i < nbanks_; ++i ) {
+        const auto& b = banks_[ i ];
+        can.filter( uint8_t( i ), CAN_FIFO( b.fifo ), CAN_FILTER_SCALE( b.scale ), CAN_FILTER_MODE( b.mode ), b.fr1, b.fr2 );
+    }
+    for ( size_t i = nbanks_; i < max_banks; ++i )
+        can.filter_disable( uint8_t( i ) );
+    return true;
+}
+
+const can_subscription *
+can_filter_bank::match( const CanMsg& msg ) const
+{
+    if ( msg.FIFO > 1 || msg.FMI >= fmi_[ 0 ].size() )
+        return nullptr;
+    auto i = fmi_[ msg.FIFO ][ msg.FMI ];
+    return ( i == none ) ? nullptr : &subs_[ i ];
+}
+
+bool
+can_filter_bank::dispatch( const CanMsg& msg ) const
+{
+    if ( auto s = match( msg ) ) {
+        if ( s->handler ) {
+            s->handler( msg );
+            return true;
+        }
+    }
+    return false;
+}
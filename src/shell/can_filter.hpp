@@ -0,0 +1,80 @@
+// Copyright (C) 2018 MS-Cheminformatics LLC
+// Licence: CC BY-NC
+// Author: Toshinobu Hondo, Ph.D.
+// Contact: toshi.hondo@qtplatz.com
+//
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+struct CanMsg;
+
+namespace stm32f103 {
+
+    class can;
+
+    // One receive subscription. mask has 1 for the id bits that must match; an all-ones mask
+    // (0x7ff std, 0x1fffffff ext) is an exact id and may go into a list filter, which matches
+    // data frames only. Mask filters take data and remote frames alike.
+    struct can_subscription {
+        uint32_t id;
+        uint32_t mask;
+        uint8_t ide;                              // CAN_ID_STD | CAN_ID_EXT
+        uint8_t priority;                         // >= fifo0 threshold of apply() goes to FIFO 0
+        void (*handler)( const CanMsg& );
+    };
+
+    // Packs subscriptions into the 14 bxCAN filter banks (RM0008 24.7.4), densest format first:
+    // std exact ids 4 per 16bit list bank, std masks 2 per 16bit mask bank, ext exact ids 2 per
+    // 32bit list bank, ext masks 1 per 32bit mask bank; spare slots take leftover std ids.
+    // FIFO 0 banks come first, so the filter match index (FMI) of every slot is known and
+    // match() is a table lookup.
+    class can_filter_bank {
+    public:
+        static constexpr size_t max_banks = 14;
+        static constexpr size_t max_subscriptions = 32;
+        static constexpr uint8_t none = 0xff;
+
+        struct bank {
+            uint32_t fr1;
+            uint32_t fr2;
+            uint8_t fifo;
+            uint8_t scale;                        // CAN_FILTER_SCALE
+            uint8_t mode;                         // CAN_FILTER_MODE
+            uint8_t filters;                      // FMI numbers the bank occupies, 1, 2 or 4
+        };
+
+        can_filter_bank();
+
+        int subscribe( const can_subscription& );  // subscription index, -1 if full or invalid
+        void clear();
+
+        // computes the banks; false if they do not fit into max_banks
+        bool pack( uint8_t fifo0_priority = 1 );
+        // pack() and program the controller; unused banks are deactivated
+        bool apply( can&, uint8_t fifo0_priority = 1 );
+
+        const can_subscription * match( const CanMsg& ) const;
+        bool dispatch( const CanMsg& ) const;      // calls the handler of the match, if any
+
+        inline size_t size() const { return count_; }
+        inline size_t banks() const { return nbanks_; }
+        inline const bank& at( size_t i ) const { return banks_[ i ]; }
+        inline const can_subscription& subscription( size_t i ) const { return subs_[ i ]; }
+        inline uint8_t subscription_of( uint8_t fifo, uint8_t fmi ) const { return fmi_[ fifo & 01 ][ fmi ]; }
+
+    private:
+        std::array< can_subscription, max_subscriptions > subs_;
+        std::array< bank, max_banks > banks_;
+        std::array< std::array< uint8_t, max_banks * 4 >, 2 > fmi_;   // [fifo][FMI] -> subscription
+        size_t count_;
+        size_t nbanks_;
+
+        bool pack_fifo( uint8_t fifo, uint8_t fifo0_priority );
+        bool add_bank( const bank&, const uint8_t * subs );
+    };
+
+}
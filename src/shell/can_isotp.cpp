@@ -0,0 +1,292 @@
+// Copyright (C) 2018 MS-Cheminformatics LLC
+// Licence: CC BY-NC
+// Author: Toshinobu Hondo, Ph.D.
+// Contact: toshi.hondo@qtplatz.com
+//
+
+#include "can_isotp.hpp"
+#include "can.hpp"
+#include <atomic>
+
+extern std::atomic< uint32_t > atomic_jiffies;
+
+using namespace stm32f103;
+
+namespace {
+
+    // PCI type, high nibble of the first data byte
+    constexpr uint8_t pci_sf = 0x00;
+    constexpr uint8_t pci_ff = 0x10;
+    constexpr uint8_t pci_cf = 0x20;
+    constexpr uint8_t pci_fc = 0x30;
+
+    constexpr uint8_t fc_cts = 0;
+    constexpr uint8_t fc_wait = 1;
+    constexpr uint8_t fc_ovflw = 2;
+
+    constexpr size_t max_size = 4095;
+    constexpr uint32_t n_bs = 10000;                        // 1s in jiffies, N_Bs and N_Cr
+    constexpr uint32_t n_cr = 10000;
+    constexpr size_t tx_window = CAN_TX_QUEUE_SIZE / 2;     // leave room in the tx queue for others
+
+    // STmin in jiffies; one more than the rounded value, since the first jiffy may be almost over
+    constexpr uint32_t
+    st_min_jiffies( uint8_t st )
+    {
+        return st == 0 ? 0
+            : st <= 0x7f ? st * 10 + 1
+            : ( st >= 0xf1 && st <= 0xf9 ) ? ( st - 0xf0 ) + 1
+            : 0x7f * 10 + 1;                                 // reserved, the longest valid value
+    }
+
+    inline size_t
+    min( size_t a, size_t b )
+    {
+        return a < b ? a : b;
+    }
+}
+
+can_isotp::can_isotp( can& can, const can_isotp_config& config, uint8_t * rx_buffer, size_t rx_capacity )
+    : can_( can )
+    , config_( config )
+    , tx_data_( nullptr )
+    , tx_size_( 0 )
+    , tx_offset_( 0 )
+    , tx_time_( 0 )
+    , tx_st_( 0 )
+    , tx_bs_( 0 )
+    , tx_block_( 0 )
+    , tx_sn_( 0 )
+    , tx_state_( tx_idle )
+    , tx_result_( ISOTP_OK )
+    , rx_buffer_( rx_buffer )
+    , rx_capacity_( rx_capacity )
+    , rx_size_( 0 )
+    , rx_offset_( 0 )
+    , rx_time_( 0 )
+    , rx_block_( 0 )
+    , rx_sn_( 0 )
+    , rx_state_( rx_idle )
+    , rx_result_( ISOTP_OK )
+    , fc_pending_( 0 )
+{
+}
+
+void
+can_isotp::frame( CanMsg& msg ) const
+{
+    msg.ID = config_.tx_id;
+    msg.IDE = config_.ide;
+    msg.RTR = CAN_RTR_DATA;
+    msg.DLC = 8;
+    for ( auto& d: msg.Data )
+        d = config_.padding;
+}
+
+ISOTP_RESULT
+can_isotp::send( const uint8_t * data, size_t size )
+{
+    if ( tx_state_ != tx_idle )
+        return ISOTP_BUSY;
+    if ( size == 0 || size > max_size )
+        return ISOTP_INVALID;
+
+    CanMsg msg;
+    frame( msg );
+    if ( size <= 7 ) {
+        msg.Data[ 0 ] = pci_sf | uint8_t( size );
+        for ( size_t i = 0; i < size; ++i )
+            msg.Data[ 1 + i ] = data[ i ];
+        if ( !can_.enqueue( msg ) )
+            return ISOTP_BUSY;
+        return tx_result_ = ISOTP_OK;
+    }
+
+    msg.Data[ 0 ] = pci_ff | uint8_t( size >> 8 );
+    msg.Data[ 1 ] = uint8_t( size );
+    for ( size_t i = 0; i < 6; ++i )
+        msg.Data[ 2 + i ] = data[ i ];
+    if ( !can_.enqueue( msg ) )
+        return ISOTP_BUSY;
+
+    tx_data_ = data;
+    tx_size_ = size;
+    tx_offset_ = 6;
+    tx_sn_ = 1;
+    tx_time_ = atomic_jiffies.load();
+    tx_state_ = tx_wait_fc;
+    return tx_result_ = ISOTP_OK;
+}
+
+void
+can_isotp::abort()
+{
+    tx_state_ = tx_idle;
+    rx_state_ = rx_idle;
+    fc_pending_ = 0;
+}
+
+bool
+can_isotp::receive( const CanMsg& msg )
+{
+    if ( msg.ID != config_.rx_id || msg.IDE != config_.ide || msg.RTR != CAN_RTR_DATA || msg.DLC == 0 )
+        return false;
+
+    const uint8_t pci = msg.Data[ 0 ];
+    switch ( pci & 0xf0 ) {
+    case pci_sf: {
+        const size_t size = pci & 0x0f;
+        if ( size == 0 || size + 1 > msg.DLC )
+            break;
+        if ( rx_state_ == rx_done || size > rx_capacity_ ) {
+            rx_result_ = ISOTP_OVERFLOW;
+            break;
+        }
+        for ( size_t i = 0; i < size; ++i )    // a SF during a segmented reception replaces it
+            rx_buffer_[ i ] = msg.Data[ 1 + i ];
+        rx_size_ = size;
+        rx_result_ = ISOTP_OK;
+        rx_state_ = rx_done;
+        break;
+    }
+    case pci_ff: {
+        const size_t size = ( size_t( pci & 0x0f ) << 8 ) | msg.Data[ 1 ];
+        if ( msg.DLC < 8 || size < 8 )
+            break;
+        if ( rx_state_ == rx_done || size > rx_capacity_ ) {
+            rx_result_ = ISOTP_OVERFLOW;
+            send_fc( fc_ovflw );
+            break;
+        }
+        for ( size_t i = 0; i < 6; ++i )
+            rx_buffer_[ i ] = msg.Data[ 2 + i ];
+        rx_size_ = size;
+        rx_offset_ = 6;
+        rx_sn_ = 1;
+        rx_block_ = 0;
+        rx_time_ = atomic_jiffies.load();
+        rx_result_ = ISOTP_OK;
+        rx_state_ = rx_wait_cf;
+        send_fc( fc_cts );
+        break;
+    }
+    case pci_cf: {
+        if ( rx_state_ != rx_wait_cf )
+            break;
+        if ( ( pci & 0x0f ) != ( rx_sn_ & 0x0f ) ) {
+            rx_result_ = ISOTP_WRONG_SN;
+            rx_state_ = rx_idle;
+            break;
+        }
+        const size_t n = min( min( 7, rx_size_ - rx_offset_ ), msg.DLC - 1 );
+        for ( size_t i = 0; i < n; ++i )
+            rx_buffer_[ rx_offset_ + i ] = msg.Data[ 1 + i ];
+        rx_offset_ += n;
+        ++rx_sn_;
+        rx_time_ = atomic_jiffies.load();
+        if ( rx_offset_ >= rx_size_ ) {
+            rx_result_ = ISOTP_OK;
+            rx_state_ = rx_done;
+        } else if ( config_.block_size && ++rx_block_ >= config_.block_size ) {
+            rx_block_ = 0;
+            send_fc( fc_cts );
+        }
+        break;
+    }
+    case pci_fc:
+        on_flow_control( msg );
+        break;
+    }
+    return true;
+}
+
+void
+can_isotp::on_flow_control( const CanMsg& msg )
+{
+    if ( tx_state_ != tx_wait_fc || msg.DLC < 3 )
+        return;
+
+    switch ( msg.Data[ 0 ] & 0x0f ) {
+    case fc_cts:
+        tx_bs_ = msg.Data[ 1 ];
+        tx_st_ = st_min_jiffies( msg.Data[ 2 ] );
+        tx_block_ = 0;
+        tx_time_ = atomic_jiffies.load() - tx_st_;    // the first CF is due now
+        tx_state_ = tx_send_cf;
+        break;
+    case fc_wait:
+        tx_time_ = atomic_jiffies.load();             // restarts N_Bs
+        break;
+    case fc_ovflw:
+        tx_result_ = ISOTP_OVERFLOW;
+        tx_state_ = tx_idle;
+        break;
+    default:
+        tx_result_ = ISOTP_INVALID;
+        tx_state_ = tx_idle;
+        break;
+    }
+}
+
+void
+can_isotp::send_fc( uint8_t status )
+{
+    fc_pending_ = status + 1;
+    flush_fc();
+}
+
+void
+can_isotp::flush_fc()
+{
+    if ( !fc_pending_ )
+        return;
+    CanMsg msg;
+    frame( msg );
+    msg.Data[ 0 ] = pci_fc | uint8_t( fc_pending_ - 1 );
+    msg.Data[ 1 ] = config_.block_size;
+    msg.Data[ 2 ] = config_.st_min;
+    if ( can_.enqueue( msg ) )
+        fc_pending_ = 0;
+}
+
+void
+can_isotp::poll()
+{
+    const uint32_t now = atomic_jiffies.load();
+
+    flush_fc();
+
+    if ( rx_state_ == rx_wait_cf && now - rx_time_ >= n_cr ) {
+        rx_result_ = ISOTP_TIMEOUT_CR;
+        rx_state_ = rx_idle;
+    }
+
+    if ( tx_state_ == tx_wait_fc && now - tx_time_ >= n_bs ) {
+        tx_result_ = ISOTP_TIMEOUT_BS;
+        tx_state_ = tx_idle;
+    }
+
+    // with STmin 0 as many CFs as the window takes; the tx isr sends them back to back
+    while ( tx_state_ == tx_send_cf && now - tx_time_ >= tx_st_ && can_.tx_pending() < tx_window ) {
+        CanMsg msg;
+        frame( msg );
+        const size_t n = min( 7, tx_size_ - tx_offset_ );
+        msg.Data[ 0 ] = pci_cf | ( tx_sn_ & 0x0f );
+        for ( size_t i = 0; i < n; ++i )
+            msg.Data[ 1 + i ] = tx_data_[ tx_offset_ + i ];
+        if ( !can_.enqueue( msg ) )
+            break;
+
+        tx_offset_ += n;
+        ++tx_sn_;
+        tx_time_ = now;
+        if ( tx_offset_ >= tx_size_ ) {
+            tx_result_ = ISOTP_OK;
+            tx_state_ = tx_idle;
+        } else if ( tx_bs_ && ++tx_block_ >= tx_bs_ ) {
+            tx_state_ = tx_wait_fc;
+        } else if ( tx_st_ ) {
+            break;
+        }
+    }
+}
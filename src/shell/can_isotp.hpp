@@ -0,0 +1,97 @@
+// Copyright (C) 2018 MS-Cheminformatics LLC
+// Licence: CC BY-NC
+// Author: Toshinobu Hondo, Ph.D.
+// Contact: toshi.hondo@qtplatz.com
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+struct CanMsg;
+
+enum ISOTP_RESULT : uint8_t {
+    ISOTP_OK = 0
+    , ISOTP_BUSY             // a transfer in progress, or the can tx queue is full
+    , ISOTP_INVALID          // size 0 or > 4095, or an unexpected flow control status
+    , ISOTP_TIMEOUT_BS       // no flow control from the receiver
+    , ISOTP_TIMEOUT_CR       // no consecutive frame from the sender
+    , ISOTP_WRONG_SN
+    , ISOTP_OVERFLOW         // the receiver has no room (FC.OVFLW), or we had none
+};
+
+namespace stm32f103 {
+
+    class can;
+
+    // Normal addressing, the PCI in the first data byte; both ids have the same format.
+    struct can_isotp_config {
+        uint32_t tx_id;
+        uint32_t rx_id;
+        uint8_t ide;                              // CAN_ID_STD | CAN_ID_EXT
+        uint8_t block_size;                       // our flow control: CFs per FC, 0 for one FC only
+        uint8_t st_min;                           // our flow control: 0..127 ms, 0xf1..0xf9 100..900 us
+        uint8_t padding;                          // fill byte, every frame goes out with DLC 8
+    };
+
+    // ISO 15765-2 transport for one pair of ids, full duplex, payloads up to 4095 bytes.
+    // Thread context only and never blocks: hand it the received frames (from rx_drain) and call
+    // poll() from the same loop; frames go out through can::enqueue, CFs paced by the peer's STmin
+    // on the 100us jiffies clock. Buffers belong to the caller; the payload given to send() must
+    // stay untouched until tx_busy() is false.
+    class can_isotp {
+    public:
+        can_isotp( can&, const can_isotp_config&, uint8_t * rx_buffer, size_t rx_capacity );
+
+        ISOTP_RESULT send( const uint8_t * data, size_t size );
+        inline bool tx_busy() const { return tx_state_ != tx_idle; }
+        inline ISOTP_RESULT tx_result() const { return tx_result_; }
+
+        bool receive( const CanMsg& );            // false if the frame is not for this link
+        void poll();                              // sends due CFs and flow control, runs the timers
+
+        inline bool rx_ready() const { return rx_state_ == rx_done; }
+        inline size_t rx_size() const { return rx_size_; }
+        inline const uint8_t * rx_data() const { return rx_buffer_; }
+        inline ISOTP_RESULT rx_result() const { return rx_result_; }
+        inline void rx_release() { rx_state_ = rx_idle; }     // the buffer may take the next payload
+
+        void abort();
+
+    private:
+        enum tx_state : uint8_t { tx_idle, tx_wait_fc, tx_send_cf };
+        enum rx_state : uint8_t { rx_idle, rx_wait_cf, rx_done };
+
+        can& can_;
+        can_isotp_config config_;
+
+        const uint8_t * tx_data_;
+        size_t tx_size_;
+        size_t tx_offset_;
+        uint32_t tx_time_;                        // jiffies of the last CF or FC
+        uint32_t tx_st_;                          // peer STmin in jiffies
+        uint8_t tx_bs_;                           // peer block size
+        uint8_t tx_block_;
+        uint8_t tx_sn_;
+        tx_state tx_state_;
+        ISOTP_RESULT tx_result_;
+
+        uint8_t * rx_buffer_;
+        size_t rx_capacity_;
+        size_t rx_size_;
+        size_t rx_offset_;
+        uint32_t rx_time_;
+        uint8_t rx_block_;
+        uint8_t rx_sn_;
+        rx_state rx_state_;
+        ISOTP_RESULT rx_result_;
+        uint8_t fc_pending_;                      // flow status + 1 the tx queue had no room for
+
+        void frame( CanMsg& ) const;
+        void send_fc( uint8_t status );
+        void flush_fc();
+        void on_flow_control( const CanMsg& );
+    };
+
+}
@@ -0,0 +1,93 @@
+// Copyright (C) 2018 MS-Cheminformatics LLC
+// Licence: CC BY-NC
+// Author: Toshinobu Hondo, Ph.D.
+// Contact: toshi.hondo@qtplatz.com
+//
+
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace stm32f103 {
+
+    // A data or remote frame on the wire, SOF through the intermission. Stuffing depends on the
+    // bit pattern, so only its bound is kept: after the first 5 bits of SOF .. CRC at most every
+    // 4th bit is a stuff bit (135 bits for a standard frame of 8 bytes, 160 for an extended one).
+    struct can_frame_size {
+        uint32_t bits;                            // without stuff bits
+        uint32_t stuff_max;
+    };
+
+    constexpr can_frame_size
+    can_frame_bits( uint32_t dlc, bool ext, bool rtr )
+    {
+        const uint32_t data = rtr ? 0 : 8 * ( dlc > 8 ? 8 : dlc );
+        const uint32_t stuffed = ( ext ? 54 : 34 ) + data;     // SOF, arbitration, control, data, CRC
+        return { stuffed + 13, ( stuffed - 1 ) / 4 };         // CRC/ACK delimiters, ACK, EOF, intermission
+    }
+
+    static_assert( can_frame_bits( 8, false, false ).bits == 111 && can_frame_bits( 8, false, false ).stuff_max == 24, "" );
+    static_assert( can_frame_bits( 8, true, false ).bits + can_frame_bits( 8, true, false ).stuff_max == 160, "" );
+    static_assert( can_frame_bits( 0, false, false ).bits == 47, "" );
+
+    // Counters of the can isrs. The frames are those this node sends and those its filters accept,
+    // so the bus load is a lower bound on a busy bus with narrow filters.
+    struct can_stats {
+        static constexpr size_t max_ids = 16;
+        static constexpr uint32_t ext_flag = 0x80000000;
+
+        struct id_count {
+            uint32_t id;                          // | ext_flag for an extended id
+            uint32_t rx;
+            uint32_t tx;
+        };
+
+        uint32_t since;                           // jiffies of the last clear
+        uint32_t rx_frames;
+        uint32_t tx_frames;
+        uint32_t tx_failed;                       // mailbox completed without TXOK, aborts included
+        uint32_t bits;                            // both directions, without stuff bits
+        uint32_t stuff_max;
+
+        std::array< id_count, max_ids > ids;      // first seen first
+        size_t nids;
+        uint32_t other_rx;                        // ids beyond the table
+        uint32_t other_tx;
+
+        std::array< uint32_t, 8 > lec;            // by last error code: 1 stuff, 2 form, 3 ack, 4 bit recessive,
+                                                  // 5 bit dominant, 6 crc
+        uint32_t error_warning;                   // entries into the state
+        uint32_t error_passive;
+        uint32_t bus_off;
+        uint32_t bus_off_recovered;
+        uint8_t tec;                              // ESR at the time of can::stats()
+        uint8_t rec;
+        uint8_t tec_max;
+        uint8_t rec_max;
+        bool in_bus_off;
+
+        // rx or tx isr; ir is the RIR/TIR image, dtr the RDTR/TDTR image
+        inline void count( uint32_t ir, uint32_t dtr, bool tx ) {
+            const bool ext = ir & 0x04;
+            const uint32_t id = ext ? ( ( ir >> 3 ) | ext_flag ) : ( ( ir >> 21 ) & 0x7ff );
+            const auto size = can_frame_bits( dtr & 0x0f, ext, ir & 0x02 );
+            bits += size.bits;
+            stuff_max += size.stuff_max;
+            ++( tx ? tx_frames : rx_frames );
+
+            for ( size_t i = 0; i < nids; ++i ) {
+                if ( ids[ i ].id == id ) {
+                    ++( tx ? ids[ i ].tx : ids[ i ].rx );
+                    return;
+                }
+            }
+            if ( nids < max_ids )
+                ids[ nids++ ] = { id, tx ? 0u : 1u, tx ? 1u : 0u };
+            else
+                ++( tx ? other_tx : other_rx );
+        }
+    };
+
+}
@@ -6,6 +6,7 @@
 
 #include "command_processor.hpp"
 #include "adc.hpp"
+#include "adc_decimator.hpp"
 #include "bkp.hpp"
 #include "condition_wait.hpp"
 #include "dma.hpp"
@@ -29,8 +30,10 @@ extern std::atomic< uint32_t > atomic_jiffies;
 extern void mdelay( uint32_t ms );
 
 void can_command( size_t argc, const char ** argv );
+void slcan_command( size_t argc, const char ** argv );
 void i2c_command( size_t argc, const char ** argv );
 void i2cdetect( size_t argc, const char ** argv );
+void bench_command( size_t argc, const char ** argv );
 void bmp280_command( size_t argc, const char ** argv );
 void ad5593_command( size_t argc, const char ** argv );
 void rcc_status( size_t argc, const char ** argv );
@@ -160,6 +163,11 @@ spi_command( size_t argc, const char ** argv )
     size_t count = 1024;
     bool spi_read( false );
     bool spi_ss_soft = false;
+    bool spi_dma = false;
+    bool spi_stream = false;
+    int spi_mode = -1, spi_br = -1;
+    uint32_t spi_hz = 0;
+    bool spi_lsb = false;
 
     while ( --argc ) {
         ++argv;
@@ -167,6 +175,21 @@ spi_command( size_t argc, const char ** argv )
             count = strtod( argv[ 0 ] );
             if ( count == 0 )
                 count = 1;
+        } else if ( strcmp( argv[0], "dma" ) == 0 ) {
+            spi_dma = true;
+        } else if ( strcmp( argv[0], "stream" ) == 0 ) {
+            spi_stream = true;
+        } else if ( strcmp( argv[0], "mode" ) == 0 && argc > 1 ) {
+            spi_mode = strtod( argv[ 1 ] ) & 03;
+            --argc; ++argv;
+        } else if ( strcmp( argv[0], "br" ) == 0 && argc > 1 ) {
+            spi_br = strtod( argv[ 1 ] ) & 07;
+            --argc; ++argv;
+        } else if ( strcmp( argv[0], "hz" ) == 0 && argc > 1 ) {
+            spi_hz = strtod( argv[ 1 ] );
+            --argc; ++argv;
+        } else if ( strcmp( argv[0], "lsb" ) == 0 ) {
+            spi_lsb = true;
         } else if ( *argv[0] == 's' ) {
             spi_ss_soft = true;
         } else if ( *argv[0] == 'r' ) {
@@ -212,6 +235,84 @@ spi_command( size_t argc, const char ** argv )
         }
     }
 
+    if ( spi_mode >= 0 )
+        spix.set_mode( SPI_MODE( spi_mode ) );
+    if ( spi_br >= 0 )
+        spix.set_baud_prescaler( spi_br );
+    if ( spi_hz || spi_lsb ) {
+        // 16bit frames, as used below
+        auto c = spi_config_solver( spi_hz ? spi_hz : spix.config().hz()
+                                    , spix.mode(), true, spi_lsb, spix.pclk() );
+        if ( ! spix.configure( c ) ) {
+            stream() << "spi: " << int( spi_hz ) << " Hz is out of range, " << int( spix.pclk() >> 8 )
+                     << " .. " << int( spi_max_hz ) << std::endl;
+            return;
+        }
+        stream() << "spi: " << int( c.hz() ) << " Hz, br " << int( c.br() ) << ( c.lsb_first() ? ", lsb first" : "" ) << std::endl;
+    }
+
+    if ( spi_stream ) {
+        // slave receiver; an external master clocks frames in while ~SS is low
+        static std::array< uint16_t, 128 > buffer;
+        size_t nblocks = std::min( count, size_t( 64 ) ), invalid = 0;
+        if ( ! spix.attach( *dma_t< DMA1_BASE >::instance() ) ) {
+            stream() << "spi stream: dma channels in use" << std::endl;
+            return;
+        }
+        if ( ! spix.stream_start( buffer.data(), buffer.size() ) ) {
+            spix.detach();
+            stream() << "spi stream start failed" << std::endl;
+            return;
+        }
+        uint32_t idle = atomic_jiffies.load();
+        while ( nblocks && ( atomic_jiffies.load() - idle ) < 10000 ) { // give up after 1s without data
+            spi_block block;
+            if ( ! spix.stream_read( block ) )
+                continue;
+            const uint16_t first = block.data[ 0 ], last = block.data[ block.size - 1 ];
+            if ( spix.stream_release( block ) )
+                stream() << "[" << int( block.sequence ) << "] " << int( block.timestamp ) << "\t"
+                         << first << " .. " << last << std::endl;
+            else
+                ++invalid;
+            idle = atomic_jiffies.load();
+            --nblocks;
+        }
+        spix.stream_stop();
+        spix.detach();
+        stream() << "spi stream: overrun " << int( spix.stream_overrun() ) << ", ovr " << int( spix.stream_ovr() )
+                 << ", invalid " << int( invalid ) << std::endl;
+        return;
+    }
+
+    if ( spi_dma ) {
+        // one dma block of count 16bit frames; with MOSI looped back to MISO rx echoes tx
+        static std::array< uint16_t, 256 > tx, rx;
+        count = std::min( count, tx.size() );
+        if ( ! spix.attach( *dma_t< DMA1_BASE >::instance() ) ) {
+            stream() << "spi dma: dma channels in use" << std::endl;
+            return;
+        }
+        for ( size_t i = 0; i < count; ++i )
+            tx[ i ] = uint16_t( atomic_jiffies.load() + i );
+        rx.fill( 0 );
+        const uint32_t t0 = cycle_counter::now();
+        const bool ok = spix.transfer( tx.data(), rx.data(), count ) && spix.wait();
+        const uint32_t us = ( cycle_counter::now() - t0 ) / cycle_counter::cycles_per_us();
+        spix.detach();
+        if ( !ok ) {
+            stream() << "spi dma transfer failed" << std::endl;
+            return;
+        }
+        stream() << "spi dma: " << int( count ) << " frames in " << int( us ) << " us, mode " << int( spix.mode() )
+                 << ", br " << int( spix.baud_prescaler() ) << ( spix.error() ? ", error" : "" ) << std::endl;
+        size_t match = 0;
+        for ( size_t i = 0; i < count; ++i )
+            match += ( tx[ i ] == rx[ i ] );
+        stream() << "\trx[0] = " << rx[ 0 ] << ", " << int( match ) << "/" << int( count ) << " frames echoed" << std::endl;
+        return;
+    }
+
     if ( spi_read ) {
         uint16_t rxd;
         while ( count-- ) {
@@ -259,6 +360,233 @@ alt_test( size_t argc, const char ** argv )
     }
 }
 
+static uint32_t __adc_sample_rate; // scans/s, 0 := free running
+static stm32f103::adc_dual_mode __adc_mode = stm32f103::adc_independent;
+alignas( 4 ) static std::array< uint16_t, 512 > __adc_stream_buffer; // 32bit dma in dual mode
+
+// 4 channels in a block whichever mode but fast interleaved, which is a single channel
+static uint8_t
+adc_stream_channels()
+{
+    return __adc_mode == stm32f103::adc_fast_interleaved ? 1 : 4;
+}
+
+static bool
+adc_stream_start( stm32f103::adc& adc )
+{
+    auto& dma = *stm32f103::dma_t< stm32f103::DMA1_BASE >::instance();
+    switch ( __adc_mode ) {
+    case stm32f103::adc_regular_simultaneous:
+        return adc.stream_start( dma, __adc_stream_buffer.data(), __adc_stream_buffer.size(), __adc_mode, 2, __adc_sample_rate );
+    case stm32f103::adc_fast_interleaved:
+        return adc.stream_start( dma, __adc_stream_buffer.data(), __adc_stream_buffer.size(), __adc_mode, 1 );
+    default:
+        return adc.stream_start( dma, __adc_stream_buffer.data(), __adc_stream_buffer.size(), adc_stream_channels(), __adc_sample_rate );
+    }
+}
+
+static void
+adc_print_rate( const stm32f103::adc& adc )
+{
+    const auto& rate = adc.stream_trigger();
+    if ( rate.period() > 1 ) {
+        stream() << "adc trigger: TIM3 PSC=" << int( rate.psc ) << " ARR=" << int( rate.arr )
+                 << "\t" << int( rate.hz() ) << "." << ( rate.millihz() < 100 ? ( rate.millihz() < 10 ? "00" : "0" ) : "" )
+                 << int( rate.millihz() ) << "Hz (requested " << int( __adc_sample_rate ) << "Hz)" << std::endl;
+    } else {
+        stream() << "adc trigger: free running" << std::endl;
+    }
+}
+
+// jiffies without a block before a stream loop gives up: 1s, or four blocks at slow trigger rates
+static uint32_t
+adc_idle_limit( const stm32f103::adc& adc )
+{
+    const auto& rate = adc.stream_trigger();
+    if ( rate.period() <= 1 )
+        return 10000;
+    const uint32_t scans = ( __adc_stream_buffer.size() / 2 ) / adc_stream_channels();
+    const uint32_t hz = rate.hz() ? rate.hz() : 1;
+    const uint32_t block = ( scans * 10000 ) / hz;
+    return 4 * block > 10000 ? 4 * block : 10000;
+}
+
+static void
+adc_stream( stm32f103::adc& adc, size_t nblocks )
+{
+    if ( ! adc_stream_start( adc ) ) {
+        stream() << "adc stream start failed" << std::endl;
+        return;
+    }
+    adc_print_rate( adc );
+
+    size_t invalid = 0;
+    const uint32_t limit = adc_idle_limit( adc );
+    uint32_t idle = atomic_jiffies.load();
+    while ( nblocks && ( atomic_jiffies.load() - idle ) < limit ) { // no trigger or a dma error
+        stm32f103::adc_block block;
+        if ( ! adc.stream_read( block ) )
+            continue;
+        idle = atomic_jiffies.load();
+
+        std::array< uint32_t, 16 > sum = { 0 };
+        for ( size_t i = 0; i < block.size; ++i )
+            sum[ i % block.channels ] += block.data[ i ];
+
+        if ( adc.stream_release( block ) ) {
+            const size_t scans = block.size / block.channels;
+            stream() << "[" << int( block.sequence ) << "] " << int( block.timestamp ) << "\t";
+            for ( size_t ch = 0; ch < block.channels; ++ch )
+                stream() << int( sum[ ch ] / scans ) << "\t";
+            stream() << std::endl;
+        } else {
+            ++invalid;
+        }
+        --nblocks;
+    }
+
+    adc.stream_stop();
+
+    if ( nblocks )
+        stream() << "adc stream: no data for " << int( limit / 10 ) << "ms, " << int( nblocks ) << " blocks missing" << std::endl;
+    stream() << "adc stream: overrun " << int( adc.stream_overrun() )
+             << ", invalid " << int( invalid ) << std::endl;
+}
+
+static void
+adc_decimate( stm32f103::adc& adc, uint32_t ratio, uint8_t order, size_t noutputs )
+{
+    static stm32f103::adc_decimator __decimator;
+    static std::atomic< size_t > __remaining;
+
+    if ( ! __decimator.configure( adc_stream_channels(), ratio, order ) ) {
+        stream() << "adc decimate: ratio " << int( ratio ) << " order " << int( order ) << " out of range" << std::endl;
+        return;
+    }
+
+    __remaining = noutputs;
+    auto print = +[]( const stm32f103::adc_decimated& out ){
+            if ( __remaining == 0 )
+                return;
+            --__remaining;
+            stream() << "[" << int( out.sequence ) << "] " << int( out.timestamp ) << "\t";
+            for ( size_t ch = 0; ch < out.channels; ++ch ) {
+                int frac = ( ( out.data[ ch ] & 0x0f ) * 100 ) / 16; // 12.4 fixed point, two decimals
+                stream() << int( out.data[ ch ] >> 4 ) << ( frac < 10 ? ".0" : "." ) << frac << "\t";
+            }
+            stream() << std::endl;
+        };
+    __decimator.subscribe( print );
+
+    if ( ! adc_stream_start( adc ) ) {
+        stream() << "adc stream start failed" << std::endl;
+        __decimator.unsubscribe( print );
+        return;
+    }
+    adc_print_rate( adc );
+
+    const uint32_t limit = adc_idle_limit( adc );
+    uint32_t idle = atomic_jiffies.load();
+    while ( __remaining && ( atomic_jiffies.load() - idle ) < limit ) {
+        stm32f103::adc_block block;
+        if ( adc.stream_read( block ) ) {
+            __decimator.process( block );
+            adc.stream_release( block );
+            idle = atomic_jiffies.load();
+        }
+    }
+
+    adc.stream_stop();
+    __decimator.unsubscribe( print );
+
+    if ( const size_t missing = __remaining.exchange( 0 ) )
+        stream() << "adc decimate: no data for " << int( limit / 10 ) << "ms, " << int( missing ) << " outputs missing" << std::endl;
+
+    stream() << "adc decimate: ratio " << int( ratio ) << ", order " << int( order )
+             << ", overrun " << int( adc.stream_overrun() ) << std::endl;
+}
+
+static void
+adc_watch( stm32f103::adc& adc, uint16_t low, uint16_t high, int channel, size_t nevents )
+{
+    static std::array< uint16_t, 64 > __capture;
+    constexpr uint16_t pre = 4, post = 4;
+
+    if ( ! adc_stream_start( adc ) ) {
+        stream() << "adc stream start failed" << std::endl;
+        return;
+    }
+    if ( ! adc.watchdog_enable( low, high, channel ) ) {
+        stream() << "adc watch: invalid threshold" << std::endl;
+        adc.stream_stop();
+        return;
+    }
+    bool capture = ( pre + 1 + post ) * adc_stream_channels() <= __capture.size()
+        && adc.capture_arm( __capture.data(), pre, post );
+
+    stream() << "adc watch: [" << int( low ) << ", " << int( high ) << "] on ";
+    if ( channel < 0 )
+        stream() << "all channels" << std::endl;
+    else
+        stream() << "channel " << channel << std::endl;
+
+    const uint32_t tp = atomic_jiffies.load();
+    while ( nevents && ( atomic_jiffies.load() - tp ) < 100000 ) { // 10s
+        stm32f103::adc_watchdog_event event;
+        if ( adc.watchdog_read( event ) ) {
+            stream() << "[" << int( event.timestamp ) << "] ch" << int( event.channel )
+                     << "\t" << int( event.value ) << "\t@" << int( event.position ) << std::endl;
+            --nevents;
+        }
+        stm32f103::adc_capture cap;
+        if ( capture && adc.capture_read( cap ) ) {
+            stream() << "capture @" << int( cap.event.position ) << ":" << std::endl;
+            for ( size_t scan = 0; scan < size_t( cap.pre + 1 + cap.post ); ++scan ) {
+                stream() << ( scan == cap.pre ? "*" : " " ) << "\t";
+                for ( size_t ch = 0; ch < cap.channels; ++ch )
+                    stream() << int( cap.data[ scan * cap.channels + ch ] ) << "\t";
+                stream() << std::endl;
+            }
+            capture = false;
+        }
+    }
+
+    adc.watchdog_disable();
+    adc.stream_stop();
+
+    stream() << "adc watch: lost " << int( adc.watchdog_lost() ) << std::endl;
+}
+
+static void
+adc_bench( uint32_t ratio, uint8_t order )
+{
+    static std::array< uint16_t, 512 > __data;
+    static stm32f103::adc_decimator __decimator;
+
+    constexpr uint8_t channels = 4;
+    if ( ! __decimator.configure( channels, ratio, order ) ) {
+        stream() << "adc bench: ratio " << int( ratio ) << " order " << int( order ) << " out of range" << std::endl;
+        return;
+    }
+
+    for ( size_t i = 0; i < __data.size(); ++i )
+        __data[ i ] = ( i * 37 ) & 0x0fff;
+
+    size_t samples = 0;
+    uint32_t tp = atomic_jiffies.load();
+    while ( ( atomic_jiffies.load() - tp ) < 10000 ) { // 1s
+        __decimator.process( __data.data(), __data.size(), 0 );
+        samples += __data.size();
+    }
+    uint32_t elapsed = atomic_jiffies.load() - tp; // 100us
+    uint32_t n = samples / channels;
+    uint32_t rate = ( n / elapsed ) * 10000 + ( ( n % elapsed ) * 10000 ) / elapsed; // no 64bit division
+
+    stream() << "adc bench: ratio " << int( ratio ) << ", order " << int( order )
+             << "\t" << int( rate ) << " samples/s per channel ("
+             << int( channels ) << " channels)" << std::endl;
+}
+
 void
 adc_command( size_t argc, const char ** argv )
 {
@@ -298,6 +626,95 @@ adc_command( size_t argc, const char ** argv )
                          << "\t" << int(d) << "(mV)"
                          << std::endl;
             }
+        } else if ( strcmp( argv[0], "stream" ) == 0 ) {
+            size_t nblocks = 16;
+            if ( argc > 1 && std::isdigit( *argv[1] ) ) {
+                --argc; ++argv;
+                nblocks = strtod( argv[ 0 ] );
+            }
+            adc_stream( __adc, nblocks );
+        } else if ( strcmp( argv[0], "convert" ) == 0 ) {
+            std::array< uint8_t, 16 > channels;
+            std::array< uint16_t, 16 > results;
+            size_t n = 0;
+            while ( argc > 1 && std::isdigit( *argv[1] ) && n < channels.size() ) {
+                --argc; ++argv;
+                channels[ n++ ] = strtod( argv[ 0 ] );
+            }
+            if ( n == 0 )
+                channels[ n++ ] = 0;
+            if ( __adc.convert( channels.data(), results.data(), n ) ) {
+                for ( size_t i = 0; i < n; ++i )
+                    stream() << "ch" << int( channels[ i ] ) << "\t" << int( results[ i ] ) << std::endl;
+            } else {
+                stream() << "adc convert: timeout" << std::endl;
+            }
+        } else if ( strcmp( argv[0], "watch" ) == 0 ) {
+            uint16_t low = 0, high = 0x0fff;
+            int channel = -1;
+            size_t nevents = 8;
+            if ( argc > 2 && std::isdigit( *argv[1] ) && std::isdigit( *argv[2] ) ) {
+                low = strtod( argv[ 1 ] );
+                high = strtod( argv[ 2 ] );
+                argc -= 2; argv += 2;
+            }
+            if ( argc > 1 && ( std::isdigit( *argv[1] ) || strcmp( argv[1], "all" ) == 0 ) ) {
+                --argc; ++argv;
+                channel = std::isdigit( *argv[0] ) ? int( strtod( argv[ 0 ] ) ) : -1;
+            }
+            if ( argc > 1 && std::isdigit( *argv[1] ) ) {
+                --argc; ++argv;
+                nevents = strtod( argv[ 0 ] );
+            }
+            adc_watch( __adc, low, high, channel, nevents );
+        } else if ( strcmp( argv[0], "mode" ) == 0 ) {
+            if ( argc > 1 ) {
+                --argc; ++argv;
+                if ( strcmp( argv[0], "simultaneous" ) == 0 )
+                    __adc_mode = stm32f103::adc_regular_simultaneous;
+                else if ( strcmp( argv[0], "interleaved" ) == 0 )
+                    __adc_mode = stm32f103::adc_fast_interleaved;
+                else
+                    __adc_mode = stm32f103::adc_independent;
+            }
+            stream() << "adc mode: "
+                     << ( __adc_mode == stm32f103::adc_regular_simultaneous ? "ADC1+ADC2 regular simultaneous (ch0,2,1,3)"
+                          : __adc_mode == stm32f103::adc_fast_interleaved ? "ADC1+ADC2 fast interleaved (ch0, free running)"
+                          : "ADC1 independent" ) << std::endl;
+        } else if ( strcmp( argv[0], "rate" ) == 0 ) {
+            if ( argc > 1 && std::isdigit( *argv[1] ) ) {
+                --argc; ++argv;
+                __adc_sample_rate = strtod( argv[ 0 ] );
+            }
+            if ( __adc_sample_rate ) {
+                auto rate = stm32f103::timer_rate_solver( __adc_sample_rate );
+                stream() << "adc rate: " << int( __adc_sample_rate ) << "Hz -> PSC=" << int( rate.psc ) << " ARR=" << int( rate.arr )
+                         << "\t" << int( rate.hz() ) << "." << ( rate.millihz() < 100 ? ( rate.millihz() < 10 ? "00" : "0" ) : "" )
+                         << int( rate.millihz() ) << "Hz" << std::endl;
+            } else {
+                stream() << "adc rate: free running" << std::endl;
+            }
+        } else if ( strcmp( argv[0], "decimate" ) == 0 || strcmp( argv[0], "bench" ) == 0 ) {
+            bool bench = strcmp( argv[0], "bench" ) == 0;
+            uint32_t ratio = 16;
+            uint8_t order = 3;
+            size_t noutputs = 16;
+            if ( argc > 1 && std::isdigit( *argv[1] ) ) {
+                --argc; ++argv;
+                ratio = strtod( argv[ 0 ] );
+            }
+            if ( argc > 1 && std::isdigit( *argv[1] ) ) {
+                --argc; ++argv;
+                order = strtod( argv[ 0 ] );
+            }
+            if ( !bench && argc > 1 && std::isdigit( *argv[1] ) ) {
+                --argc; ++argv;
+                noutputs = strtod( argv[ 0 ] );
+            }
+            if ( bench )
+                adc_bench( ratio, order );
+            else
+                adc_decimate( __adc, ratio, order, noutputs );
         } else if ( std::isdigit( *argv[0] ) ) {
             count = strtod( argv[ 1 ] );
             for ( size_t i = 0; i < count; ++i ) {
@@ -371,6 +788,24 @@ rtc_status( size_t argc, const char ** argv )
     }
 }
 
+void
+wait_command( size_t argc, const char ** argv )
+{
+    const bool clear = argc > 1 && strcmp( argv[ 1 ], "clear" ) == 0;
+    const uint32_t k = cycle_counter::cycles_per_us();
+    for ( auto p = wait_stats::head().load(); p; p = p->next ) {
+        stream() << p->file << ":" << p->line
+                 << "\twaits " << int( p->waits.load() )
+                 << "\ttimeouts " << int( p->timeouts.load() )
+                 << "\tmax " << int( p->max_cycles / k ) << "us" << std::endl;
+        if ( clear ) {
+            p->waits = 0;
+            p->timeouts = 0;
+            p->max_cycles = 0;
+        }
+    }
+}
+
 ///////////////////////////////////////////////////////
 
 command_processor::command_processor()
@@ -385,16 +820,17 @@ public:
 };
 
 static const primitive command_table [] = {
-    { "spi",    spi_command,    " spi [replicates]" }
-    , { "spi2", spi_command,    " spi2 [replicates]" }
+    { "spi",    spi_command,    " spi [replicates] [r|s] [mode 0..3] [br 0..7|hz n] [lsb] [dma|stream]" }
+    , { "spi2", spi_command,    " spi2 [replicates] [r|s] [mode 0..3] [br 0..7|hz n] [lsb] [dma|stream]" }
     , { "ad5593", ad5593_command,  "ad5593" }
-    , { "adc",  adc_command,    " replicates (1)" }
+    , { "adc",  adc_command,    " replicates (1) | mode [single|simultaneous|interleaved] | convert [ch...] | rate [Hz] | stream [blocks] | watch low high [ch|all] [events] | decimate [ratio] [order] [outputs] | bench [ratio] [order]" }
     , { "alt",  alt_test,       " spi [remap]" }
     , { "bkp",    bkp_command,  " backup registers" }
     , { "bmp",    bmp280_command,  " start|stop" }
     , { "can",    can_command,  " can" }
     , { "cansend",  can_command,  " cansend 01a#11223333aabbccdd" }
     , { "candump",  can_command,  " candump" }
+    , { "slcan",    slcan_command, " slcan [baud] (Lawicel gateway on the console, ^C to leave)" }
     , { "gpio", gpio_command,   " pin# (toggle PA# as GPIO, where # is 0..12)" }
     , { "rcc",  rcc_status,     " RCC clock enable register list" }
     , { "rtc",  rtc_status,     " RTC register print" }
@@ -403,11 +839,13 @@ static const primitive command_table [] = {
     , { "afio", afio_test,      " AFIO MAPR list" }
     , { "i2c",  i2c_command,    " I2C-1 test" }
     , { "i2c2", i2c_command,    " I2C-2 test" }
-    , { "i2cdetect", i2cdetect, " i2cdetect [0|1]" }
+    , { "i2cdetect", i2cdetect, " [0|1] -- address-only write scan, both buses at once unless given" }
+    , { "bench", bench_command, " i2c [rounds] [bytes] [addr1] [addr2] [reg] -- serial vs. parallel i2c1/i2c2 throughput" }
     , { "dma",    dma_command,     " ram to ram dma copy teset" }
     , { "timer",  timer_command,   "" }
     , { "date",   date_command,     " show current date time; date --set 'iso format date'" }
     , { "hwclock", hwclock_command, "" }
+    , { "wait",   wait_command,     " [clear] deadline wait statistics per call site" }
     , { "reset", system_reset, "" }
     , { "help", help, "" }
     , { "?", help, "" }
@@ -6,8 +6,13 @@
 
 #pragma once
 
+#include <atomic>
 #include <cstddef>
+#include <cstdint>
 
+extern uint32_t __system_clock;
+
+// loop count bound; the actual time depends on the clock and on what the condition reads
 struct condition_wait {
     size_t count;
     condition_wait( size_t maxcounts = 0xffff ) : count( maxcounts ) {}
@@ -17,3 +22,89 @@ struct condition_wait {
         return count != 0;
     }
 };
+
+// DWT cycle counter (ARMv7-M ARM C1.8), counts HCLK; wraps after ~59s at 72MHz
+struct cycle_counter {
+    static inline uint32_t now() { return *reinterpret_cast< volatile uint32_t * >( 0xe0001004 ); } // DWT_CYCCNT
+
+    static inline void enable() {
+        auto DEMCR = reinterpret_cast< volatile uint32_t * >( 0xe000edfc );
+        auto DWT_CTRL = reinterpret_cast< volatile uint32_t * >( 0xe0001000 );
+        if ( ( *DWT_CTRL & 1 ) == 0 ) {
+            *DEMCR |= 1 << 24;   // TRCENA
+            *DWT_CTRL |= 1;      // CYCCNTENA
+        }
+    }
+
+    static inline uint32_t cycles_per_us() { return __system_clock >= 1000000 ? __system_clock / 1000000 : 8; } // HSI before clock setup
+
+    static inline uint32_t us_to_cycles( uint32_t us ) {
+        const uint32_t k = cycles_per_us();
+        return us < 0xffffffff / k ? us * k : 0xffffffff;
+    }
+};
+
+// per call site statistics of deadline_wait; constant initialized, linked on first use
+struct wait_stats {
+    const char * file;
+    int line;
+    std::atomic< uint32_t > waits;
+    std::atomic< uint32_t > timeouts;
+    uint32_t max_cycles;                 // longest successful wait
+    wait_stats * next;
+    std::atomic< bool > linked;
+
+    constexpr wait_stats( const char * f, int l ) : file( f ), line( l ), waits( 0 ), timeouts( 0 ), max_cycles( 0 )
+                                                  , next( nullptr ), linked( false ) {}
+
+    static inline std::atomic< wait_stats * >& head() {
+        static std::atomic< wait_stats * > __head;
+        return __head;
+    }
+
+    inline void record( uint32_t cycles, bool success ) {
+        if ( !linked.exchange( true ) ) {
+            auto p = head().load();
+            do {
+                next = p;
+            } while ( !head().compare_exchange_weak( p, this ) );
+        }
+        ++waits;
+        if ( !success )
+            ++timeouts;
+        else if ( cycles > max_cycles )
+            max_cycles = cycles;
+    }
+};
+
+// Polls condition until it holds or the deadline, measured on the cycle counter, passes.
+// With wfe the core sleeps between polls; use it only for conditions that an interrupt makes true,
+// SysTick (100us) bounds the sleep otherwise.
+struct deadline_wait {
+    uint32_t start;
+    uint32_t cycles;
+    wait_stats * stats;
+    bool wfe;
+
+    deadline_wait( uint32_t us, wait_stats * s = nullptr, bool w = false ) : stats( s ), wfe( w ) {
+        cycle_counter::enable();
+        cycles = cycle_counter::us_to_cycles( us );
+        start = cycle_counter::now();
+    }
+
+    template< typename functor > inline bool operator()( functor condition ) {
+        bool success;
+        uint32_t elapsed = 0;
+        while ( !( success = condition() ) && ( elapsed = cycle_counter::now() - start ) < cycles ) {
+            if ( wfe )
+                __asm__ volatile ( "wfe" );
+        }
+        if ( stats )
+            stats->record( success ? cycle_counter::now() - start : elapsed, success );
+        return success;
+    }
+};
+
+// deadline_wait with statistics for the call site, listed by the 'wait' command
+#define DEADLINE_WAIT( us, ... )                                        \
+    deadline_wait( us, []{ static wait_stats __stats( __FILE__, __LINE__ ); return &__stats; }(), ##__VA_ARGS__ )
@@ -105,7 +105,7 @@ void ( * const vector_table [] )() __attribute__ ((section(".vect"))) = {
 	__i2c1_event_handler,           /* 0x0BC I2C1 event                      */
 	__i2c1_error_handler,           /* 0x0C0 I2C1 error                      */
 	__i2c2_event_handler,           /* 0x0C4 I2C2 event                      */
-	__i2c2_event_handler,           /* 0x0C8 I2C2 error                      */
+	__i2c2_error_handler,           /* 0x0C8 I2C2 error                      */
 	__spi1_handler,                 /* 0x0CC SPI1                            */
 	__spi2_handler,                 /* 0x0D0 SPI2                            */
 	__usart1_handler,               /* 0x0D4 USART1                          */
@@ -23,14 +23,6 @@ namespace stm32f103 {
 }
 
 namespace stm32f103 {
-    // DMA_ISRx = [27:24][23:20]..[3:0]; // 4bit/word
-    enum DMA_ISRx {       // interrupt status register
-        TEIF  = 1 << 3        // transfer error flag
-        , HTIF  = 1 << 2      // half transfer flag
-        , TCIF  = 1 << 1      // transfer complete flag
-        , GIF   = 1           // global interrupt flag
-    };
-
     enum DMA_IFCRx {  // 4bit/word
         CTEIF  = 1 << 3  // Channel x transfer error clear
         , CHTIF  = 1 << 2  // Channel x half transfer clear
@@ -110,14 +102,21 @@ dma::init_channel( DMA_CHANNEL channel_number
 void
 dma::enable( uint32_t channel_number, bool enable )
 {
+    this->enable( channel_number, enable, TCIE | TEIE ); // transfer complete interrupt enable, error irq
+}
+
+void
+dma::enable( uint32_t channel_number, bool enable, uint32_t interrupt_enable )
+{
+    interrupt_enable &= ( HTIE | TCIE | TEIE );
     if ( enable ) {
         while ( !lock_.test_and_set( std::memory_order_acquire ) )
             ;
         interrupt_status_ &= ~( 0x0f << channel_number );
         lock_.clear();
-        dmaChannel( channel_number ).CCR |= EN | TCIE | TEIE; // channel enable, transfer complete interrupt enable, error irq
+        dmaChannel( channel_number ).CCR |= EN | interrupt_enable; // channel enable
     } else {
-        dmaChannel( channel_number ).CCR &= ~( EN | TCIE );
+        dmaChannel( channel_number ).CCR &= ~( EN | TCIE | interrupt_enable );
     }
 #if 0
     stream( __FILE__, __LINE__ ) << "dma dma #" << channel_number << ": " << enable << std::endl;
@@ -151,6 +150,12 @@ dma::set_receive_buffer( uint32_t channel_number, uint8_t * buffer, size_t size
     dmaChannel( channel_number ).CNDTR = size;
 }
 
+uint16_t
+dma::remaining( uint32_t channel ) const
+{
+    return uint16_t( dma_->channels[ channel ].CNDTR );
+}
+
 bool
 dma::transfer_complete( uint32_t channel )
 {
@@ -59,6 +59,7 @@ namespace stm32f103 {
         inline operator bool () const { return dma_; };
 
         void enable( uint32_t channel, bool );
+        void enable( uint32_t channel, bool, uint32_t interrupt_enable ); // CCR {HTIE|TCIE|TEIE} bits
 
         void set_transfer_buffer( uint32_t channel, const uint8_t * buffer, size_t size );
         void set_receive_buffer( uint32_t channel, uint8_t * buffer, size_t size );
@@ -74,12 +75,14 @@ namespace stm32f103 {
         }
 
         bool transfer_complete( uint32_t channel );
+        uint16_t remaining( uint32_t channel ) const; // CNDTR, transfers left before wrap/complete
 
         void set_callback( uint32_t channel, void(*callback)( uint32_t ) ) {
             callbacks_.at( channel ) = callback;
         }
 
         void clear_callback( uint32_t channel );
+        inline void (*callback( uint32_t channel ) const)( uint32_t ) { return callbacks_.at( channel ); } // owner, if any
         
         void handle_interrupt( uint32_t );
     };
@@ -0,0 +1,73 @@
+// Copyright (C) 2018 MS-Cheminformatics LLC
+// Licence: CC BY-NC
+// Author: Toshinobu Hondo, Ph.D.
+// Contact: toshi.hondo@qtplatz.com
+//
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+namespace stm32f103 {
+
+    // Hands the halves of a circular dma buffer from the HT/TC interrupt (producer) to a thread
+    // (consumer). One entry per half, indexed by sequence & 1; the isr never waits, it drops the
+    // oldest unread block instead, which dma is about to overwrite. Block has a 'sequence' member.
+    template< typename Block >
+    class dma_block_queue {
+        std::array< Block, 2 > blocks_;
+        std::atomic< uint32_t > head_;       // number of blocks produced
+        std::atomic< uint32_t > tail_;       // number of blocks consumed (or dropped)
+        std::atomic< uint32_t > overrun_;    // blocks lost to a slow consumer
+
+    public:
+        dma_block_queue() : head_( 0 ), tail_( 0 ), overrun_( 0 ) {}
+
+        inline void clear() {
+            head_ = 0;
+            tail_ = 0;
+            overrun_ = 0;
+        }
+
+        inline uint32_t head() const { return head_.load(); }    // sequence of the next block
+        inline uint32_t overrun() const { return overrun_.load(); }
+
+        // isr context; block.sequence must be head()
+        const Block& push( const Block& block ) {
+            const uint32_t seq = head_.load();
+            uint32_t tail = tail_.load();
+            if ( seq - tail >= blocks_.size() ) {
+                // consumer did not pick up the oldest block, which is about to be reused -- drop it
+                if ( tail_.compare_exchange_strong( tail, tail + 1 ) )
+                    ++overrun_;
+            }
+            blocks_[ seq & 01 ] = block;
+            head_ = seq + 1;
+            return blocks_[ seq & 01 ];
+        }
+
+        // non-blocking, false if no block is ready
+        bool read( Block& block ) {
+            uint32_t tail = tail_.load();
+            do {
+                if ( tail == head_.load() )
+                    return false;
+                block = blocks_[ tail & 01 ];
+            } while ( ! tail_.compare_exchange_weak( tail, tail + 1 ) ); // dma irq dropped it while copying
+            return true;
+        }
+
+        // false if dma has overwritten the block while in use
+        bool release( const Block& block ) {
+            // block N is being overwritten once block N+1 has been completed
+            if ( ( head_.load() - block.sequence ) > 1 ) {
+                ++overrun_;
+                return false;
+            }
+            return true;
+        }
+    };
+
+}
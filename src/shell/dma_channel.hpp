@@ -26,8 +26,8 @@ namespace stm32f103 {
         DMA_ADC1 = 0
         , DMA_SPI1_RX = 1
         , DMA_SPI1_TX = 2
-        //, DMA_SPI2_RX = 4
-        //, DMA_SPI2_TX = 5
+        , DMA_SPI2_RX = 3        // shared with I2C2_TX
+        , DMA_SPI2_TX = 4        // shared with I2C2_RX
         , DMA_I2C2_TX = 3
         , DMA_I2C2_RX = 4        
         , DMA_I2C1_TX = 5
@@ -66,6 +66,15 @@ namespace stm32f103 {
         , EN          = 1        // 0x0001 Channel enable
     };
 
+    // DMA_ISRx = [27:24][23:20]..[3:0]; // 4bit/word
+    // callbacks receive the channel's 4 bits shifted down to [3:0]
+    enum DMA_ISRx : uint32_t {  // interrupt status register
+        TEIF  = 1 << 3        // transfer error flag
+        , HTIF  = 1 << 2      // half transfer flag
+        , TCIF  = 1 << 1      // transfer complete flag
+        , GIF   = 1           // global interrupt flag
+    };
+
     //---------------------------------------
     template< DMA_CHANNEL >
     struct peripheral_address {
@@ -136,10 +145,19 @@ namespace stm32f103 {
             dma.init_channel( channel, peripheral_address, data, size, dma_ccr );
         }
 
+        // same peripheral, different transfer width/mode (e.g. 32bit dual adc)
+        dma_channel_t( dma& dma, uint8_t * data, uint16_t size, uint32_t ccr ) : dma_( dma ) {
+            dma.init_channel( channel, peripheral_address, data, size, ccr );
+        }
+
         inline void enable( bool enable ) {
             dma_.enable( channel, enable );
         }
 
+        inline void enable( bool enable, uint32_t interrupt_enable ) {
+            dma_.enable( channel, enable, interrupt_enable );
+        }
+
         template< typename buffer_type >
         inline void set_transfer_buffer( const buffer_type * buffer, size_t size ) {
             dma_.set_transfer_buffer( channel, buffer, size );
@@ -154,6 +172,10 @@ namespace stm32f103 {
             return dma_.transfer_complete( channel );
         }
 
+        inline uint16_t remaining() const {
+            return dma_.remaining( channel );
+        }
+
         inline void set_callback( void(*callback)( uint32_t ) ) {
             dma_.set_callback( channel, callback );
         }
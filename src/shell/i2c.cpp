@@ -13,12 +13,14 @@
 #include "scoped_spinlock.hpp"
 #include "stream.hpp"
 #include "stm32f103.hpp"
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <mutex>
 
 extern uint32_t __pclk1, __pclk2;
 extern void mdelay( uint32_t );
+extern std::atomic< uint32_t > atomic_jiffies;
 
 extern "C" {
     void i2c1_handler();
@@ -28,7 +30,8 @@ extern "C" {
 // bits in the status register
 namespace stm32f103 {
 
-    constexpr uint32_t i2c_clock_speed = 100'000; //'; //100kHz
+    constexpr uint32_t i2c_timeout_us = 1000;     // per bus event; ~10 byte times at 100kHz, room for clock stretching
+    constexpr uint32_t i2c_byte_timeout_us = 100; // per byte of a dma transfer, 9 SCL at 100kHz
 
     enum I2C_CR1_MASK {
         SWRST          = 1 << 15  // Software reset (0 := not under reset, 0 := under reset state
@@ -109,10 +112,14 @@ namespace stm32f103 {
     };
 
     struct i2c_reset {
-        bool operator()( volatile I2C& i2c, uint8_t own_addr = 0 ) {
+        bool operator()( volatile I2C& i2c, uint8_t own_addr = 0, const i2c_timing * timing = nullptr ) {
             if ( own_addr == 0 )
                 own_addr = i2c.OAR1 >> 1;
 
+            // SWRST clears CCR/TRISE; keep the current ones unless told otherwise
+            const uint16_t ccr = timing ? timing->ccr : uint16_t( i2c.CCR );
+            const uint16_t trise = timing ? timing->trise : uint16_t( i2c.TRISE );
+
             bitset::reset( i2c.CR1, PE );
             bitset::set( i2c.CR1, SWRST );
             while ( i2c.SR1 && i2c.SR2 )
@@ -121,22 +128,18 @@ namespace stm32f103 {
             bitset::reset( i2c.CR1, PE );
 
             uint16_t freqrange = uint16_t( __pclk1 / 1000'000 /*'*/ ); // source clk in MHz
-            uint16_t cr2 = freqrange;
-            i2c.CR2 |= cr2;
+            i2c.CR2 = ( i2c.CR2 & ~FREQ ) | freqrange;
 
-            // p784,
-            i2c.TRISE = freqrange + 1;
+            // p784, CCR and TRISE are written while PE = 0
+            i2c.TRISE = trise;
             i2c.OAR1 = own_addr << 1;
             i2c.OAR2 = 0;
-
-            uint16_t ccr = __pclk1 / ( i2c_clock_speed * 2 );  // ratio make it 5us for 10us interval clock
-            i2c.CCR = ccr;  // Sm mode
+            i2c.CCR = ccr;
 
             return true;
         }
     };
 
-
     // master start
     struct i2c_start {
         volatile I2C& _;
@@ -146,7 +149,7 @@ namespace stm32f103 {
 
         inline bool operator()() const {
             bitset::set( _.CR1, START );
-            return condition_wait()( [&]{ return _.SR1 & SB; } );
+            return DEADLINE_WAIT( i2c_timeout_us )( [&]{ return _.SR1 & SB; } );
         }
     };
 
@@ -169,7 +172,7 @@ namespace stm32f103 {
             auto status = _.SR1 | ( _.SR2 << 16 ); // clear ADDR
             if ( success ) {
                 bitset::set( _.CR1, STOP );
-                condition_wait()( [&]{ return !bitset::test(_.SR2, BUSY); } );
+                DEADLINE_WAIT( i2c_timeout_us )( [&]{ return !bitset::test(_.SR2, BUSY); } );
             }
 
             bitset::reset( _.CR2, LAST );
@@ -196,7 +199,7 @@ namespace stm32f103 {
         inline bool operator()( volatile I2C& _, uint8_t address ) {
 
             _.DR = ( address << 1 );
-            return condition_wait()( [&]{ return _.SR1 & ADDR; } );
+            return DEADLINE_WAIT( i2c_timeout_us )( [&]{ return _.SR1 & ADDR; } );
         }
 
         void static clear( volatile I2C& _ ) {
@@ -206,7 +209,7 @@ namespace stm32f103 {
 
     template<> inline bool i2c_address<Receiver>::operator()( volatile I2C& _, uint8_t address ) {
         _.DR = (address << 1) | 1;
-        return condition_wait()( [&](){ return _.SR1 & ADDR; } );
+        return DEADLINE_WAIT( i2c_timeout_us )( [&](){ return _.SR1 & ADDR; } );
     }
 
     template<> void i2c_address<Receiver>::clear( volatile I2C& _ ) {
@@ -227,9 +230,9 @@ namespace stm32f103 {
             if ( start() ) {
                 if ( i2c_address< Receiver >()( _, address ) ) {
                     i2c_address<Receiver>().clear( _ );
-                    condition_wait()( [&](){ return !_.SR1 & ADDR; } );
+                    DEADLINE_WAIT( i2c_timeout_us )( [&](){ return !_.SR1 & ADDR; } );
                     while ( size >= 3 ) {
-                        if ( condition_wait()( [&](){ return _.SR1 & (RxNE|BTF); } ) ) {
+                        if ( DEADLINE_WAIT( i2c_timeout_us )( [&](){ return _.SR1 & (RxNE|BTF); } ) ) {
                             if ( _.SR1 & RxNE ) {
                                 *data++ = _.DR;
                                 --size;
@@ -238,7 +241,7 @@ namespace stm32f103 {
                             return I2C_POLLING_MASTER_RECEIVER_RECV_TIMEOUT;
                         }
                     }
-                    if ( condition_wait()( [&](){ return _.SR1 & BTF; } ) ) {
+                    if ( DEADLINE_WAIT( i2c_timeout_us )( [&](){ return _.SR1 & BTF; } ) ) {
                         bitset::reset( _.CR1, ACK );
                         bitset::set( _.CR1, STOP );
                         *data++ = _.DR;  // Data N-1
@@ -246,7 +249,7 @@ namespace stm32f103 {
                     } else {
                         return I2C_POLLING_MASTER_RECEIVER_RECV_TIMEOUT;
                     }
-                    if ( condition_wait()( [&](){ return _.SR1 & RxNE; } ) ) {
+                    if ( DEADLINE_WAIT( i2c_timeout_us )( [&](){ return _.SR1 & RxNE; } ) ) {
                         *data++ = _.DR;
                         --size;
                         return I2C_RESULT_SUCCESS;
@@ -269,14 +272,14 @@ namespace stm32f103 {
                 bitset::set( _.CR1, POS );
                 i2c_address<Receiver>().clear( _ );
                 bitset::reset( _.CR1, ACK );
-                if ( condition_wait()( [&](){ return _.SR1 & BTF; } ) ) {
+                if ( DEADLINE_WAIT( i2c_timeout_us )( [&](){ return _.SR1 & BTF; } ) ) {
                     bitset::set( _.CR1, STOP );
                     *data++ = _.DR;
                     --size;
-                    if ( condition_wait()( [&](){ return _.SR1 & (RxNE|BTF); } ) ) {
+                    if ( DEADLINE_WAIT( i2c_timeout_us )( [&](){ return _.SR1 & (RxNE|BTF); } ) ) {
                         *data++ = _.DR;
                         --size;
-                        if ( condition_wait()( [&](){ return !bitset::test(_.SR2, BUSY); } ) ) {
+                        if ( DEADLINE_WAIT( i2c_timeout_us )( [&](){ return !bitset::test(_.SR2, BUSY); } ) ) {
                             bitset::reset( _.CR1, POS );
                         }
                     }
@@ -294,7 +297,7 @@ namespace stm32f103 {
                 bitset::reset( _.CR1, ACK );           // ACK = 0
                 i2c_address<Receiver>().clear( _ );    // Clear ADDR
                 bitset::set( _.CR1, STOP );            // STOP = 1
-                if ( condition_wait()( [&](){ return _.SR1 & RxNE; } ) ) {  // Wait until RxNE = 1
+                if ( DEADLINE_WAIT( i2c_timeout_us )( [&](){ return _.SR1 & RxNE; } ) ) {  // Wait until RxNE = 1
                     *data++ = _.DR;                    // Read the data
                     --size;
                 }
@@ -313,7 +316,7 @@ namespace stm32f103 {
 
         inline bool operator << ( uint8_t data ) {
             _.DR = data;
-            return condition_wait()( [&](){ return _.SR1 & TxE|BTF; } );
+            return DEADLINE_WAIT( i2c_timeout_us )( [&](){ return _.SR1 & TxE|BTF; } );
         }
     };
 
@@ -332,7 +335,7 @@ namespace stm32f103 {
                     return I2C_DEVICE_ERROR_CONDITION;
             }
 
-            if ( ! condition_wait()( [&](){ return !st.busy(); } ) ) {
+            if ( ! DEADLINE_WAIT( i2c_timeout_us )( [&](){ return !st.busy(); } ) ) {
                 if ( ( _.SR1 & error_condition ) && ( _.SR2 & (BUSY| MSL) ) )
                     i2c_reset()( _, own_addr_ );  // Reset i2c chip
             }
@@ -365,7 +368,7 @@ namespace stm32f103 {
                 if ( i2c_address< Transmitter >()( _, address ) ) {
                     i2c_address< Transmitter >().clear( _ );
 
-                    if ( condition_wait()( [&]{ return dma_channel.transfer_complete(); } ) )
+                    if ( DEADLINE_WAIT( i2c_timeout_us + size * i2c_byte_timeout_us )( [&]{ return dma_channel.transfer_complete(); } ) )
                         return I2C_RESULT_SUCCESS;
                     else
                         return I2C_DMA_MASTER_TRANSMITTER_SEND_TIMEOUT;
@@ -396,7 +399,7 @@ namespace stm32f103 {
             if ( start() ) { // generate start condition (master start)
                 if ( i2c_address< Receiver >()( _, address ) ) {
                     i2c_address< Receiver >::clear(_);
-                    if ( condition_wait()( [&](){ return dma_channel.transfer_complete(); } ) ) {
+                    if ( DEADLINE_WAIT( i2c_timeout_us + size * i2c_byte_timeout_us )( [&](){ return dma_channel.transfer_complete(); } ) ) {
                         return I2C_RESULT_SUCCESS;
                     } else
                         return I2C_DMA_MASTER_RECEIVER_RECV_TIMEOUT;
@@ -423,6 +426,23 @@ static dma_channel_t< DMA_I2C2_TX > * __dma_i2c2_tx;
 static dma_channel_t< DMA_I2C2_RX > * __dma_i2c2_rx;
 
 i2c::i2c() : i2c_( 0 )
+           , listening_( false )
+           , timing_( i2c_standard_mode )
+           , transaction_( nullptr )
+           , pending_( nullptr )
+           , queue_( nullptr )
+           , segment_( 0 )
+           , data_( nullptr )
+           , remaining_( 0 )
+           , address_phase_( false )
+           , started_( 0 )
+           , stats_since_( 0 )
+           , slave_{ nullptr, 0, nullptr }
+           , slave_state_( slave_idle )
+           , slave_pointer_( 0 )
+           , slave_offset_( 0 )
+           , slave_count_( 0 )
+           , slave_bytes_( 0 )
 {
 }
 
@@ -469,6 +489,13 @@ i2c::init( stm32f103::I2C_BASE addr )
 {
     lock_.clear();
     own_addr_ = ( addr == I2C1_BASE ) ? 0x03 : 0x04;
+    listening_ = false;
+    transaction_ = nullptr;
+    pending_ = nullptr;
+    queue_ = nullptr;
+    remaining_ = 0;
+    clear_stats();
+    timing_ = ( __pclk1 == i2c_pclk1 ) ? i2c_standard_mode : i2c_timing_solver( 100000, I2C_DUTY_2, __pclk1 );
 
     if ( auto I2C = reinterpret_cast< volatile stm32f103::I2C * >( addr ) ) {
         i2c_ = I2C;
@@ -497,14 +524,49 @@ i2c::listen( uint8_t addr )
     i2c_->OAR1 = own_addr_ << 1;
     bitset::set( i2c_->CR1, ACK );
     bitset::set( i2c_->CR2, ITEVTEN | ITERREN );
+    listening_ = true;
 
     return true;
 }
 
+bool
+i2c::listen( uint8_t addr, const i2c_register_file& regs )
+{
+    if ( regs.data == nullptr || regs.size == 0 || regs.size > 256 )
+        return false;
+
+    bitset::reset( i2c_->CR2, ITEVTEN | ITERREN | ITBUFFN );
+    slave_ = regs;
+    slave_state_ = slave_idle;
+    slave_pointer_ = 0;
+    bitset::set( i2c_->CR1, PE );
+    return listen( addr );
+}
+
 void
 i2c::reset()
 {
-    i2c_reset()( *i2c_, own_addr_ );
+    i2c_reset()( *i2c_, own_addr_, &timing_ );
+}
+
+bool
+i2c::set_speed( uint32_t hz, I2C_DUTY duty )
+{
+    auto timing = i2c_timing_solver( hz, duty, __pclk1 );
+    if ( !timing.valid || i2c_ == nullptr )
+        return false;
+
+    scoped_lock lock( *this );
+    DEADLINE_WAIT( i2c_timeout_us )( [&]{ return !( i2c_->CR1 & STOP ); } );
+
+    timing_ = timing;
+    bitset::reset( i2c_->CR1, PE ); // CCR is writable only while disabled
+    i2c_->TRISE = timing_.trise;
+    i2c_->CCR = timing_.ccr;
+    bitset::set( i2c_->CR1, PE );
+    if ( listening_ )
+        bitset::set( i2c_->CR1, ACK );
+    return true;
 }
 
 bool
@@ -563,6 +625,18 @@ i2c::print_result( stream&& o ) const
         o << "i2c dma master transmitter address failed"; break;
     case I2C_DMA_MASTER_TRANSMITTER_SEND_TIMEOUT:
         o << "i2c dma master transmitter send timeout"; break;
+    case I2C_TRANSFER_PENDING:
+        o << "i2c transfer pending"; break;
+    case I2C_TRANSFER_ADDRESS_NACK:
+        o << "i2c transfer address nack"; break;
+    case I2C_TRANSFER_DATA_NACK:
+        o << "i2c transfer data nack"; break;
+    case I2C_TRANSFER_ARBITRATION_LOST:
+        o << "i2c transfer arbitration lost"; break;
+    case I2C_TRANSFER_BUS_ERROR:
+        o << "i2c transfer bus error"; break;
+    case I2C_TRANSFER_TIMEOUT:
+        o << "i2c transfer timeout"; break;
     default:
         o << "error code: " << code << "\t";
         break;
@@ -595,7 +669,7 @@ i2c::print_status( stream&& o ) const
 bool
 i2c::read( uint8_t address, uint8_t * data, size_t size )
 {
-    scoped_spinlock<> lock( lock_ );
+    scoped_lock lock( *this );
 
     if ( ( result_code_ = i2c_ready_wait( *i2c_, own_addr_ )() ) != I2C_RESULT_SUCCESS )
         return false;
@@ -612,7 +686,7 @@ i2c::read( uint8_t address, uint8_t * data, size_t size )
 bool
 i2c::write( uint8_t address, const uint8_t * data, size_t size )
 {
-    scoped_spinlock<> lock( lock_ );
+    scoped_lock lock( *this );
 
     bitset::set( i2c_->CR1, ACK | PE );
 
@@ -648,7 +722,7 @@ i2c::write( uint8_t address, const uint8_t * data, size_t size )
 bool
 i2c::dma_transfer( uint8_t address, const uint8_t * data, size_t size )
 {
-    scoped_spinlock<> lock( lock_ );
+    scoped_lock lock( *this );
 
     const auto base_addr = reinterpret_cast< uint32_t >( const_cast< I2C * >(i2c_) );
     if ( base_addr == I2C1_BASE && __dma_i2c1_tx == nullptr ) {
@@ -681,7 +755,7 @@ i2c::dma_transfer( uint8_t address, const uint8_t * data, size_t size )
 bool
 i2c::dma_receive( uint8_t address, uint8_t * data, size_t size )
 {
-    scoped_spinlock<> lock( lock_ );
+    scoped_lock lock( *this );
 
     const auto base_addr = reinterpret_cast< uint32_t >( const_cast< I2C * >(i2c_) );
 
@@ -712,15 +786,544 @@ i2c::dma_receive( uint8_t address, uint8_t * data, size_t size )
     return false;
 }
 
+bool
+i2c::submit( i2c_transaction& t )
+{
+    if ( i2c_ == nullptr || t.count == 0 || t.segments == nullptr )
+        return false;
+
+    for ( size_t i = 0; i < t.count; ++i )
+        if ( t.segments[ i ].read && t.segments[ i ].size == 0 )
+            return false;
+
+    // a transaction is linked once at a time
+    auto result = t.result.load();
+    do {
+        if ( result == I2C_TRANSFER_PENDING )
+            return false;
+    } while ( ! t.result.compare_exchange_weak( result, I2C_TRANSFER_PENDING ) );
+
+    cycle_counter::enable();
+    t.submitted = cycle_counter::now();
+    t.bus = this;
+
+    auto head = pending_.load();
+    do {
+        t.next = head;
+    } while ( ! pending_.compare_exchange_weak( head, &t ) );
+
+    dispatch();
+    return true;
+}
+
+// lock_ owner only
+i2c_transaction *
+i2c::next_transaction()
+{
+    // take the submitted ones at once, keep them in submission order
+    if ( auto p = pending_.exchange( nullptr ) ) {
+        i2c_transaction * fifo = nullptr;
+        while ( p ) {
+            auto next = p->next;
+            p->next = fifo;
+            fifo = p;
+            p = next;
+        }
+        auto tail = &queue_;
+        while ( *tail )
+            tail = &( *tail )->next;
+        *tail = fifo;
+    }
+
+    if ( queue_ == nullptr )
+        return nullptr;
+
+    const uint32_t now = cycle_counter::now();
+    const uint32_t k = cycle_counter::cycles_per_us();
+
+    i2c_transaction ** best = nullptr;
+    uint32_t best_late = 0;    // overdue cycles
+    uint32_t best_level = 0;   // priority + age
+    for ( auto pp = &queue_; *pp; pp = &( *pp )->next ) {
+        const auto t = *pp;
+        const uint32_t age = now - t->submitted;
+        const uint32_t deadline = cycle_counter::us_to_cycles( t->deadline_us );
+        const uint32_t late = ( t->deadline_us && age >= deadline ) ? age - deadline + 1 : 0;
+        const uint32_t level = t->priority + age / ( k * i2c_aging_us );
+        if ( best == nullptr
+             || late > best_late
+             || ( late == 0 && best_late == 0 && level > best_level ) ) {
+            best = pp;
+            best_late = late;
+            best_level = level;
+        }
+    }
+    auto t = *best;
+    *best = t->next;
+    return t;
+}
+
+void
+i2c::dispatch()
+{
+    while ( pending_.load() || queue_ ) {
+        if ( lock_.test_and_set( std::memory_order_acquire ) )
+            return; // the owner picks it up when it completes
+        if ( auto t = next_transaction() ) {
+            start( t );
+            return;
+        }
+        lock_.clear( std::memory_order_release );
+    }
+}
+
+void
+i2c::start( i2c_transaction * t )
+{
+    segment_ = 0;
+    data_ = t->segments[ 0 ].data;
+    remaining_ = t->segments[ 0 ].size;
+    address_phase_ = true;
+    started_ = cycle_counter::now();
+    transaction_ = t;
+
+    // START must not be set while the previous STOP is still pending
+    DEADLINE_WAIT( i2c_timeout_us )( [&]{ return !( i2c_->CR1 & STOP ); } );
+
+    bitset::reset( i2c_->CR1, POS );
+    bitset::set( i2c_->CR1, PE | ACK );
+    i2c_->SR1 &= ~error_condition;
+    bitset::set( i2c_->CR2, ITEVTEN | ITERREN | ITBUFFN );
+    bitset::set( i2c_->CR1, START );
+}
+
+I2C_RESULT_CODE
+i2c::wait( i2c_transaction& t, uint32_t timeout_us )
+{
+    while ( ! DEADLINE_WAIT( timeout_us, true )( [&]{ return t.result.load() != I2C_TRANSFER_PENDING; } ) )
+        abort_hung( timeout_us ); // ours is either on the bus or queued behind healthy transfers
+    return t.result.load();
+}
+
+// aborts the transaction on the bus only if it has held the bus for limit_us since its START;
+// one queued behind it may wait longer than that under deadline and priority ordering
+bool
+i2c::abort_hung( uint32_t limit_us )
+{
+    auto current = transaction_.load();
+    if ( current == nullptr || ( cycle_counter::now() - started_ ) < cycle_counter::us_to_cycles( limit_us ) )
+        return false;
+    return abort( *current );  // fails if it completed in the meantime
+}
+
+//static
+bool
+i2c::wait_all( i2c_transaction * const * list, size_t size, uint32_t timeout_us )
+{
+    auto done = [&]{
+        return std::none_of( list, list + size, []( auto t ){ return t->result.load() == I2C_TRANSFER_PENDING; } );
+    };
+    while ( ! DEADLINE_WAIT( timeout_us, true )( done ) ) {
+        for ( size_t i = 0; i < size; ++i ) { // a hung bus holding the ones still pending
+            if ( list[ i ]->result.load() == I2C_TRANSFER_PENDING )
+                list[ i ]->bus->abort_hung( timeout_us );
+        }
+    }
+    return std::all_of( list, list + size, []( auto t ){ return t->result.load() == I2C_RESULT_SUCCESS; } );
+}
+
+//static
+int
+i2c::wait_any( i2c_transaction * const * list, size_t size, uint32_t timeout_us )
+{
+    int index = -1;
+    DEADLINE_WAIT( timeout_us, true )( [&]{
+            for ( size_t i = 0; i < size; ++i ) {
+                if ( list[ i ]->result.load() != I2C_TRANSFER_PENDING ) {
+                    index = int( i );
+                    return true;
+                }
+            }
+            return false;
+        });
+    return index;
+}
+
+I2C_RESULT_CODE
+i2c::transact( i2c_transaction& t )
+{
+    if ( ! submit( t ) )
+        return I2C_DEVICE_ERROR_CONDITION;
+    return wait( t );
+}
+
+bool
+i2c::abort( i2c_transaction& t )
+{
+    i2c_transaction * expected = &t;
+    if ( ! transaction_.compare_exchange_strong( expected, nullptr ) )
+        return false;  // not on the bus, or completed in the meantime
+
+    bitset::reset( i2c_->CR2, ITBUFFN | ( listening_ ? 0 : ( ITEVTEN | ITERREN ) ) );
+    bitset::set( i2c_->CR1, STOP );
+    if ( ( i2c_->SR1 & error_condition ) && ( i2c_->SR2 & ( BUSY | MSL ) ) )
+        i2c_reset()( *i2c_, own_addr_ );
+
+    account( t, I2C_TRANSFER_TIMEOUT );
+    result_code_ = I2C_TRANSFER_TIMEOUT;
+    t.result = I2C_TRANSFER_TIMEOUT;
+
+    lock_.clear( std::memory_order_release );
+    dispatch();
+    return true;
+}
+
+bool
+i2c::read_register( uint8_t address, uint8_t reg, uint8_t * data, size_t size, uint8_t priority )
+{
+    const i2c_segment segments[] = { { false, &reg, 1 }, { true, data, uint16_t( size ) } };
+    i2c_transaction t = { address, segments, 2, {}, nullptr, nullptr, priority };
+    return transact( t ) == I2C_RESULT_SUCCESS;
+}
+
+void
+i2c::account( const i2c_transaction& t, I2C_RESULT_CODE code )
+{
+    auto it = std::find_if( stats_.begin(), stats_.end() - 1, [&]( const auto& d ){
+            return d.address == t.address || d.transactions == 0; } );
+    const uint32_t k = cycle_counter::cycles_per_us();
+    const uint32_t latency = ( started_ - t.submitted ) / k;
+
+    it->address = t.address;
+    it->transactions++;
+    if ( code != I2C_RESULT_SUCCESS )
+        it->errors++;
+    if ( t.deadline_us && latency > t.deadline_us )
+        it->missed++;
+    it->busy_us += ( cycle_counter::now() - started_ ) / k;
+    it->latency_us += latency;
+    if ( latency > it->max_latency_us )
+        it->max_latency_us = latency;
+}
+
+void
+i2c::clear_stats()
+{
+    for ( auto& d: stats_ )
+        d = i2c_device_stats{ 0 };
+    stats_since_ = atomic_jiffies.load();
+}
+
+// isr context
+void
+i2c::complete( I2C_RESULT_CODE code )
+{
+    auto t = transaction_.exchange( nullptr );
+    if ( t == nullptr )
+        return;
+
+    bitset::reset( i2c_->CR2, ITBUFFN | ( listening_ ? 0 : ( ITEVTEN | ITERREN ) ) );
+    bitset::reset( i2c_->CR1, POS );
+    bitset::set( i2c_->CR1, ACK );
+
+    account( *t, code );
+    result_code_ = code;
+    t->result = code;
+    if ( t->callback )
+        t->callback( *t );
+
+    // still holding the bus
+    if ( auto next = next_transaction() ) {
+        start( next );
+    } else {
+        lock_.clear( std::memory_order_release );
+        dispatch(); // submitted while releasing
+    }
+}
+
+// STOP after the last segment, repeated START otherwise
+void
+i2c::end_condition()
+{
+    auto t = transaction_.load();
+    bitset::set( i2c_->CR1, ( segment_ + 1 < t->count ) ? START : STOP );
+}
+
+void
+i2c::next_segment()
+{
+    auto t = transaction_.load();
+    const auto& seg = t->segments[ ++segment_ ];
+    data_ = seg.data;
+    remaining_ = seg.size;
+    address_phase_ = true;
+    bitset::reset( i2c_->CR1, POS );
+    bitset::set( i2c_->CR1, ACK );
+    bitset::set( i2c_->CR2, ITBUFFN );
+}
+
+// RM0008 26.3.3 Master receiver, AN2824 interrupt driven sequences
 void
 i2c::handle_event_interrupt()
 {
+    auto t = transaction_.load();
+    if ( t == nullptr ) {
+        if ( listening_ && slave_.data )
+            handle_slave_event();
+        return;
+    }
+
+    const uint32_t sr1 = i2c_->SR1;
+    const bool read = t->segments[ segment_ ].read;
+    const bool last = segment_ + 1 >= t->count;
+
+    if ( sr1 & SB ) {
+        i2c_->DR = ( t->address << 1 ) | ( read ? 1 : 0 );
+        return;
+    }
+
+    if ( sr1 & ADDR ) {
+        address_phase_ = false;
+        if ( ! read ) {
+            (void)i2c_->SR2;                             // clear ADDR
+            if ( remaining_ == 0 ) {                     // address-only
+                end_condition();
+                if ( last )
+                    complete( I2C_RESULT_SUCCESS );
+                else
+                    next_segment();
+            }
+            return;
+        }
+        if ( remaining_ == 1 ) {
+            bitset::reset( i2c_->CR1, ACK );
+            (void)i2c_->SR2;
+            end_condition();                             // wait RxNE
+        } else if ( remaining_ == 2 ) {
+            bitset::reset( i2c_->CR1, ACK );
+            bitset::set( i2c_->CR1, POS );               // NACK goes to the 2nd byte
+            (void)i2c_->SR2;
+            bitset::reset( i2c_->CR2, ITBUFFN );         // wait BTF
+        } else {
+            (void)i2c_->SR2;
+            if ( remaining_ == 3 )
+                bitset::reset( i2c_->CR2, ITBUFFN );     // wait BTF
+        }
+        return;
+    }
+
+    if ( read ) {
+        bool done = false;
+        if ( remaining_ > 3 ) {
+            if ( sr1 & ( RxNE | BTF ) ) {
+                *data_++ = i2c_->DR;
+                if ( --remaining_ == 3 )
+                    bitset::reset( i2c_->CR2, ITBUFFN );
+            }
+        } else if ( remaining_ == 3 ) {
+            if ( sr1 & BTF ) {                           // N-2 in DR, N-1 in shift register
+                bitset::reset( i2c_->CR1, ACK );
+                *data_++ = i2c_->DR;
+                --remaining_;
+            }
+        } else if ( remaining_ == 2 ) {
+            if ( sr1 & BTF ) {                           // N-1 in DR, N in shift register
+                end_condition();
+                *data_++ = i2c_->DR;
+                *data_++ = i2c_->DR;
+                remaining_ = 0;
+                done = true;
+            }
+        } else if ( remaining_ == 1 ) {
+            if ( sr1 & RxNE ) {
+                *data_++ = i2c_->DR;
+                remaining_ = 0;
+                done = true;
+            }
+        }
+        if ( done ) {
+            if ( last )
+                complete( I2C_RESULT_SUCCESS );
+            else
+                next_segment();                          // Sr has been requested, SB follows
+        }
+        return;
+    }
+
+    // transmitter
+    if ( remaining_ ) {
+        if ( sr1 & TxE ) {
+            i2c_->DR = *data_++;
+            if ( --remaining_ == 0 ) {
+                const i2c_segment * next = last ? nullptr : &t->segments[ segment_ + 1 ];
+                if ( next && ! next->read && next->size ) {
+                    ++segment_;                          // write follows write, no restart
+                    data_ = next->data;
+                    remaining_ = next->size;
+                } else {
+                    bitset::reset( i2c_->CR2, ITBUFFN ); // wait BTF for the last byte
+                }
+            }
+        }
+    } else if ( sr1 & BTF ) {
+        end_condition();
+        if ( last )
+            complete( I2C_RESULT_SUCCESS );
+        else
+            next_segment();
+    }
 }
 
 void
 i2c::handle_error_interrupt()
 {
     // stream() << "ERROR irq: " << status32_to_string( i2c_status( *i2c_ )() ) << std::endl;
-    constexpr uint32_t error_condition = SMB_ALART | TIME_OUT | PEC_ERR | OVR | AF | ARLO | BERR;
+    const uint32_t sr1 = i2c_->SR1;
     i2c_->SR1 &= ~error_condition;
+
+    if ( transaction_.load() == nullptr ) {
+        if ( ( sr1 & AF ) && slave_state_ == slave_transmit )
+            slave_finish();  // master NACKed the last byte it wanted
+        return;
+    }
+
+    if ( sr1 & ARLO ) {
+        complete( I2C_TRANSFER_ARBITRATION_LOST ); // already released the bus, no STOP
+    } else if ( sr1 & AF ) {
+        bitset::set( i2c_->CR1, STOP );
+        complete( address_phase_ ? I2C_TRANSFER_ADDRESS_NACK : I2C_TRANSFER_DATA_NACK );
+    } else if ( sr1 & BERR ) {
+        bitset::set( i2c_->CR1, STOP );
+        complete( I2C_TRANSFER_BUS_ERROR );
+    } else if ( sr1 & error_condition ) {
+        bitset::set( i2c_->CR1, STOP );
+        complete( I2C_DEVICE_ERROR_CONDITION );
+    }
+}
+
+namespace {
+    template< typename F >
+    bool with_slave_dma( volatile I2C * i2c, bool transmit, F f ) {
+        const uint32_t addr = reinterpret_cast< uint32_t >( const_cast< I2C * >( i2c ) );
+        if ( addr == I2C1_BASE ) {
+            if ( transmit && __dma_i2c1_tx ) { f( *__dma_i2c1_tx ); return true; }
+            if ( !transmit && __dma_i2c1_rx ) { f( *__dma_i2c1_rx ); return true; }
+        } else if ( addr == I2C2_BASE ) {
+            if ( transmit && __dma_i2c2_tx ) { f( *__dma_i2c2_tx ); return true; }
+            if ( !transmit && __dma_i2c2_rx ) { f( *__dma_i2c2_rx ); return true; }
+        }
+        return false;
+    }
+}
+
+// isr context; ADDR matched (transmit), or the register pointer has been received
+void
+i2c::slave_start( bool transmit )
+{
+    slave_state_ = transmit ? slave_transmit : slave_receive;
+    slave_offset_ = slave_pointer_;
+    slave_bytes_ = 0;
+    slave_count_ = 0;
+
+    if ( transmit && !( i2c_->SR1 & TxE ) ) {
+        // DR still holds the byte preloaded for a read the master cut short; replace it, no dma request comes
+        i2c_->DR = slave_.data[ slave_offset_ ];
+        slave_bytes_ = 1;
+    }
+
+    const uint16_t start = ( slave_offset_ + slave_bytes_ ) % slave_.size;
+    const uint16_t count = slave_.size - start;  // up to the end, then byte by byte with wrap around
+
+    if ( with_slave_dma( i2c_, transmit, [&]( auto& dma ){
+                if ( transmit )
+                    dma.set_transfer_buffer( slave_.data + start, count );
+                else
+                    dma.set_receive_buffer( slave_.data + start, count );
+                dma.enable( true, 0 );
+            }) ) {
+        slave_count_ = count;
+        bitset::reset( i2c_->CR2, ITBUFFN );
+        bitset::set( i2c_->CR2, DMAEN );
+    } else {
+        bitset::set( i2c_->CR2, ITBUFFN );
+    }
+}
+
+// isr context; STOP, Sr or NACK ends the phase
+void
+i2c::slave_finish()
+{
+    if ( slave_state_ == slave_receive || slave_state_ == slave_transmit ) {
+        const bool transmit = slave_state_ == slave_transmit;
+        uint16_t n = slave_bytes_;
+        if ( slave_count_ ) {
+            with_slave_dma( i2c_, transmit, [&]( auto& dma ){
+                    uint16_t moved = slave_count_ - dma.remaining();
+                    if ( transmit && moved && !( i2c_->SR1 & TxE ) )
+                        --moved;  // loaded into DR, never shifted out
+                    n += moved;
+                    dma.enable( false );
+                });
+            bitset::reset( i2c_->CR2, DMAEN );
+        }
+        slave_pointer_ = ( slave_offset_ + n ) % slave_.size;
+        if ( !transmit && n && slave_.on_write )
+            slave_.on_write( slave_offset_, n );
+    }
+    slave_state_ = slave_idle;
+    slave_count_ = 0;
+    bitset::reset( i2c_->CR2, ITBUFFN );
+}
+
+// RM0008 26.3.2 Slave mode, EV1..EV4
+void
+i2c::handle_slave_event()
+{
+    const uint32_t sr1 = i2c_->SR1;
+
+    if ( sr1 & ADDR ) {
+        const uint32_t sr2 = i2c_->SR2;         // SR1 then SR2 clears ADDR
+        slave_finish();                         // Sr after the register pointer/data
+        if ( sr2 & TRA ) {
+            slave_start( true );
+        } else {
+            slave_state_ = slave_pointer;
+            bitset::set( i2c_->CR2, ITBUFFN );
+        }
+        return;
+    }
+
+    if ( sr1 & STOPF ) {
+        bitset::set( i2c_->CR1, PE );           // SR1 then CR1 write clears STOPF
+        slave_finish();
+        return;
+    }
+
+    switch ( slave_state_ ) {
+    case slave_pointer:
+        if ( sr1 & RxNE ) {
+            slave_pointer_ = uint8_t( i2c_->DR ) % slave_.size;
+            slave_start( false );
+        }
+        break;
+    case slave_receive:
+        // byte path, or the master keeps writing past the end of the dma block
+        if ( sr1 & ( RxNE | BTF ) ) {
+            const uint16_t at = ( slave_offset_ + slave_count_ + slave_bytes_ ) % slave_.size;
+            slave_.data[ at ] = i2c_->DR;
+            ++slave_bytes_;
+        }
+        break;
+    case slave_transmit:
+        if ( sr1 & ( TxE | BTF ) ) {
+            const uint16_t at = ( slave_offset_ + slave_count_ + slave_bytes_ ) % slave_.size;
+            i2c_->DR = slave_.data[ at ];
+            ++slave_bytes_;
+        }
+        break;
+    default:
+        if ( sr1 & RxNE )
+            (void)i2c_->DR;
+        break;
+    }
 }
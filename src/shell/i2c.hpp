@@ -48,6 +48,122 @@ namespace stm32f103 {
         , I2C_POLLING_MASTER_TRANSMITTER_ADDRESS_FAILED
         , I2C_POLLING_MASTER_TRANSMITTER_SEND_TIMEOUT
         , I2C_DEVICE_ERROR_CONDITION
+        , I2C_TRANSFER_PENDING
+        , I2C_TRANSFER_ADDRESS_NACK
+        , I2C_TRANSFER_DATA_NACK
+        , I2C_TRANSFER_ARBITRATION_LOST
+        , I2C_TRANSFER_BUS_ERROR
+        , I2C_TRANSFER_TIMEOUT
+    };
+
+    // a piece of a transaction; consecutive writes are sent back to back,
+    // a change of direction is joined by a repeated START
+    struct i2c_segment {
+        bool read;
+        uint8_t * data;
+        uint16_t size;
+    };
+
+    // START addr segment [Sr addr segment]... STOP, executed from the event/error interrupts.
+    // Owned by the caller until result leaves I2C_TRANSFER_PENDING; a single write of size 0 is
+    // an address-only probe.
+    // The bus picks the next transaction when the current one completes: anything past its
+    // deadline first (earliest deadline first), otherwise the highest priority, where a waiting
+    // transaction gains one level per i2c_aging_us so that no device starves; ties go in order.
+    struct i2c_transaction {
+        uint8_t address;
+        const i2c_segment * segments;
+        uint8_t count;
+        std::atomic< I2C_RESULT_CODE > result;
+        void (*callback)( i2c_transaction& );   // isr context, may submit the next transaction
+        i2c_transaction * next;                 // queue link
+        uint8_t priority;                       // 0 lowest
+        uint32_t deadline_us;                   // from submit, 0 := none
+        uint32_t submitted;                     // cycle_counter at submit
+        class i2c * bus;                        // set by submit
+    };
+
+    constexpr uint32_t i2c_aging_us = 1000;
+
+    // per device (address) bus usage; occupancy is START to STOP, latency is submit to START
+    struct i2c_device_stats {
+        uint8_t address;
+        uint32_t transactions;
+        uint32_t errors;
+        uint32_t missed;                        // started after the deadline
+        uint32_t busy_us;
+        uint32_t latency_us;                    // sum
+        uint32_t max_latency_us;
+    };
+
+    // I2C is on APB1, 36MHz (RM0008 p93); defaults below are solved against it at compile time
+    constexpr uint32_t i2c_pclk1 = 36000000;
+
+    enum I2C_DUTY { I2C_DUTY_2 /* Tlow/Thigh = 2 */, I2C_DUTY_16_9 /* Tlow/Thigh = 16/9 */ };
+
+    // CCR/TRISE for a requested SCL rate, RM0008 26.6.8 and 26.6.9.
+    // SCL is never faster than requested; valid is false when the rate, the peripheral clock
+    // or the resulting Thigh/Tlow fall outside the Sm/Fm limits. The F1 peripheral has no Fm+.
+    struct i2c_timing {
+        uint32_t pclk;
+        uint16_t ccr;      // F/S | DUTY | CCR[11:0]
+        uint16_t trise;
+        bool valid;
+
+        static constexpr uint16_t FS   = 1 << 15;
+        static constexpr uint16_t DUTY = 1 << 14;
+
+        constexpr bool fast() const { return ccr & FS; }
+        constexpr uint32_t counts() const { // pclk cycles per SCL period
+            return uint32_t( ccr & 0xfff ) * ( !fast() ? 2 : ( ccr & DUTY ) ? 25 : 3 );
+        }
+        constexpr uint32_t hz() const { return valid ? pclk / counts() : 0; }
+    };
+
+    constexpr i2c_timing
+    i2c_timing_solver( uint32_t hz, I2C_DUTY duty = I2C_DUTY_2, uint32_t pclk = i2c_pclk1 )
+    {
+        const uint32_t freq = pclk / 1000000;                         // CR2 FREQ, MHz
+        const bool fast = hz > 100000;
+        i2c_timing t{ pclk, 0, 0, false };
+
+        if ( hz == 0 || hz > 400000 || freq > 36 || freq < ( fast ? 4 : 2 ) )
+            return t;
+
+        const uint32_t k = !fast ? 2 : ( duty == I2C_DUTY_16_9 ) ? 25 : 3;
+        uint32_t ccr = ( pclk + k * hz - 1 ) / ( k * hz );            // round up, SCL <= hz
+        if ( ccr < ( fast ? 1 : 4 ) )
+            ccr = fast ? 1 : 4;
+        if ( ccr > 0xfff )
+            return t;
+
+        const uint32_t high = !fast ? ccr : ( duty == I2C_DUTY_16_9 ) ? 9 * ccr : ccr;
+        const uint32_t low  = !fast ? ccr : ( duty == I2C_DUTY_16_9 ) ? 16 * ccr : 2 * ccr;
+        if ( high * 1000 / freq < ( fast ? 600 : 4000 ) || low * 1000 / freq < ( fast ? 1300 : 4700 ) )
+            return t;                                                 // tHIGH/tLOW min, ns
+
+        t.ccr = uint16_t( ccr | ( fast ? i2c_timing::FS : 0 ) | ( fast && duty == I2C_DUTY_16_9 ? i2c_timing::DUTY : 0 ) );
+        t.trise = uint16_t( ( fast ? freq * 300 / 1000 : freq ) + 1 ); // max rise time 300ns Fm, 1000ns Sm
+        t.valid = true;
+        return t;
+    }
+
+    constexpr i2c_timing i2c_standard_mode = i2c_timing_solver( 100000 );
+    constexpr i2c_timing i2c_fast_mode = i2c_timing_solver( 400000 );
+    constexpr i2c_timing i2c_fast_mode_16_9 = i2c_timing_solver( 400000, I2C_DUTY_16_9 );
+
+    static_assert( i2c_standard_mode.valid && i2c_standard_mode.ccr == 180 && i2c_standard_mode.trise == 37, "" );
+    static_assert( i2c_fast_mode.valid && i2c_fast_mode.hz() == 400000 && i2c_fast_mode.trise == 11, "" );
+    static_assert( i2c_fast_mode_16_9.valid && i2c_fast_mode_16_9.hz() == 360000, "" ); // 36MHz is not a multiple of 10MHz
+    static_assert( !i2c_timing_solver( 1000000 ).valid, "" );
+
+    // memory mapped registers seen by an external master (slave mode, RM0008 26.3.2).
+    // The master writes the register pointer first; following bytes are written from it and a read,
+    // after Sr or in a new transaction, returns bytes from it. The pointer increments and wraps at size.
+    struct i2c_register_file {
+        uint8_t * data;
+        uint16_t size;                                    // 1..256
+        void (*on_write)( uint8_t offset, uint16_t size ); // isr context, after STOP or Sr
     };
 
     // I^2C 26.5, p773 RM0008
@@ -61,6 +177,49 @@ namespace stm32f103 {
         std::atomic_flag lock_;
         uint8_t own_addr_;
         I2C_RESULT_CODE result_code_;
+        bool listening_;
+        i2c_timing timing_;
+
+        // interrupt driven master; lock_ is the bus, whoever holds it dispatches the queue
+        std::atomic< i2c_transaction * > transaction_;  // on the bus
+        std::atomic< i2c_transaction * > pending_;      // submitted, lifo
+        i2c_transaction * queue_;                       // fifo, touched by the lock_ owner only
+        uint8_t segment_;
+        uint8_t * data_;
+        uint16_t remaining_;
+        bool address_phase_;
+        uint32_t started_;                              // cycle_counter at START
+
+        std::array< i2c_device_stats, 8 > stats_;       // the last one takes the rest
+        uint32_t stats_since_;                          // atomic_jiffies
+        void account( const i2c_transaction&, I2C_RESULT_CODE );
+
+        i2c_transaction * next_transaction();
+        void dispatch();                                // call without lock_
+        void start( i2c_transaction * );                // call with lock_
+        void end_condition();
+        void next_segment();
+        void complete( I2C_RESULT_CODE );
+        bool abort_hung( uint32_t limit_us );
+
+        // polling and dma paths; takes the bus in between queued transactions, thread context only
+        struct scoped_lock {
+            i2c& _;
+            scoped_lock( i2c& t ) : _( t ) { while ( _.lock_.test_and_set( std::memory_order_acquire ) ) ; }
+            ~scoped_lock() { _.lock_.clear( std::memory_order_release ); _.dispatch(); }
+        };
+
+        // slave engine, when listening with a register file
+        enum slave_state { slave_idle, slave_pointer, slave_receive, slave_transmit };
+        i2c_register_file slave_;
+        slave_state slave_state_;
+        uint8_t slave_pointer_;
+        uint8_t slave_offset_;                          // pointer at the start of the phase
+        uint16_t slave_count_;                          // programmed into dma, 0 := byte by byte
+        uint16_t slave_bytes_;                          // moved by the cpu
+        void slave_start( bool transmit );
+        void slave_finish();
+        void handle_slave_event();
 
         i2c( const i2c& ) = delete;
         i2c& operator = ( const i2c& ) = delete;
@@ -77,7 +236,15 @@ namespace stm32f103 {
 
         void reset();
 
+        // per-bus SCL rate, solved against the running PCLK1; false (and unchanged) if out of spec
+        bool set_speed( uint32_t hz, I2C_DUTY = I2C_DUTY_2 );
+        inline const i2c_timing& timing() const { return timing_; }
+
         bool listen( uint8_t own_addr );
+        // slave with a register file; bulk data goes through the attached dma channels, byte by byte otherwise.
+        // The bus should not be used as a master meanwhile.
+        bool listen( uint8_t own_addr, const i2c_register_file& );
+        inline uint8_t register_pointer() const { return slave_pointer_; }
         
         inline operator bool () const { return i2c_; };
 
@@ -86,6 +253,25 @@ namespace stm32f103 {
         // bool read( uint8_t address, uint8_t& data );
         bool read( uint8_t address, uint8_t * data, size_t );
 
+        // queues the transaction and returns; it starts as soon as the bus is free
+        bool submit( i2c_transaction& );
+        // blocks (wfe) until completed; the transaction on the bus is aborted only once it has held the bus
+        // for timeout_us since its START, so a queued one is never returned while still linked. Not from isr context.
+        I2C_RESULT_CODE wait( i2c_transaction&, uint32_t timeout_us = 20000 );
+        I2C_RESULT_CODE transact( i2c_transaction& );
+        bool abort( i2c_transaction& );                 // only the one on the bus
+
+        // transactions on any buses, each bus runs its own concurrently
+        // wait_all: like wait() for each; true when all succeeded. Not from isr context.
+        static bool wait_all( i2c_transaction * const * list, size_t size, uint32_t timeout_us = 20000 );
+        // wait_any: index of a completed one, -1 on timeout; nothing is aborted, the rest stay queued
+        static int wait_any( i2c_transaction * const * list, size_t size, uint32_t timeout_us = 20000 );
+        bool read_register( uint8_t address, uint8_t reg, uint8_t * data, size_t size, uint8_t priority = 0 ); // write reg, Sr, read
+
+        inline const std::array< i2c_device_stats, 8 >& device_stats() const { return stats_; }
+        inline uint32_t stats_since() const { return stats_since_; }
+        void clear_stats();
+
         bool dma_transfer( uint8_t address, const uint8_t *, size_t );
         bool dma_receive( uint8_t address, uint8_t * data, size_t );
         uint32_t status() const;
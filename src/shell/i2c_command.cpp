@@ -5,6 +5,7 @@
 //
 
 #include "i2c.hpp"
+#include "condition_wait.hpp"
 #include "dma.hpp"
 #include "i2c_string.hpp"
 #include "gpio_mode.hpp"
@@ -12,8 +13,10 @@
 #include "stm32f103.hpp"
 #include "utility.hpp"
 #include <algorithm>
+#include <atomic>
 
 void i2c_command( size_t argc, const char ** argv );
+extern std::atomic< uint32_t > atomic_jiffies;
 
 static void
 i2c_probe( int id )
@@ -49,15 +52,99 @@ i2c_probe( int id )
     }
 }
 
+namespace {
+
+    // address-only write to each address, NACK (AF) ends a probe at once; one probe in flight per bus
+    struct i2c_scan {
+        stm32f103::i2c * bus;
+        uint8_t address;
+        stm32f103::i2c_segment segment;
+        stm32f103::i2c_transaction t;
+        std::array< uint16_t, 0x78 > latency;  // submit to ACK in us + 1, 0 := no device
+
+        bool probe( uint8_t addr ) {
+            address = addr;
+            t.address = addr;
+            t.segments = &segment;
+            t.count = 1;
+            return bus->submit( t );
+        }
+    };
+
+    constexpr uint8_t i2c_scan_first = 0x08, i2c_scan_last = 0x77;
+    constexpr uint32_t i2c_scan_timeout_us = 2000;
+
+    void
+    i2c_scan_print( const i2c_scan& scan, int id )
+    {
+        stream() << "i2c" << ( id + 1 ) << ":\t 0  1  2  3  4  5  6  7  8  9  a  b  c  d  e  f";
+        for ( uint8_t addr = 0; addr <= i2c_scan_last; ++addr ) {
+            if ( ( addr % 16 ) == 0 )
+                stream() << std::endl << addr << ":\t";
+            if ( addr < i2c_scan_first )
+                stream() << "   ";
+            else if ( scan.latency[ addr ] )
+                stream() << addr << " ";
+            else
+                stream() << "-- ";
+        }
+        stream() << std::endl;
+        for ( uint8_t addr = i2c_scan_first; addr <= i2c_scan_last; ++addr ) {
+            if ( scan.latency[ addr ] )
+                stream() << "\t" << addr << "\tACK in " << int( scan.latency[ addr ] - 1 ) << " us" << std::endl;
+        }
+    }
+}
+
 void
 i2cdetect( size_t argc, const char ** argv )
 {
-    int id = 0;
-    if ( argc > 2 ) {
-        if ( *argv[1] == '1' )
-            id = 1;
+    using namespace stm32f103;
+
+    static i2c_scan scans[ 2 ];  // placed once, the transactions are not copyable
+    scans[ 0 ].bus = i2c_t< I2C1_BASE >::instance();
+    scans[ 1 ].bus = i2c_t< I2C2_BASE >::instance();
+
+    int first = 0, last = 1;
+    if ( argc > 1 && ( *argv[1] == '0' || *argv[1] == '1' ) )
+        first = last = *argv[1] - '0';
+
+    i2c_transaction * list[ 2 ];
+    i2c_scan * owner[ 2 ];
+    size_t active = 0;
+
+    for ( int id = first; id <= last; ++id ) {
+        auto& scan = scans[ id ];
+        scan.segment = { false, nullptr, 0 };
+        scan.latency.fill( 0 );
+        if ( scan.probe( i2c_scan_first ) ) {
+            list[ active ] = &scan.t;
+            owner[ active++ ] = &scan;
+        }
     }
-    i2c_probe( id );
+
+    const uint32_t t0 = cycle_counter::now();
+    while ( active ) {
+        int index = i2c::wait_any( list, active, i2c_scan_timeout_us );
+        if ( index < 0 ) {
+            i2c::wait_all( list, active, i2c_scan_timeout_us ); // stuck bus; aborts the one holding it that long
+            continue;
+        }
+        auto& scan = *owner[ index ];
+        if ( scan.t.result == I2C_RESULT_SUCCESS ) {
+            uint32_t us = ( cycle_counter::now() - scan.t.submitted ) / cycle_counter::cycles_per_us();
+            scan.latency[ scan.address ] = uint16_t( std::min( us, uint32_t( 0xfffe ) ) + 1 );
+        }
+        if ( scan.address >= i2c_scan_last || ! scan.probe( scan.address + 1 ) ) {
+            list[ index ] = list[ active - 1 ];
+            owner[ index ] = owner[ --active ];
+        }
+    }
+    const uint32_t us = ( cycle_counter::now() - t0 ) / cycle_counter::cycles_per_us();
+
+    for ( int id = first; id <= last; ++id )
+        i2c_scan_print( scans[ id ], id );
+    stream() << "scanned " << i2c_scan_first << ".." << i2c_scan_last << " in " << int( us ) << " us" << std::endl;
 }
 
 void
@@ -122,7 +209,10 @@ i2c_command( size_t argc, const char ** argv )
             "i2c --read <numbuer>   // read number-byte adrray data i2c device\n"
             "i2c probe\n"
             "i2c reset\n"
+            "i2c speed [Hz] [16:9]   // SCL rate, up to 400000 (fast mode, duty 2:1 unless 16:9)\n"
+            "i2c stats [clear]   // per device bus occupancy and queueing latency\n"
             "i2c status\n"
+            "i2c --slave [addr]   // I2C2 serves a 64 byte register file (default 0x20)\n"
                  << std::endl;
         i2c_string::print_registers( stream(), i2cx.base_addr() );
     }
@@ -133,10 +223,52 @@ i2c_command( size_t argc, const char ** argv )
             i2cx.print_status( stream() );
         } else if ( strcmp( argv[0], "reset" ) == 0 ) {
             i2cx.reset();
+        } else if ( strcmp( argv[0], "speed" ) == 0 ) {
+            if ( argc > 1 && std::isdigit( *argv[1] ) ) {
+                uint32_t hz = strtod( argv[ 1 ] );
+                --argc; ++argv;
+                auto duty = stm32f103::I2C_DUTY_2;
+                if ( argc > 1 && strcmp( argv[1], "16:9" ) == 0 ) {
+                    duty = stm32f103::I2C_DUTY_16_9;
+                    --argc; ++argv;
+                }
+                if ( !i2cx.set_speed( hz, duty ) )
+                    stream() << "i2c speed " << int( hz ) << " Hz is out of the Sm/Fm range for PCLK1" << std::endl;
+            }
+            auto& t = i2cx.timing();
+            stream() << "i2c speed: " << int( t.hz() ) << " Hz, " << ( t.fast() ? ( ( t.ccr & t.DUTY ) ? "Fm 16:9" : "Fm 2:1" ) : "Sm" )
+                     << ", CCR=" << int( t.ccr & 0xfff ) << ", TRISE=" << int( t.trise ) << std::endl;
+        } else if ( strcmp( argv[0], "stats" ) == 0 ) {
+            const uint32_t elapsed = atomic_jiffies.load() - i2cx.stats_since(); // 100us
+            stream() << "addr\tcount\terrors\tmissed\tbusy(%)\tlatency avg/max(us)" << std::endl;
+            for ( const auto& d: i2cx.device_stats() ) {
+                if ( d.transactions == 0 )
+                    continue;
+                // busy_us / (elapsed * 100us) in percent
+                stream() << d.address << "\t" << int( d.transactions ) << "\t" << int( d.errors ) << "\t" << int( d.missed )
+                         << "\t" << int( elapsed ? d.busy_us / elapsed : 0 )
+                         << "\t" << int( d.latency_us / d.transactions ) << "/" << int( d.max_latency_us ) << std::endl;
+            }
+            if ( argc > 1 && strcmp( argv[1], "clear" ) == 0 ) {
+                i2cx.clear_stats();
+                --argc; ++argv;
+            }
         } else if ( strcmp( argv[0], "probe" ) == 0 ) {
             i2c_probe( id );
         } else if ( strcmp( argv[0], "--slave" ) == 0 ) {
-            stm32f103::i2c_t< stm32f103::I2C2_BASE >::instance()->listen( 0x20 ); // make it 'slave'
+            // I2C2 as a register file slave; a host reads it with e.g. i2cdump -y <bus> 0x20
+            static std::array< uint8_t, 64 > __slave_registers = { 's', 't', 'm', '3', '2', 'f', '1', '0', '3' };
+            auto& slave = *stm32f103::i2c_t< stm32f103::I2C2_BASE >::instance();
+            if ( !slave.has_dma( i2c::DMA_Both ) )
+                slave.attach( *dma_t< DMA1_BASE >::instance(), i2c::DMA_Both );
+            uint8_t own = 0x20;
+            if ( argc > 1 && std::isdigit( *argv[1] ) ) {
+                own = strtox( argv[1] );
+                --argc; ++argv;
+            }
+            slave.listen( own, { __slave_registers.data(), __slave_registers.size(), +[]( uint8_t offset, uint16_t size ){
+                        stream() << "i2c2 slave: " << int( size ) << " bytes written at " << offset << std::endl;
+                    } } );
         } else if ( std::isdigit( *argv[0] ) ) {
             txd = strtox( argv[0] );
         } else if ( strcmp( argv[0], "dma" ) == 0 ) {
@@ -220,3 +352,87 @@ i2c_command( size_t argc, const char ** argv )
     }
 }
 
+
+namespace {
+
+    // rounds of one register read per bus; serial waits for each bus in turn, parallel for both at once.
+    // bytes counts the register pointer too, 32bit arithmetic is fine below ~4M bytes
+    struct i2c_bench {
+        std::array< stm32f103::i2c *, 2 > bus;
+        std::array< uint8_t, 2 > address;
+        std::array< std::array< uint8_t, 32 >, 2 > data;
+        uint8_t reg;
+        uint16_t size;
+
+        struct result { uint32_t bytes, errors, us; };
+
+        result operator()( uint32_t rounds, bool parallel ) {
+            using namespace stm32f103;
+            const i2c_segment segments[ 2 ][ 2 ] = {
+                { { false, &reg, 1 }, { true, data[ 0 ].data(), size } }
+                , { { false, &reg, 1 }, { true, data[ 1 ].data(), size } }
+            };
+            i2c_transaction t[ 2 ] = { { address[ 0 ], segments[ 0 ], 2 }, { address[ 1 ], segments[ 1 ], 2 } };
+            i2c_transaction * list[ 2 ] = { &t[ 0 ], &t[ 1 ] };
+
+            result r{ 0, 0, 0 };
+            const uint32_t t0 = cycle_counter::now();
+            for ( uint32_t i = 0; i < rounds; ++i ) {
+                if ( parallel ) {
+                    bus[ 0 ]->submit( t[ 0 ] );
+                    bus[ 1 ]->submit( t[ 1 ] );
+                    i2c::wait_all( list, 2 );
+                } else {
+                    bus[ 0 ]->transact( t[ 0 ] );
+                    bus[ 1 ]->transact( t[ 1 ] );
+                }
+                for ( auto& x: t ) {
+                    if ( x.result == I2C_RESULT_SUCCESS )
+                        r.bytes += size + 1;
+                    else
+                        ++r.errors;
+                }
+            }
+            r.us = ( cycle_counter::now() - t0 ) / cycle_counter::cycles_per_us();
+            return r;
+        }
+    };
+
+    void
+    i2c_bench_print( const char * label, const i2c_bench::result& r )
+    {
+        stream() << label << "\t" << int( r.bytes ) << " bytes\t" << int( r.errors ) << " errors\t"
+                 << int( r.us ) << " us\t" << int( r.us ? r.bytes * 1000 / r.us : 0 ) << " kB/s" << std::endl;
+    }
+}
+
+void
+bench_command( size_t argc, const char ** argv )
+{
+    using namespace stm32f103;
+
+    if ( argc < 2 || strcmp( argv[ 1 ], "i2c" ) != 0 ) {
+        stream() << "bench i2c [rounds] [bytes] [addr1] [addr2] [reg]" << std::endl;
+        return;
+    }
+    argc -= 2; argv += 2;
+
+    uint32_t rounds = 100;
+    i2c_bench bench{ { i2c_t< I2C1_BASE >::instance(), i2c_t< I2C2_BASE >::instance() }, { 0x76, 0x76 }, {}, 0xd0 /* BMP280 id */, 6 };
+
+    if ( argc && std::isdigit( *argv[0] ) ) { rounds = strtod( argv[0] ); --argc; ++argv; }
+    if ( argc && std::isdigit( *argv[0] ) ) { bench.size = std::min( size_t( strtod( argv[0] ) ), bench.data[ 0 ].size() ); --argc; ++argv; }
+    if ( argc && std::isdigit( *argv[0] ) ) { bench.address[ 0 ] = strtox( argv[0] ); --argc; ++argv; }
+    if ( argc && std::isdigit( *argv[0] ) ) { bench.address[ 1 ] = strtox( argv[0] ); --argc; ++argv; }
+    if ( argc && std::isdigit( *argv[0] ) ) { bench.reg = strtox( argv[0] ); --argc; ++argv; }
+
+    if ( bench.size == 0 )
+        bench.size = 1;
+
+    stream() << "i2c bench: " << int( rounds ) << " rounds, " << int( bench.size ) << " bytes from "
+             << bench.address[ 0 ] << " (i2c1), " << bench.address[ 1 ] << " (i2c2) at "
+             << int( bench.bus[ 0 ]->timing().hz() ) << "/" << int( bench.bus[ 1 ]->timing().hz() ) << " Hz" << std::endl;
+
+    i2c_bench_print( "serial", bench( rounds, false ) );
+    i2c_bench_print( "parallel", bench( rounds, true ) );
+}
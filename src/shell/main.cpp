@@ -176,6 +176,7 @@ main()
         RCC->APB2ENR |= 0x0010;     // IOPC EN := GPIO C enable
 
         RCC->APB2ENR |= (01 << 9);    // ADC1
+        RCC->APB2ENR |= (01 << 10);   // ADC2 (dual mode slave)
 
         RCC->APB2ENR |= (01 << 12);   // SPI1 enable;
 
@@ -24,6 +24,9 @@ extern std::atomic< uint32_t > atomic_jiffies;          //  100us  (4.97 days)
 extern std::atomic< uint32_t > atomic_seconds;
 
 namespace stm32f103 {
+
+    constexpr uint32_t rtc_sync_timeout_us = 1000; // RTOFF follows a write within 3 RTCCLK, ~100us on LSE/LSI
+
     struct RTC {
         uint32_t CRH;   // 0x00
         uint32_t CRL;   // 0x04
@@ -91,7 +94,7 @@ namespace stm32f103 {
             auto RCC = reinterpret_cast< volatile stm32f103::RCC * >( stm32f103::RCC_BASE );
             stm32f103::bitset::reset( RCC->BDCR, stm32f103::RCC_BDCR_LSEON );
             stm32f103::bitset::set( RCC->CSR, stm32f103::RCC_CSR_LSION );
-            condition_wait(0x7ffff)( [&](){ return RCC->CSR & stm32f103::RCC_CSR_LSIRDY; } );
+            DEADLINE_WAIT( 1000 )( [&](){ return RCC->CSR & stm32f103::RCC_CSR_LSIRDY; } );     // tSU(LSI) 85us max
             return true;
         }
     };
@@ -102,7 +105,7 @@ namespace stm32f103 {
             auto RCC = reinterpret_cast< volatile stm32f103::RCC * >( stm32f103::RCC_BASE );
             stm32f103::bitset::reset( RCC->CSR, stm32f103::RCC_CSR_LSION );
             stm32f103::bitset::set( RCC->BDCR, stm32f103::RCC_BDCR_LSEON );
-            condition_wait(0x7ffff)( [&](){ return RCC->BDCR & stm32f103::RCC_BDCR_LSERDY; } );
+            DEADLINE_WAIT( 100000 )( [&](){ return RCC->BDCR & stm32f103::RCC_BDCR_LSERDY; } );
             return true;
         }
     };
@@ -149,7 +152,7 @@ rtc::enable()
         if ( auto RTC = reinterpret_cast< volatile stm32f103::RTC * >( stm32f103::RTC_BASE ) ) {
             using namespace stm32f103;
 
-            condition_wait(0x3ffff)( [&](){ return RTC->CRL & RTC_CRL_RTOFF; } );  // wait RTOFF = 1
+            DEADLINE_WAIT( rtc_sync_timeout_us )( [&](){ return RTC->CRL & RTC_CRL_RTOFF; } );  // wait RTOFF = 1
             stm32f103::bitset::set( RTC->CRL, RTC_CRL_CNF );      // set configuration mode
 
             RTC->PRLH  = ( (rtc_clock< clock_source >::clk - 1) >> 16) & 0x00ff;  // set prescaler load register high
@@ -166,7 +169,7 @@ rtc::enable()
 
             stm32f103::bitset::reset( RTC->CRL, RTC_CRL_CNF );    // exit configuration mode
 
-            condition_wait(0x3fff)( [&](){ return RTC->CRL & RTC_CRL_RTOFF; } );
+            DEADLINE_WAIT( rtc_sync_timeout_us )( [&](){ return RTC->CRL & RTC_CRL_RTOFF; } );
 
             // DBP on PWR->CR
             // p77, Note: If the HSE divided by 128 is used as the RTC clock, this bit must remain set to 1.
@@ -197,14 +200,14 @@ rtc::set_hwclock( const time_t& time )
         stream(__FILE__,__LINE__,__FUNCTION__) << "\t(" << hwclock << ")\n";
 
         bitset::set( RTC->CRL, RTC_CRL_CNF );      // set configuration mode
-        condition_wait()( [&](){ return RTC->CRL & RTC_CRL_RTOFF; } );
+        DEADLINE_WAIT( rtc_sync_timeout_us )( [&](){ return RTC->CRL & RTC_CRL_RTOFF; } );
 
         RTC->CNTH  = hwclock >> 16 & 0xffff;
         RTC->CNTL  = hwclock & 0xffff;
 
         bitset::reset( RTC->CRL, RTC_CRL_CNF );    // exit configuration mode
 
-        condition_wait()( [&](){ return RTC->CRL & RTC_CRL_RTOFF; } );
+        DEADLINE_WAIT( rtc_sync_timeout_us )( [&](){ return RTC->CRL & RTC_CRL_RTOFF; } );
     }
 
     if ( clock_source != rtc_clock_source_hse ) {
@@ -0,0 +1,275 @@
+// Copyright (C) 2018 MS-Cheminformatics LLC
+// Licence: CC BY-NC
+// Author: Toshinobu Hondo, Ph.D.
+// Contact: toshi.hondo@qtplatz.com
+//
+// SLCAN (Lawicel CAN232/CANUSB ASCII protocol) gateway on the console uart
+// stm32f> slcan [baud]      // leave with ^C (0x03), which never appears in the protocol
+// host$ slcand -o -c -f -s6 -S 115200 /dev/ttyUSB0 can0
+
+#include "can.hpp"
+#include "stm32f103.hpp"
+#include "stream.hpp"
+#include "uart.hpp"
+#include "utility.hpp"
+#include <array>
+#include <atomic>
+
+extern std::atomic< uint32_t > atomic_jiffies;
+extern void can_filter_restore();
+
+namespace {
+
+    constexpr char hex[] = "0123456789ABCDEF";
+
+    // Sn, 10k .. 1M
+    constexpr uint32_t slcan_bitrates[] = { 10000, 20000, 50000, 100000, 125000, 250000, 500000, 800000, 1000000 };
+
+    constexpr char ok = '\r';
+    constexpr char error = '\a';
+
+    inline int
+    nibble( char c )
+    {
+        return ( c >= '0' && c <= '9' ) ? c - '0' : ( c >= 'A' && c <= 'F' ) ? c - 'A' + 10 : ( c >= 'a' && c <= 'f' ) ? c - 'a' + 10 : -1;
+    }
+
+    // n hex digits, false on a non-hex character
+    inline bool
+    parse_hex( const char * p, size_t n, uint32_t& value )
+    {
+        value = 0;
+        for ( size_t i = 0; i < n; ++i ) {
+            int d = nibble( p[ i ] );
+            if ( d < 0 )
+                return false;
+            value = ( value << 4 ) | d;
+        }
+        return true;
+    }
+
+    inline char *
+    put_hex( char * p, uint32_t value, size_t n )
+    {
+        while ( n-- )
+            *p++ = hex[ ( value >> ( 4 * n ) ) & 0x0f ];
+        return p;
+    }
+
+    class slcan {
+        stm32f103::can& can_;
+        stm32f103::uart& uart_;
+        std::array< char, 32 > line_;     // longest command is T + 8 id + 1 dlc + 16 data
+        size_t size_;
+        bool open_;
+        bool timestamp_;
+
+    public:
+        uint32_t rx_frames, tx_frames, dropped, errors;
+
+        slcan( stm32f103::can& can, stm32f103::uart& uart ) : can_( can ), uart_( uart ), size_( 0 )
+                                                            , open_( false ), timestamp_( false )
+                                                            , rx_frames( 0 ), tx_frames( 0 ), dropped( 0 ), errors( 0 ) {}
+
+        // host -> can; false on ^C
+        bool input() {
+            std::array< uint8_t, 64 > buf;
+            while ( size_t n = uart_.read( buf.data(), buf.size() ) ) {
+                for ( size_t i = 0; i < n; ++i ) {
+                    const char c = char( buf[ i ] );
+                    if ( c == 0x03 )
+                        return false;
+                    if ( c == '\r' ) {
+                        reply( command( line_.data(), size_ ) );
+                        size_ = 0;
+                    } else if ( c != '\n' ) {
+                        if ( size_ < line_.size() )
+                            line_[ size_++ ] = c;
+                        else
+                            size_ = line_.size() + 1;  // too long, answered with BEL at '\r'
+                    }
+                }
+            }
+            return true;
+        }
+
+        // can -> host, as many frames as the uart ring takes
+        void output() {
+            std::array< CanMsg, 8 > msgs;
+            std::array< char, 8 * 32 > out;
+            while ( size_t n = can_.rx_drain( msgs ) ) {
+                char * p = out.data();
+                for ( size_t i = 0; i < n; ++i ) {
+                    if ( open_ )
+                        p = format( p, msgs[ i ] );
+                }
+                const size_t size = p - out.data();
+                if ( size == 0 )
+                    continue;
+                if ( uart_.tx_free() < size ) {
+                    dropped += n;  // never split a batch of frames
+                    continue;
+                }
+                uart_.write( reinterpret_cast< const uint8_t * >( out.data() ), size );
+                rx_frames += n;
+            }
+        }
+
+    private:
+        void reply( const char * s ) {
+            size_t n = 0;
+            while ( s[ n ] )
+                ++n;
+            uart_.write( reinterpret_cast< const uint8_t * >( s ), n );
+        }
+
+        char * format( char * p, const CanMsg& m ) {
+            const bool ext = m.IDE == CAN_ID_EXT;
+            *p++ = m.RTR ? ( ext ? 'R' : 'r' ) : ( ext ? 'T' : 't' );
+            p = put_hex( p, m.ID, ext ? 8 : 3 );
+            *p++ = hex[ m.DLC & 0x0f ];
+            if ( !m.RTR ) {
+                for ( size_t i = 0; i < m.DLC && i < 8; ++i )
+                    p = put_hex( p, m.Data[ i ], 2 );
+            }
+            if ( timestamp_ ) {
+                uint32_t usec;
+                const uint32_t sec = can_timestamp_split( m.timestamp, usec );
+                p = put_hex( p, ( sec % 60 ) * 1000 + usec / 1000, 4 );      // ms, wraps at 60s
+            }
+            *p++ = '\r';
+            return p;
+        }
+
+        const char * command( const char * s, size_t size ) {
+            static const char __ok[] = { ok, 0 }, __error[] = { error, 0 };
+            if ( size == 0 )
+                return __ok;
+            if ( size > line_.size() ) {
+                ++errors;
+                return __error;
+            }
+
+            switch ( s[ 0 ] ) {
+            case 'S':
+                if ( size == 2 && s[ 1 ] >= '0' && s[ 1 ] <= '8' && !open_ )
+                    return can_.set_bitrate( slcan_bitrates[ s[ 1 ] - '0' ] ) == CAN_OK ? __ok : __error;
+                break;
+            case 'O':
+            case 'L':
+                if ( !open_ && can_.set_silent_mode( s[ 0 ] == 'L' ) == CAN_OK ) {
+                    can_.rx_queue_clear();
+                    open_ = true;
+                    return __ok;
+                }
+                break;
+            case 'C':
+                open_ = false;
+                return __ok;
+            case 't': case 'T': case 'r': case 'R':
+                if ( open_ && !can_.silent_mode() && transmit( s, size ) ) {
+                    ++tx_frames;
+                    return ( s[ 0 ] == 't' || s[ 0 ] == 'r' ) ? "z\r" : "Z\r";
+                }
+                break;
+            case 'F': {
+                static char flags[] = "F00\r";
+                const uint32_t lost = can_.rx_lost( CAN_FIFO_0 ) + can_.rx_lost( CAN_FIFO_1 );
+                put_hex( flags + 1, ( lost ? 0x08 : 0 ) | ( dropped ? 0x02 : 0 ), 2 );   // data overrun, rx queue full
+                return flags;
+            }
+            case 'Z':
+                if ( size == 2 && ( s[ 1 ] == '0' || s[ 1 ] == '1' ) ) {
+                    timestamp_ = s[ 1 ] == '1';
+                    return __ok;
+                }
+                break;
+            case 'V':
+                return "V1013\r";
+            case 'v':
+                return "vSTM32\r";
+            case 'N':
+                return "NF103\r";
+            case 'M': case 'm':      // SJA1000 acceptance code/mask; use 'can filter' instead
+            case 'X': case 'W': case 'Q':
+                return __ok;
+            default:                 // 's' (raw BTR0/1) is SJA1000 specific
+                break;
+            }
+            ++errors;
+            return __error;
+        }
+
+        bool transmit( const char * s, size_t size ) {
+            CanMsg msg;
+            const bool ext = s[ 0 ] == 'T' || s[ 0 ] == 'R';
+            const size_t idlen = ext ? 8 : 3;
+            uint32_t id, dlc;
+            if ( size < 2 + idlen || !parse_hex( s + 1, idlen, id ) || !parse_hex( s + 1 + idlen, 1, dlc ) || dlc > 8 )
+                return false;
+
+            msg.ID = id & ( ext ? 0x1fffffff : 0x7ff );
+            msg.IDE = ext ? CAN_ID_EXT : CAN_ID_STD;
+            msg.RTR = ( s[ 0 ] == 'r' || s[ 0 ] == 'R' ) ? CAN_RTR_REMOTE : CAN_RTR_DATA;
+            msg.DLC = uint8_t( dlc );
+
+            if ( msg.RTR == CAN_RTR_DATA ) {
+                const char * p = s + 2 + idlen;
+                if ( size != 2 + idlen + 2 * dlc )
+                    return false;
+                for ( size_t i = 0; i < dlc; ++i ) {
+                    uint32_t b;
+                    if ( !parse_hex( p + 2 * i, 2, b ) )
+                        return false;
+                    msg.Data[ i ] = uint8_t( b );
+                }
+            }
+            return can_.enqueue( msg );
+        }
+    };
+}
+
+void
+slcan_command( size_t argc, const char ** argv )
+{
+    using namespace stm32f103;
+
+    auto& uart = *uart_t< USART1_BASE >::instance();
+    auto& cbus = *can_t< CAN1_BASE >::instance();
+    const uint32_t console_baud = uart.baud();
+    const uint32_t baud = argc > 1 ? strtod( argv[ 1 ] ) : console_baud;
+
+    stream() << "slcan: " << int( baud ) << " baud, ^C to leave" << std::endl;
+
+    // the candump callback would print into the stream from the rx isr
+    auto callback = can_t< CAN1_BASE >::callback_;
+    can_t< CAN1_BASE >::clear_callback();
+
+    uart.set_raw( true );
+    if ( baud != console_baud && !uart.set_baud( baud ) ) {
+        uart.set_raw( false );
+        can_t< CAN1_BASE >::set_callback( callback );
+        stream() << "slcan: invalid baud rate" << std::endl;
+        return;
+    }
+
+    can_filter_restore();   // banks are inactive after reset when slcan is the first can command
+
+    slcan gateway( cbus, uart );
+    const uint32_t start = atomic_jiffies.load();
+    while ( gateway.input() ) {
+        gateway.output();
+        __asm__ volatile ( "wfi" );  // the next uart, can or systick irq
+    }
+    const uint32_t elapsed = atomic_jiffies.load() - start;  // 100us
+
+    uart.set_baud( console_baud );
+    uart.set_raw( false );
+    can_t< CAN1_BASE >::set_callback( callback );
+
+    const uint32_t seconds = elapsed / 10000 ? elapsed / 10000 : 1;
+    stream() << "\nslcan: " << int( gateway.rx_frames ) << " rx, " << int( gateway.tx_frames ) << " tx, "
+             << int( gateway.dropped ) << " dropped, " << int( gateway.errors ) << " errors, uart overrun "
+             << int( uart.rx_overrun() ) << " in " << int( elapsed / 10 ) << " ms, "
+             << int( ( gateway.rx_frames + gateway.tx_frames ) / seconds ) << " frames/s" << std::endl;
+}
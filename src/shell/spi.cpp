@@ -7,8 +7,11 @@
 #include "stm32f103.hpp"
 #include "stream.hpp"
 #include "spinlock.hpp"
+#include "condition_wait.hpp"
 #include <atomic>
 
+extern std::atomic< uint32_t > atomic_jiffies;
+
 extern "C" {
     void spi1_handler();
     void enable_interrupt( stm32f103::IRQn_type IRQn );
@@ -37,19 +40,36 @@ namespace stm32f103 {
     };
 
     enum SPI_CR2 {
-        SSOE         = 04 //(01 << 2) // SS output enable
+        TXEIE        = (01 << 7)  // Tx buffer empty interrupt enable
+        , RXNEIE     = (01 << 6)  // Rx buffer not empty interrupt enable
+        , ERRIE      = (01 << 5)  // Error interrupt enable
+        , SSOE       = 04 //(01 << 2) // SS output enable
+        , TXDMAEN    = (01 << 1)  // Tx buffer DMA enable
+        , RXDMAEN    = (01 << 0)  // Rx buffer DMA enable
+    };
+
+    enum SPI_SR {
+        SR_BSY       = (01 << 7)
+        , SR_OVR     = (01 << 6)
+        , SR_TXE     = (01 << 1)
+        , SR_RXNE    = (01 << 0)
     };
 
-    constexpr uint32_t fclk = 04;
-    constexpr uint32_t cr1 = ((fclk & 7) << 3)          // clock
+    // DMA1 requests (RM0008 Table 78), 0 origin
+    constexpr uint32_t spi1_rx_dma = 1, spi2_rx_dma = 3;
+
+    // source/sink for half duplex use of the full duplex transfer
+    static uint16_t __spi_dummy_tx = 0xffff;
+    static uint16_t __spi_dummy_rx;
+
+    // power-on format: fPCLK/32, 16bit, mode 3, msb first
+    constexpr uint32_t cr1 = spi1_default.cr1
                                             //| BIDIMODE  // 1: 1-line bidirectional, 0: 2-line unidirectional data
                                             //| BIDIOE
-                                            | DFF       // 16bit
-                                            | CPOL      // polarity
-                                            | CPHA      // phase
                                             | SSI
                                             | MSTR      // master mode
                                             ;
+    static_assert( cr1 == ( ( 04 << 3 ) | DFF | CPOL | CPHA | SSI | MSTR ), "" );
 }
 
 using namespace stm32f103;
@@ -58,6 +78,17 @@ void
 spi::init( stm32f103::SPI_BASE base, uint8_t gpio, uint32_t ss_n )
 {
     lock_.clear();
+    busy_.clear();
+    done_ = true;
+    error_ = false;
+    callback_ = nullptr;
+    dma_ = nullptr;
+    dma_channel_ = ( base == SPI1_BASE ) ? spi1_rx_dma : spi2_rx_dma;
+    stream_buffer_ = nullptr;
+    stream_size_ = 0;
+    stream_callback_ = nullptr;
+    stream_cr1_ = 0;
+    stream_saved_cr1_ = 0;
     rxd_ = 0;
 
     gpio_ = gpio;
@@ -165,6 +196,7 @@ spi&
 spi::operator >> ( uint16_t& d )
 {
     (*this) = false;       // ~SS -> L
+    spi_->CR1 |= SPE;      // a dma transfer with hardware NSS leaves it cleared
 
     // cr1_ &= ~BIDIOE; // read only
     // spi_->CR1 = cr1_;
@@ -194,6 +226,7 @@ spi::operator << ( uint16_t d )
         stream() << "spi tx timeout" << std::endl;
     }
     txd_ = d;
+    spi_->CR1 |= SPE;
     // spi_->CR1 |= SPE | BIDIOE; // SPI enable, output only mode
     // cr1_ = spi_->CR1;
     spi_->CR2 |= (1 << 7);     // Tx empty irq
@@ -205,13 +238,21 @@ void
 spi::handle_interrupt()
 {
     if ( spi_ ) {
+        if ( stream_buffer_ ) {
+            // slave stream, entered through ERRIE only; RXNE belongs to dma and ~SS to the master
+            if ( spi_->SR & SR_OVR ) {
+                // dma fell behind the master; DR then SR read clears OVR, the frame in DR is lost anyway
+                (void)spi_->DATA;
+                (void)spi_->SR;
+                ++stream_ovr_;
+            }
+            return;
+        }
+
         if ( spi_->SR & 01 ) { // RX not empty
             rxd_ = spi_->DATA | 0x80000000;
             (*this) = true;        // ~SS = 'H'
             // spi_->CR1 |= BIDIOE;   // switch to write-only mode
-            scoped_spinlock<> lock( lock_ );
-            if ( spi_ == reinterpret_cast< volatile stm32f103::SPI * >( SPI2_BASE ) )
-                stream() << "SPI2 got : " << ( rxd_.load() & 0xffff ) << std::endl;
         }
 
         if ( spi_->SR & 02 ) { // Tx empty
@@ -256,3 +297,329 @@ spi::interrupt_handler( spi * _this )
 {
     _this->handle_interrupt();
 }
+
+template< SPI_BASE base >
+void
+spi::dma_handler( uint32_t flags )
+{
+    spi_t< base >::instance()->handle_dma( flags );
+}
+
+// tx completes before rx, which reports the transfer; only a tx error is of interest
+template< SPI_BASE base >
+void
+spi::dma_tx_handler( uint32_t flags )
+{
+    if ( flags & TEIF )
+        spi_t< base >::instance()->handle_dma( TEIF );
+}
+
+bool
+spi::attach( dma& dma )
+{
+    const bool spi1 = spi_ == reinterpret_cast< volatile SPI * >( SPI1_BASE );
+    auto rx = spi1 ? &dma_handler< SPI1_BASE > : &dma_handler< SPI2_BASE >;
+    auto tx = spi1 ? &dma_tx_handler< SPI1_BASE > : &dma_tx_handler< SPI2_BASE >;
+
+    // e.g. the I2C2 slave engine on channel 4/5
+    auto rx_owner = dma.callback( dma_channel_ ), tx_owner = dma.callback( dma_channel_ + 1 );
+    if ( ( rx_owner && rx_owner != rx ) || ( tx_owner && tx_owner != tx ) )
+        return false;
+
+    dma_ = &dma;
+    dma.set_callback( dma_channel_, rx );
+    dma.set_callback( dma_channel_ + 1, tx );
+    return true;
+}
+
+void
+spi::detach()
+{
+    if ( dma_ == nullptr || stream_buffer_ )
+        return;
+    dma_->clear_callback( dma_channel_ );
+    dma_->clear_callback( dma_channel_ + 1 );
+    dma_ = nullptr;
+}
+
+// format bits may only change while disabled (RM0008 25.3.3); caller holds lock_ or the bus
+void
+spi::write_cr1( uint32_t mask, uint32_t bits )
+{
+    if ( ( spi_->CR1 & mask ) == bits )
+        return;
+    DEADLINE_WAIT( 1000 )( [&]{ return !( spi_->SR & SR_BSY ); } );
+    const uint32_t spe = spi_->CR1 & SPE;
+    spi_->CR1 &= ~SPE;
+    spi_->CR1 = ( spi_->CR1 & ~mask ) | bits;
+    spi_->CR1 |= spe;
+    cr1_ = spi_->CR1;
+}
+
+void
+spi::set_mode( SPI_MODE mode )
+{
+    scoped_spinlock<> lock( lock_ );
+    write_cr1( CPOL | CPHA, mode & 03 );
+}
+
+void
+spi::set_baud_prescaler( uint8_t br )
+{
+    scoped_spinlock<> lock( lock_ );
+    write_cr1( BR, ( br & 07 ) << 3 );
+}
+
+uint32_t
+spi::pclk() const
+{
+    return ( spi_ == reinterpret_cast< volatile SPI * >( SPI1_BASE ) ) ? spi_pclk2 : spi_pclk1;
+}
+
+spi_config
+spi::config() const
+{
+    return spi_config{ pclk(), uint16_t( spi_->CR1 & spi_config::MASK ), true };
+}
+
+bool
+spi::configure( const spi_config& c )
+{
+    if ( !c.valid || c.pclk != pclk() )
+        return false;
+    if ( busy_.test_and_set( std::memory_order_acquire ) )
+        return false;
+    write_cr1( spi_config::MASK, c.cr1 );
+    busy_.clear( std::memory_order_release );
+    return true;
+}
+
+SPI_MODE
+spi::mode() const
+{
+    return SPI_MODE( spi_->CR1 & ( CPOL | CPHA ) );
+}
+
+uint8_t
+spi::baud_prescaler() const
+{
+    return ( spi_->CR1 & BR ) >> 3;
+}
+
+void
+spi::select( bool assert )
+{
+    if ( spi_->CR1 & SSM ) {
+        switch( gpio_ ) {
+        case 'A':
+            stm32f103::gpio< GPIOA_PIN >( static_cast< GPIOA_PIN >( ss_n_ ) ) = !assert;
+            break;
+        case 'B':
+            stm32f103::gpio< GPIOB_PIN >( static_cast< GPIOB_PIN >( ss_n_ ) ) = !assert;
+            break;
+        }
+    } else if ( !assert ) {
+        spi_->CR1 &= ~SPE;                 // hardware NSS follows SPE (SSOE=1), RM0008 25.3.1
+    }
+}
+
+bool
+spi::transfer( const uint8_t * tx, uint8_t * rx, size_t n, void (*callback)( spi& ) )
+{
+    return start_transfer( tx, rx, n, false, nullptr, callback );
+}
+
+bool
+spi::transfer( const uint16_t * tx, uint16_t * rx, size_t n, void (*callback)( spi& ) )
+{
+    return start_transfer( tx, rx, n, true, nullptr, callback );
+}
+
+bool
+spi::transfer( const spi_config& c, const uint8_t * tx, uint8_t * rx, size_t n, void (*callback)( spi& ) )
+{
+    return start_transfer( tx, rx, n, false, &c, callback );
+}
+
+bool
+spi::transfer( const spi_config& c, const uint16_t * tx, uint16_t * rx, size_t n, void (*callback)( spi& ) )
+{
+    return start_transfer( tx, rx, n, true, &c, callback );
+}
+
+bool
+spi::start_transfer( const void * tx, void * rx, size_t n, bool frame16, const spi_config * c, void (*callback)( spi& ) )
+{
+    if ( dma_ == nullptr || spi_ == nullptr || n == 0 || n > 0xffff )
+        return false;
+
+    if ( c && ( !c->valid || c->pclk != pclk() || c->frame16() != frame16 ) )
+        return false;
+
+    if ( busy_.test_and_set( std::memory_order_acquire ) )
+        return false;
+
+    done_ = false;
+    error_ = false;
+    callback_ = callback;
+
+    // frame format is changed while disabled; SPE is set again below, so switching devices costs nothing extra
+    DEADLINE_WAIT( 1000 )( [&]{ return !( spi_->SR & SR_BSY ); } );
+    spi_->CR1 &= ~SPE;
+    if ( c )
+        spi_->CR1 = ( spi_->CR1 & ~spi_config::MASK ) | c->cr1;
+    else
+        spi_->CR1 = frame16 ? ( spi_->CR1 | DFF ) : ( spi_->CR1 & ~DFF );
+    cr1_ = spi_->CR1;
+
+    // legacy rx irq would steal frames from the dma
+    cr2_ = spi_->CR2;
+    spi_->CR2 = cr2_ & ~( RXNEIE | TXEIE );
+    while ( spi_->SR & SR_RXNE )
+        (void)spi_->DATA;
+
+    const uint32_t size = frame16 ? ( ( 1 << 10 ) | ( 1 << 8 ) ) : 0;  // MSIZE, PSIZE
+    const uint32_t data = reinterpret_cast< uint32_t >( &spi_->DATA );
+
+    dma_->init_channel( DMA_CHANNEL( dma_channel_ ), data
+                        , reinterpret_cast< uint8_t * >( rx ? rx : &__spi_dummy_rx ), n
+                        , PL_VeryHigh | DMA_ReadFromPeripheral | ( rx ? MINC : 0 ) | size );
+    dma_->init_channel( DMA_CHANNEL( dma_channel_ + 1 ), data
+                        , reinterpret_cast< uint8_t * >( const_cast< void * >( tx ? tx : &__spi_dummy_tx ) ), n
+                        , PL_High | DMA_ReadFromMemory | ( tx ? MINC : 0 ) | size );
+
+    dma_->enable( dma_channel_, true, TCIE | TEIE );
+    dma_->enable( dma_channel_ + 1, true, TEIE );
+
+    select( true );
+    spi_->CR1 |= SPE;
+    spi_->CR2 |= RXDMAEN | TXDMAEN;      // RM0008 25.3.9, tx request starts the clock
+    return true;
+}
+
+// dma isr; rx complete means the last frame has been clocked in
+void
+spi::handle_dma( uint32_t flags )
+{
+    if ( stream_buffer_ ) {
+        handle_stream_dma( flags );
+        return;
+    }
+
+    if ( done_ )
+        return;
+
+    if ( flags & TEIF )
+        error_ = true;
+    else if ( !( flags & TCIF ) )
+        return;
+
+    dma_->enable( dma_channel_ + 1, false );
+    dma_->enable( dma_channel_, false );
+
+    DEADLINE_WAIT( 100 )( [&]{ return !( spi_->SR & SR_BSY ); } );
+    spi_->CR2 = cr2_;
+    if ( spi_->SR & SR_OVR ) {
+        (void)spi_->DATA;                // DR then SR read clears OVR
+        (void)spi_->SR;
+        error_ = true;
+    }
+    select( false );
+
+    done_ = true;
+    busy_.clear( std::memory_order_release );
+    if ( callback_ )
+        callback_( *this );
+}
+
+bool
+spi::wait( uint32_t timeout_us )
+{
+    return DEADLINE_WAIT( timeout_us, true )( [&]{ return done_.load(); } );
+}
+
+bool
+spi::stream_start( uint16_t * buffer, size_t size, void (*callback)( const spi_block& ) )
+{
+    if ( dma_ == nullptr || spi_ == nullptr || buffer == nullptr || size < 2 || ( size & 01 ) || size > 0xffff )
+        return false;
+
+    if ( busy_.test_and_set( std::memory_order_acquire ) )
+        return false;  // a block transfer is running
+
+    stream_buffer_ = buffer;
+    stream_size_ = size;
+    stream_callback_ = callback;
+    stream_queue_.clear();
+    stream_ovr_ = 0;
+
+    stream_cr1_ = spi_->CR1;
+    stream_saved_cr1_ = cr1_;
+    spi_->CR1 &= ~SPE;
+    spi_->CR1 &= ~( MSTR | SSM | SSI );   // slave, NSS from the pin
+    cr2_ = spi_->CR2;
+    spi_->CR2 = ERRIE;                    // OVR to the spi irq, data to dma only
+    while ( spi_->SR & SR_RXNE )
+        (void)spi_->DATA;
+    (void)spi_->SR;
+    cr1_ = spi_->CR1;
+
+    const uint32_t size16 = ( 1 << 10 ) | ( 1 << 8 );  // MSIZE, PSIZE
+    dma_->init_channel( DMA_CHANNEL( dma_channel_ ), reinterpret_cast< uint32_t >( &spi_->DATA )
+                        , reinterpret_cast< uint8_t * >( buffer ), size
+                        , PL_VeryHigh | DMA_ReadFromPeripheral | MINC | CIRC | size16 );
+    dma_->enable( dma_channel_, true, HTIE | TCIE | TEIE );
+
+    spi_->CR2 |= RXDMAEN;
+    spi_->CR1 |= SPE;
+    return true;
+}
+
+void
+spi::stream_stop()
+{
+    if ( stream_buffer_ == nullptr )
+        return;
+    spi_->CR2 &= ~RXDMAEN;
+    dma_->enable( dma_channel_, false, HTIE | TCIE | TEIE );
+    spi_->CR1 &= ~SPE;
+    spi_->CR2 = cr2_;
+    (void)spi_->DATA;                     // DR then SR read clears a pending OVR
+    (void)spi_->SR;
+    spi_->CR1 = stream_cr1_ & ~SPE;       // MSTR|SSM|SSI before SPE
+    spi_->CR1 = stream_cr1_;
+    cr1_ = stream_saved_cr1_;
+    stream_buffer_ = nullptr;
+    stream_callback_ = nullptr;
+    busy_.clear( std::memory_order_release );
+}
+
+// dma (HT|TC) interrupt context
+void
+spi::handle_stream_dma( uint32_t flags )
+{
+    const uint32_t timestamp = atomic_jiffies.load();
+    const uint16_t half = stream_size_ / 2;
+
+    for ( auto mask: { HTIF, TCIF } ) { // a delayed irq may carry both, first half goes first
+        if ( ( flags & mask ) == 0 )
+            continue;
+
+        const auto& block = stream_queue_.push( { stream_buffer_ + ( mask == HTIF ? 0 : half ), half
+                                                  , stream_queue_.head(), timestamp } );
+        if ( stream_callback_ )
+            stream_callback_( block );
+    }
+}
+
+bool
+spi::stream_read( spi_block& block )
+{
+    return stream_queue_.read( block );
+}
+
+bool
+spi::stream_release( const spi_block& block )
+{
+    return stream_queue_.release( block );
+}
@@ -1,7 +1,9 @@
 // Copyright (C) 2018 MS-Cheminformatics LLC
 
+#include <array>
 #include <atomic>
 #include <cstdint>
+#include "dma_block_queue.hpp"
 
 namespace stm32f103 {
 
@@ -12,6 +14,66 @@ namespace stm32f103 {
 
     class dma;
 
+    // CPOL/CPHA, RM0008 25.3.1
+    enum SPI_MODE : uint8_t { SPI_MODE0, SPI_MODE1, SPI_MODE2, SPI_MODE3 };
+
+    constexpr uint32_t spi_pclk1 = 36000000;  // SPI2 (APB1)
+    constexpr uint32_t spi_pclk2 = 72000000;  // SPI1 (APB2)
+    constexpr uint32_t spi_max_hz = 18000000; // datasheet fSCK max, master
+
+    // CR1 format bits of one device on a shared bus (RM0008 25.5.1); everything else in CR1 belongs to the port.
+    // SCK is never faster than requested, valid is false below pclk/256 or above spi_max_hz.
+    struct spi_config {
+        uint32_t pclk;
+        uint16_t cr1;      // DFF | LSBFIRST | BR[2:0] | CPOL | CPHA
+        bool valid;
+
+        static constexpr uint16_t DFF      = 1 << 11;
+        static constexpr uint16_t LSBFIRST = 1 << 7;
+        static constexpr uint16_t BR       = 07 << 3;
+        static constexpr uint16_t MASK     = DFF | LSBFIRST | BR | 03;
+
+        constexpr uint8_t br() const { return ( cr1 & BR ) >> 3; }
+        constexpr uint32_t hz() const { return valid ? pclk >> ( br() + 1 ) : 0; }
+        constexpr SPI_MODE mode() const { return SPI_MODE( cr1 & 03 ); }
+        constexpr bool frame16() const { return cr1 & DFF; }
+        constexpr bool lsb_first() const { return cr1 & LSBFIRST; }
+    };
+
+    constexpr spi_config
+    spi_config_solver( uint32_t hz, SPI_MODE mode = SPI_MODE3, bool frame16 = true, bool lsb_first = false
+                       , uint32_t pclk = spi_pclk2 )
+    {
+        spi_config c{ pclk, 0, false };
+        if ( hz == 0 || hz > spi_max_hz || hz < ( pclk >> 8 ) )
+            return c;
+
+        uint32_t br = 0;
+        while ( ( pclk >> ( br + 1 ) ) > hz ) // fPCLK / 2^(br+1)
+            ++br;
+
+        c.cr1 = uint16_t( ( frame16 ? spi_config::DFF : 0 ) | ( lsb_first ? spi_config::LSBFIRST : 0 ) | ( br << 3 ) | ( mode & 03 ) );
+        c.valid = true;
+        return c;
+    }
+
+    constexpr spi_config spi1_18MHz = spi_config_solver( 18000000 );
+    constexpr spi_config spi1_default = spi_config_solver( 2250000 );            // /32, the power-on format
+    constexpr spi_config spi2_default = spi_config_solver( 1125000, SPI_MODE3, true, false, spi_pclk1 );
+
+    static_assert( spi1_18MHz.valid && spi1_18MHz.br() == 1 && spi1_18MHz.hz() == 18000000, "" );
+    static_assert( spi1_default.br() == 4 && spi1_default.cr1 == spi2_default.cr1, "" );
+    static_assert( spi_config_solver( 10000000 ).hz() == 9000000, "" );
+    static_assert( !spi_config_solver( 36000000 ).valid && !spi_config_solver( 100000 ).valid, "" );
+
+    // a half of the slave stream's circular dma buffer, handed over by the HT/TC interrupt
+    struct spi_block {
+        const uint16_t * data;   // points into the dma buffer; valid until the next half has been filled
+        uint16_t size;           // frames (8bit frames are in the low byte)
+        uint32_t sequence;       // block sequence number (counts up from stream_start)
+        uint32_t timestamp;      // atomic_jiffies (100us) when the block has been completed
+    };
+
     class spi {
         volatile SPI * spi_;
         std::atomic_flag lock_;
@@ -25,7 +87,32 @@ namespace stm32f103 {
         uint32_t ss_n_;  // PA4|PB
         uint32_t cr1_;
         dma * dma_;
-        uint32_t dma_channel_;
+        uint32_t dma_channel_;  // rx; tx is the next one
+
+        // dma block transfer
+        std::atomic_flag busy_;
+        std::atomic< bool > done_;
+        bool error_;
+        uint32_t cr2_;
+        void (*callback_)( spi& );
+
+        // slave streaming receiver
+        uint16_t * stream_buffer_;
+        uint16_t stream_size_;
+        dma_block_queue< spi_block > stream_queue_;
+        std::atomic< uint32_t > stream_ovr_;        // frames lost in the peripheral (OVR)
+        uint32_t stream_cr1_;                       // master setup, CR1 and cr1_, restored by stream_stop
+        uint32_t stream_saved_cr1_;
+        void (*stream_callback_)( const spi_block& );
+        void handle_stream_dma( uint32_t flags );
+
+        bool start_transfer( const void * tx, void * rx, size_t n, bool frame16, const spi_config *, void (*)( spi& ) );
+        void write_cr1( uint32_t mask, uint32_t bits );
+        void select( bool );    // NSS, low active
+        void handle_dma( uint32_t flags );
+        template< SPI_BASE > static void dma_handler( uint32_t );
+        template< SPI_BASE > static void dma_tx_handler( uint32_t );
+
         void init( SPI_BASE, uint8_t gpio = 0, uint32_t ss_n = 0 );
         template< SPI_BASE > friend struct spi_t;
     public:
@@ -40,6 +127,45 @@ namespace stm32f103 {
         
         void operator = ( bool flag ); // SS control
 
+        // DMA1 channel 2/3 (SPI1) or 4/5 (SPI2, shared with I2C2); false while another peripheral owns them
+        bool attach( dma& );
+        void detach();
+
+        // runtime format; waits until the bus is idle, SPE is cleared while changing
+        void set_mode( SPI_MODE );
+        void set_baud_prescaler( uint8_t br ); // fPCLK / 2^(br+1), 0..7
+        SPI_MODE mode() const;
+        uint8_t baud_prescaler() const;
+
+        // per device format, switched between transactions; a no-op when the bus already runs it.
+        // false if the config is invalid, made for the other APB clock, or a transfer is running
+        bool configure( const spi_config& );
+        spi_config config() const;
+        uint32_t pclk() const;
+
+        // full duplex block transfer of n frames, 8 or 16bit by the buffer type; tx == nullptr sends 0xff..,
+        // rx == nullptr discards. Returns at once, callback (isr context) after the last frame is received.
+        // NSS is asserted for the whole block: the gpio pin with software NSS, SPE otherwise.
+        bool transfer( const uint8_t * tx, uint8_t * rx, size_t n, void (*callback)( spi& ) = nullptr );
+        bool transfer( const uint16_t * tx, uint16_t * rx, size_t n, void (*callback)( spi& ) = nullptr );
+        // same, in the device's format; the frame size of the config must match the buffer type
+        bool transfer( const spi_config&, const uint8_t * tx, uint8_t * rx, size_t n, void (*callback)( spi& ) = nullptr );
+        bool transfer( const spi_config&, const uint16_t * tx, uint16_t * rx, size_t n, void (*callback)( spi& ) = nullptr );
+        bool wait( uint32_t timeout_us = 100000 );
+        inline bool busy() const { return !done_.load(); }
+        inline bool error() const { return error_; }
+
+        // Slave receiver streaming into a circular dma buffer (needs attach()); size must be even,
+        // each half is delivered as a spi_block to the callback (isr context) and to stream_read().
+        // NSS input selects the slave; frames keep the current DFF.
+        bool stream_start( uint16_t * buffer, size_t size, void (*callback)( const spi_block& ) = nullptr );
+        void stream_stop();
+        bool stream_read( spi_block& );          // non-blocking, false if no block is ready
+        bool stream_release( const spi_block& ); // false if dma has overwritten the block while in use
+        inline uint32_t stream_overrun() const { return stream_queue_.overrun(); }
+        inline uint32_t stream_ovr() const { return stream_ovr_.load(); }
+        inline bool is_streaming() const { return stream_buffer_; }
+
         void handle_interrupt();
         static void interrupt_handler( spi * );
     };
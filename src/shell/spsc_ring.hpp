@@ -0,0 +1,88 @@
+// Copyright (C) 2018 MS-Cheminformatics LLC
+// Licence: CC BY-NC
+// Author: Toshinobu Hondo, Ph.D.
+// Contact: toshi.hondo@qtplatz.com
+//
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace stm32f103 {
+
+    // Lock-free ring for one producer (typically an isr) and one consumer (thread context).
+    // head_ is written by the producer only and tail_ by the consumer only; both run freely
+    // and are masked on access, so all N slots are usable. N must be a power of two.
+    template< typename T, size_t N >
+    class spsc_ring {
+        static_assert( N >= 2 && ( N & ( N - 1 ) ) == 0, "spsc_ring depth must be a power of two" );
+
+        T data_[ N ];
+        std::atomic< uint32_t > head_;
+        std::atomic< uint32_t > tail_;
+
+    public:
+        spsc_ring() : head_( 0 ), tail_( 0 ) {}
+
+        static constexpr size_t capacity() { return N; }
+
+        inline size_t size() const {
+            return head_.load( std::memory_order_acquire ) - tail_.load( std::memory_order_acquire );
+        }
+        inline bool empty() const { return size() == 0; }
+
+        // producer: slot to fill in place, nullptr when full; commit() publishes it
+        inline T * prepare() {
+            const uint32_t head = head_.load( std::memory_order_relaxed );
+            if ( head - tail_.load( std::memory_order_acquire ) >= N )
+                return nullptr;
+            return &data_[ head & ( N - 1 ) ];
+        }
+
+        inline void commit() {
+            head_.store( head_.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+        }
+
+        inline bool push( const T& t ) {
+            if ( auto p = prepare() ) {
+                *p = t;
+                commit();
+                return true;
+            }
+            return false;
+        }
+
+        // consumer: oldest entry, valid until pop()
+        inline T * front() {
+            const uint32_t tail = tail_.load( std::memory_order_relaxed );
+            if ( tail == head_.load( std::memory_order_acquire ) )
+                return nullptr;
+            return &data_[ tail & ( N - 1 ) ];
+        }
+
+        inline void pop() {
+            const uint32_t tail = tail_.load( std::memory_order_relaxed );
+            if ( tail != head_.load( std::memory_order_acquire ) )
+                tail_.store( tail + 1, std::memory_order_release );
+        }
+
+        // consumer: copies up to n entries out and frees their slots at once
+        size_t drain( T * out, size_t n ) {
+            const uint32_t tail = tail_.load( std::memory_order_relaxed );
+            const uint32_t avail = head_.load( std::memory_order_acquire ) - tail;
+            const size_t count = n < avail ? n : avail;
+            for ( size_t i = 0; i < count; ++i )
+                out[ i ] = data_[ ( tail + i ) & ( N - 1 ) ];
+            tail_.store( tail + count, std::memory_order_release );
+            return count;
+        }
+
+        // consumer side; entries committed concurrently may survive
+        inline void clear() {
+            tail_.store( head_.load( std::memory_order_acquire ), std::memory_order_release );
+        }
+    };
+
+}
@@ -60,6 +60,18 @@ namespace stm32f103 {
         , "ARR", "CCR1", "CCR2", "CCR3", "CCR4", "DCR", "DMAR"
     };
 
+    enum TIM_CR2_MASK : uint32_t {
+        MMS          = 7 << 4  // Master mode selection
+        , MMS_UPDATE = 2 << 4  // 010: update event is selected as trigger output (TRGO)
+    };
+
+    enum TIM_EGR_MASK : uint32_t {
+        UG = 1                 // Update generation, reloads PSC
+    };
+
+    static_assert( timer_rate_solver( 10000 ).period() == 7200, "timer_rate_solver" );
+    static_assert( timer_rate_solver( 1 ).hz() == 1 && timer_rate_solver( 1 ).millihz() == 0, "timer_rate_solver" );
+
     template< TIM_BASE base > inline void timer_irq_clear() {
         stm32f103::bitset::reset( reinterpret_cast< TIM * >( base )->SR, 0x0001 );
     }
@@ -170,6 +182,31 @@ timer::set_interval( TIM_BASE base, size_t arr )
     p->CR1 |= 1;      // enable
 }
 
+// RM0008 15.3.15 Timer synchronization; CEN is left to the caller so that the slave can be armed first
+void
+timer::set_trigger_output( TIM_BASE base, const timer_rate& rate )
+{
+    auto p = reinterpret_cast< volatile TIM * >( base );
+
+    p->CR1 = 0;
+    p->DIER = 0;      // trigger only, no interrupt
+
+    p->PSC = rate.psc;
+    p->ARR = rate.arr;
+    p->CNT = 0;
+
+    p->CCMR1 = 0;
+    p->CCMR2 = 0;
+    p->CCER = 0;
+    p->SMCR = 0;      // internal clock
+
+    p->CR2 = MMS_UPDATE;
+    p->EGR = UG;      // load PSC now; this TRGO is seen by nobody since the slave is not armed yet
+    p->SR = 0;
+
+    p->CR1 = 4;       // URS, counter disabled
+}
+
 void
 timer::print_registers( TIM_BASE base )
 {
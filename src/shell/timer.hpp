@@ -4,6 +4,8 @@
 // Contact: toshi.hondo@qtplatz.com
 //
 
+#pragma once
+
 #include <array>
 #include <atomic>
 #include <cstdint>
@@ -14,6 +16,55 @@ namespace stm32f103 {
     enum TIM_BASE : uint32_t;
     template< TIM_BASE > struct timer_t;
 
+    // TIM2..TIM7 are on APB1; timer clock is PCLK1 x2 since APB1 prescaler is not 1 (RM0008 p93)
+    constexpr uint32_t timer_clock = 72000000;
+
+    // update rate := clock / ((PSC + 1) * (ARR + 1))
+    struct timer_rate {
+        uint32_t clock;
+        uint16_t psc;
+        uint16_t arr;
+
+        constexpr uint32_t period() const { return ( uint32_t( psc ) + 1 ) * ( uint32_t( arr ) + 1 ); }
+        constexpr uint32_t hz() const { return clock / period(); }
+        constexpr uint32_t millihz() const { // fractional part of the achieved rate, 0..999
+            uint32_t r = clock % period(), f = 0;
+            for ( int i = 0; i < 3; ++i ) {
+                r *= 10;
+                f = f * 10 + r / period();
+                r %= period();
+            }
+            return f;
+        }
+    };
+
+    // Finds PSC/ARR closest to the requested rate; the first exact match wins,
+    // candidates are visited with the smallest prescaler (best ARR resolution) first.
+    constexpr timer_rate
+    timer_rate_solver( uint32_t hz, uint32_t clock = timer_clock )
+    {
+        timer_rate best{ clock, 0xffff, 0xffff };
+        if ( hz == 0 || hz > clock / 2 )
+            return best;
+
+        const uint32_t n = ( clock + hz / 2 ) / hz; // counts per period
+        uint64_t best_error = ~uint64_t( 0 );
+        for ( uint32_t p = ( n + 0xffff ) / 0x10000; p <= 0x10000 && p <= n; ++p ) {
+            const uint32_t a = ( n + p / 2 ) / p;
+            if ( p == 0 || a < 2 || a > 0x10000 )
+                continue;
+            const uint64_t t = uint64_t( p ) * a * hz;
+            const uint64_t error = t > clock ? t - clock : clock - t;
+            if ( error < best_error ) {
+                best = timer_rate{ clock, uint16_t( p - 1 ), uint16_t( a - 1 ) };
+                best_error = error;
+                if ( error == 0 )
+                    break;
+            }
+        }
+        return best;
+    }
+
     class timer {
         timer( const timer& ) = delete;
         timer& operator = ( const timer& ) = delete;
@@ -25,6 +76,7 @@ namespace stm32f103 {
         static void init( TIM_BASE );
         static void enable( TIM_BASE, bool );
         static void set_interval( TIM_BASE, size_t ); // 1Hz default
+        static void set_trigger_output( TIM_BASE, const timer_rate& ); // TRGO on update, no interrupt
         static void print_registers( TIM_BASE );
     };
 
@@ -48,6 +100,8 @@ namespace stm32f103 {
 
         inline void set_interval( size_t arr ) const { timer::set_interval( base, arr ); };
 
+        inline void set_trigger_output( const timer_rate& rate ) const { timer::set_trigger_output( base, rate ); };
+
         void set_callback( void (*cb)() ) { // required ctor
             scoped_spinlock<> guard( guard_ );
             callback_ = cb;
@@ -1,5 +1,6 @@
 // Copyright (C) 2018 MS-Cheminformatics LLC
 
+#include "condition_wait.hpp"
 #include "gpio_mode.hpp"
 #include "stm32f103.hpp"
 #include "uart.hpp"
@@ -54,6 +55,9 @@ using namespace stm32f103;
 
 uart::uart() : usart_( 0 )
              , baud_( 115200 )
+             , pclk_( 72000000 )
+             , raw_( false )
+             , rx_overrun_( 0 )
 {
 }
 
@@ -68,6 +72,7 @@ bool
 uart::config( parity parity, int nbits, uint32_t baud, uint32_t pclk )
 {
     baud_ = baud;
+    pclk_ = pclk;
     if ( usart_ ) {
         uint32_t flag( UE | TE | RE ); // uart enable, transmitter enable, receiver enable
         if ( parity != parity_none )
@@ -172,6 +177,70 @@ uart::gets( char * s, size_t size )
 void
 uart::handle_interrupt()
 {
-    __input_char = usart_->DR & 0xff;
+    const uint32_t sr = usart_->SR;
+
+    if ( sr & ( ST_RXNE | ST_OVER ) ) {
+        const uint8_t c = usart_->DR & 0xff;  // SR then DR read also clears ORE
+        if ( raw_ ) {
+            if ( ( sr & ST_OVER ) || !rx_.push( c ) )
+                ++rx_overrun_;
+        } else {
+            __input_char = c;
+        }
+    }
+
+    if ( ( sr & ST_TXE ) && ( usart_->CR1 & TXEIE ) ) {
+        if ( auto p = tx_.front() ) {
+            usart_->DR = *p;
+            tx_.pop();
+        } else {
+            usart_->CR1 &= ~TXEIE;
+        }
+    }
+}
+
+void
+uart::set_raw( bool raw )
+{
+    if ( !raw )
+        flush();
+    rx_.clear();
+    raw_ = raw;
+}
+
+size_t
+uart::write( const uint8_t * data, size_t size )
+{
+    size_t n = 0;
+    while ( n < size && tx_.push( data[ n ] ) )
+        ++n;
+    if ( n )
+        usart_->CR1 |= TXEIE;
+    return n;
+}
+
+size_t
+uart::read( uint8_t * data, size_t size )
+{
+    return rx_.drain( data, size );
+}
+
+bool
+uart::flush( uint32_t timeout_us )
+{
+    return DEADLINE_WAIT( timeout_us, true )( [&]{ return tx_.empty() && ( usart_->SR & ST_TC ); } );
+}
+
+bool
+uart::set_baud( uint32_t baud )
+{
+    if ( usart_ == nullptr || baud == 0 || pclk_ / baud < 16 )
+        return false;
+    flush();
+    baud_ = baud;
+    usart_->CR1 &= ~UE;
+    usart_->BRR = ( pclk_ + baud / 2 ) / baud;  // USARTDIV in 12.4 fixed point, rounded to nearest
+    usart_->CR1 |= UE;
+    return true;
 }
 
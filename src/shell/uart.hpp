@@ -4,6 +4,7 @@
 // Contact: toshi.hondo@qtplatz.com
 //
 
+#include "spsc_ring.hpp"
 #include <atomic>
 #include <cstdint>
 #include <cstddef>
@@ -16,6 +17,13 @@ namespace stm32f103 {
     class uart {
         volatile USART * usart_;
         uint32_t baud_;
+        uint32_t pclk_;
+
+        // raw mode: interrupt driven, binary clean byte streams instead of the console's line input
+        std::atomic< bool > raw_;
+        spsc_ring< uint8_t, 256 > rx_;          // rx isr -> thread
+        spsc_ring< uint8_t, 1024 > tx_;         // thread -> TXE isr
+        std::atomic< uint32_t > rx_overrun_;    // ring full or ORE
 
         uart( const uart& ) = delete;
         uart& operator = ( const uart& ) = delete;
@@ -35,6 +43,18 @@ namespace stm32f103 {
 
         void handle_interrupt();
 
+        // raw byte streams for protocol gateways; the console getc/gets sees nothing while raw.
+        // write() queues what fits and returns at once, read() returns what has arrived.
+        void set_raw( bool );
+        inline bool raw() const { return raw_; }
+        size_t write( const uint8_t * data, size_t size );
+        size_t read( uint8_t * data, size_t size );
+        inline size_t tx_free() const { return tx_.capacity() - tx_.size(); }
+        bool flush( uint32_t timeout_us = 100000 );
+        inline uint32_t rx_overrun() const { return rx_overrun_.load(); }
+        bool set_baud( uint32_t baud );
+        inline uint32_t baud() const { return baud_; }
+
         // printf & console interface
         static int getc();
         static size_t gets( char * p, size_t size );